@@ -0,0 +1,1145 @@
+
+#include <assert.h>
+#include <math.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#include "util.h"
+#include "bios.h"
+#include "tinyoslib.h"
+#include "unit_testing.h"
+
+
+/*
+ *
+ *   KERNEL BENCHMARKS
+ *
+ *   Each benchmark boots the VM several times, with a different
+ *   number of cores, and reports the measured rate. The benchmarks
+ *   do not fail on poor numbers, because the results depend on the
+ *   host machine (e.g., on the number of physical cores).
+ *
+ *   Run them as
+ *     ./benchmarks
+ *   or select one, e.g.,
+ *     ./benchmarks bench_context_switch
+ *
+ */
+
+
+static void mark_time(struct timeval* t)
+{
+	CHECK(gettimeofday(t, NULL));
+}
+
+static double time_since(struct timeval* t0)
+{
+	struct timeval t1;
+	mark_time(&t1);
+
+	return ((double)(t1.tv_sec-t0->tv_sec)) + 1E-6* (t1.tv_usec - t0->tv_usec);
+}
+
+
+/* The core counts used by the scaling benchmarks */
+static const uint bench_cores[] = { 1, 2, 4, 8, 16 };
+#define BENCH_CORE_COUNTS (sizeof(bench_cores)/sizeof(uint))
+
+
+
+/*
+	bench_context_switch
+
+	A number of process pairs play ping-pong over a condition variable.
+	Each round trip blocks one player and wakes up the other, so that
+	every move costs a context switch. Also, report the fraction of
+	switches where the player moved to another core.
+ */
+
+#define PINGPONG_PAIRS 16
+#define PINGPONG_ROUNDS 2000
+
+typedef struct pingpong_table {
+	Mutex mx;
+	CondVar cv;
+	int turn;
+} pingpong_table;
+
+typedef struct pingpong_player {
+	pingpong_table* table;
+	int me;
+} pingpong_player;
+
+static pingpong_table pingpong_tables[PINGPONG_PAIRS];
+static unsigned long pingpong_migrations;
+
+/* Return the migrations of the current process, from the info stream */
+static unsigned long get_migrations()
+{
+	Pid_t me = GetPid();
+	procinfo info;
+	unsigned long migrations = 0;
+
+	Fid_t finfo = OpenInfo();
+	while(Read(finfo, (char*) &info, sizeof(info)) > 0)
+		if(info.pid == me) { migrations = info.migrations; break; }
+	Close(finfo);
+	return migrations;
+}
+
+static int pingpong_play(int argl, void* args)
+{
+	assert(argl==sizeof(pingpong_player));
+	pingpong_player* p = args;
+	pingpong_table* t = p->table;
+
+	for(int i=0; i<PINGPONG_ROUNDS; i++) {
+		Mutex_Lock(& t->mx);
+		while(t->turn != p->me)
+			Cond_Wait(& t->mx, & t->cv);
+		t->turn = 1 - p->me;
+		Cond_Signal(& t->cv);
+		Mutex_Unlock(& t->mx);
+	}
+
+	__atomic_fetch_add(& pingpong_migrations, get_migrations(), __ATOMIC_RELAXED);
+	return 0;
+}
+
+static double pingpong_time;
+
+static int pingpong_boot(int argl, void* args)
+{
+	struct timeval t0;
+	mark_time(&t0);
+	pingpong_migrations = 0;
+
+	for(int i=0; i<PINGPONG_PAIRS; i++) {
+		pingpong_tables[i] = (pingpong_table){ MUTEX_INIT, COND_INIT, 0 };
+		for(int j=0; j<2; j++) {
+			pingpong_player p = { & pingpong_tables[i], j };
+			Exec(pingpong_play, sizeof(p), &p);
+		}
+	}
+
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	pingpong_time = time_since(&t0);
+	return 0;
+}
+
+BARE_TEST(bench_context_switch,
+	"Report the context-switch throughput of a ping-pong workload\n"
+	"as the number of cores increases.",
+	.timeout = 120
+	)
+{
+	for(int i=0; i<BENCH_CORE_COUNTS; i++) {
+		boot(bench_cores[i], 0, pingpong_boot, 0, NULL);
+		double switches = 2.0 * PINGPONG_PAIRS * PINGPONG_ROUNDS;
+		MSG("cores=%2u  %10.0f switches/sec  %6.2f%% migrated\n", bench_cores[i], 
+			switches/pingpong_time, 100.0*pingpong_migrations/switches);
+	}
+}
+
+
+/*
+	bench_idle_wakeup
+
+	Two threads, pinned to different cores, play ping-pong. Each move 
+	makes the mover's core idle and wakes up a thread on the other core, 
+	which is idle too. Report the time per move, and how the idle cores 
+	noticed their work: by polling, or after halting.
+ */
+
+#define IDLE_WAKEUP_ROUNDS 2000
+
+static pingpong_table idle_table;
+
+static int idle_wakeup_play(int argl, void* args)
+{
+	int me = argl;
+	SetThreadAffinity(ThreadSelf(), 1u << me);
+
+	for(int i=0; i<IDLE_WAKEUP_ROUNDS; i++) {
+		Mutex_Lock(& idle_table.mx);
+		while(idle_table.turn != me)
+			Cond_Wait(& idle_table.mx, & idle_table.cv);
+		idle_table.turn = 1 - me;
+		Cond_Signal(& idle_table.cv);
+		Mutex_Unlock(& idle_table.mx);
+	}
+	return 0;
+}
+
+static double idle_wakeup_time;
+static coreinfo idle_wakeup_info;
+
+static int idle_wakeup_boot(int argl, void* args)
+{
+	struct timeval t0;
+	coreinfo info;
+
+	idle_table = (pingpong_table){ MUTEX_INIT, COND_INIT, 0 };
+	mark_time(&t0);
+	Tid_t t1 = CreateThread(idle_wakeup_play, 0, NULL);
+	Tid_t t2 = CreateThread(idle_wakeup_play, 1, NULL);
+	ThreadJoin(t1, NULL);
+	ThreadJoin(t2, NULL);
+	idle_wakeup_time = time_since(&t0);
+
+	/* Sum up the two cores of the players */
+	idle_wakeup_info = (coreinfo){ 0 };
+	Fid_t fid = OpenCoreInfo();
+	while(Read(fid, (char*) &info, sizeof(info)) > 0 && info.core < 2) {
+		idle_wakeup_info.idle_halts += info.idle_halts;
+		idle_wakeup_info.idle_spin_hits += info.idle_spin_hits;
+		idle_wakeup_info.idle_wakeups += info.idle_wakeups;
+		idle_wakeup_info.idle_latency += info.idle_latency;
+		if(info.idle_latency_max > idle_wakeup_info.idle_latency_max)
+			idle_wakeup_info.idle_latency_max = info.idle_latency_max;
+	}
+	Close(fid);
+	return 0;
+}
+
+BARE_TEST(bench_idle_wakeup,
+	"Report the latency of waking up threads on idle cores, in a\n"
+	"ping-pong between two cores.",
+	.timeout = 120
+	)
+{
+	for(int i=1; i<BENCH_CORE_COUNTS; i++) {
+		boot(bench_cores[i], 0, idle_wakeup_boot, 0, NULL);
+		coreinfo* ci = & idle_wakeup_info;
+		MSG("cores=%2u  %6.1f us/move  latency avg %6.1f us  max %6lu us  polled %5lu  halted %5lu\n",
+			bench_cores[i], 1E6*idle_wakeup_time/(2.0*IDLE_WAKEUP_ROUNDS),
+			ci->idle_wakeups ? (double) ci->idle_latency / ci->idle_wakeups : 0.0,
+			ci->idle_latency_max, ci->idle_spin_hits, ci->idle_halts);
+	}
+}
+
+
+/*
+	bench_broadcast
+
+	A thread broadcasts on a CondVar where many threads wait, and waits
+	until all of them have woken up and re-acquired the mutex; then it
+	repeats. Report the time per broadcast round, with a Mutex and with
+	a PIMutex, where all waiters wake up and contend for the mutex, and 
+	with a PIMutex and Cond_BroadcastPI, which hands the mutex to the 
+	waiters one at a time.
+ */
+
+#define BROADCAST_WAITERS 200
+#define BROADCAST_ROUNDS 200
+
+static Mutex bc_mx = MUTEX_INIT;
+static PIMutex bc_pimx = PIMUTEX_INIT;
+static int bc_pi;		/* 0: Mutex, 1: PIMutex, 2: PIMutex and Cond_BroadcastPI */
+static CondVar bc_go = COND_INIT;
+static CondVar bc_done = COND_INIT;
+static int bc_round, bc_arrived;
+
+static void bc_lock() 
+{ 
+	if(bc_pi) PIMutex_Lock(& bc_pimx); else Mutex_Lock(& bc_mx); 
+}
+
+static void bc_unlock() 
+{ 
+	if(bc_pi) PIMutex_Unlock(& bc_pimx); else Mutex_Unlock(& bc_mx); 
+}
+
+static void bc_wait(CondVar* cv) 
+{ 
+	if(bc_pi) Cond_WaitPI(& bc_pimx, cv); else Cond_Wait(& bc_mx, cv); 
+}
+
+static int broadcast_waiter(int argl, void* args)
+{
+	bc_lock();
+	for(int r=1; r<=BROADCAST_ROUNDS; r++) {
+		bc_arrived++;
+		if(bc_arrived == BROADCAST_WAITERS) Cond_Signal(& bc_done);
+		while(bc_round < r)
+			bc_wait(& bc_go);
+	}
+	bc_unlock();
+	return 0;
+}
+
+static double broadcast_time;
+
+static int broadcast_boot(int argl, void* args)
+{
+	struct timeval t0;
+	Tid_t tids[BROADCAST_WAITERS];
+
+	bc_round = bc_arrived = 0;
+	for(int i=0; i<BROADCAST_WAITERS; i++)
+		tids[i] = CreateThread(broadcast_waiter, 0, NULL);
+
+	mark_time(&t0);
+	bc_lock();
+	for(int r=1; r<=BROADCAST_ROUNDS; r++) {
+		while(bc_arrived < BROADCAST_WAITERS)
+			bc_wait(& bc_done);
+		bc_arrived = 0;
+		bc_round = r;
+		if(bc_pi == 2) Cond_BroadcastPI(& bc_pimx, & bc_go); else Cond_Broadcast(& bc_go);
+	}
+	bc_unlock();
+
+	for(int i=0; i<BROADCAST_WAITERS; i++)
+		ThreadJoin(tids[i], NULL);
+	broadcast_time = time_since(&t0);
+	return 0;
+}
+
+BARE_TEST(bench_broadcast,
+	"Report the time to wake up many threads waiting on a CondVar\n"
+	"with Cond_Broadcast, as the number of cores increases.",
+	.timeout = 120
+	)
+{
+	MSG("%d waiters, us/broadcast:   Mutex   PIMutex   morphing\n", BROADCAST_WAITERS);
+	for(int i=0; i<BENCH_CORE_COUNTS; i++) {
+		double t[3];
+		for(bc_pi = 0; bc_pi < 3; bc_pi++) {
+			boot(bench_cores[i], 0, broadcast_boot, 0, NULL);
+			t[bc_pi] = 1E6*broadcast_time/BROADCAST_ROUNDS;
+		}
+		MSG("cores=%2u                   %8.1f  %8.1f   %8.1f\n", bench_cores[i], t[0], t[1], t[2]);
+	}
+}
+
+
+/*
+	bench_mutex_contention
+
+	Several threads repeatedly lock a Mutex, do a short critical section,
+	unlock it and do some work outside. Report the acquisitions per ms, 
+	and the fairness, as the smallest and largest number of acquisitions
+	by a thread, relative to the average.
+ */
+
+#define MUTEX_THREADS 8
+#define MUTEX_ACQUISITIONS 1000000
+
+static Mutex mc_mx = MUTEX_INIT;
+static unsigned long mc_total;
+static unsigned long mc_count[MUTEX_THREADS];
+
+static int mutex_contender(int argl, void* args)
+{
+	volatile unsigned long work = 0;
+	for(;;) {
+		Mutex_Lock(& mc_mx);
+		if(mc_total == MUTEX_ACQUISITIONS) {
+			Mutex_Unlock(& mc_mx);
+			break;
+		}
+		mc_total++;
+		mc_count[argl]++;
+		for(int i=0; i<20; i++) work++;
+		Mutex_Unlock(& mc_mx);
+		for(int i=0; i<100; i++) work++;
+	}
+	return 0;
+}
+
+static double mutex_time;
+
+static int mutex_contention_boot(int argl, void* args)
+{
+	struct timeval t0;
+	Tid_t tids[MUTEX_THREADS];
+
+	mc_total = 0;
+	for(int i=0; i<MUTEX_THREADS; i++) mc_count[i] = 0;
+
+	mark_time(&t0);
+	for(int i=0; i<MUTEX_THREADS; i++)
+		tids[i] = CreateThread(mutex_contender, i, NULL);
+	for(int i=0; i<MUTEX_THREADS; i++)
+		ThreadJoin(tids[i], NULL);
+	mutex_time = time_since(&t0);
+	return 0;
+}
+
+BARE_TEST(bench_mutex_contention,
+	"Report the throughput and fairness of a contended Mutex, as the\n"
+	"number of cores increases.",
+	.timeout = 120
+	)
+{
+	MSG("%d threads:  acquisitions/ms   min/avg   max/avg\n", MUTEX_THREADS);
+	for(int i=0; i<BENCH_CORE_COUNTS; i++) {
+		boot(bench_cores[i], 0, mutex_contention_boot, 0, NULL);
+		unsigned long min = mc_count[0], max = mc_count[0];
+		for(int t=1; t<MUTEX_THREADS; t++) {
+			if(mc_count[t] < min) min = mc_count[t];
+			if(mc_count[t] > max) max = mc_count[t];
+		}
+		double avg = (double) MUTEX_ACQUISITIONS / MUTEX_THREADS;
+		MSG("cores=%2u   %12.1f   %7.2f   %7.2f\n", bench_cores[i], 
+			MUTEX_ACQUISITIONS/(1E3*mutex_time), min/avg, max/avg);
+	}
+}
+
+
+/*
+	bench_syscall_throughput
+
+	One process per core makes I/O system calls on its own streams: it 
+	writes to and reads back from a private pipe, and writes to a null
+	stream. Since the processes share no kernel objects, their system 
+	calls may run in parallel. Report the total system calls per ms.
+ */
+
+#define SYSCALL_ROUNDS 20000
+#define SYSCALL_MSG 64
+
+static int syscall_worker(int argl, void* args)
+{
+	char buf[SYSCALL_MSG] = { 0 };
+	pipe_t p;
+	ASSERT(Pipe(&p) == 0);
+	Fid_t null = OpenNull();
+	ASSERT(null != NOFILE);
+
+	for(int r=0; r<SYSCALL_ROUNDS; r++) {
+		Write(p.write, buf, SYSCALL_MSG);
+		Read(p.read, buf, SYSCALL_MSG);
+		Write(null, buf, SYSCALL_MSG);
+	}
+
+	Close(p.read);
+	Close(p.write);
+	Close(null);
+	return 0;
+}
+
+static double syscall_time;
+
+static int syscall_throughput_boot(int argl, void* args)
+{
+	struct timeval t0;
+
+	mark_time(&t0);
+	for(int i=0; i<argl; i++)
+		Exec(syscall_worker, 0, NULL);
+	while(WaitChild(NOPROC, NULL) != NOPROC);
+	syscall_time = time_since(&t0);
+	return 0;
+}
+
+BARE_TEST(bench_syscall_throughput,
+	"Report the throughput of independent system calls, made by one\n"
+	"process per core, as the number of cores increases.",
+	.timeout = 120
+	)
+{
+	for(int i=0; i<BENCH_CORE_COUNTS; i++) {
+		uint n = bench_cores[i];
+		boot(n, 0, syscall_throughput_boot, n, NULL);
+		MSG("cores=%2u  %10.1f syscalls/ms\n", n, 3.0*n*SYSCALL_ROUNDS/(1E3*syscall_time));
+	}
+}
+
+
+/*
+	bench_readonly_syscalls
+
+	One thread per core calls the read-only system calls (GetPid, 
+	GetPPid, ThreadSelf and GetTerminalDevices) in a tight loop. These
+	take no lock, so the total rate should grow with the number of
+	cores (given enough host cores). Report the total calls per ms.
+ */
+
+#define READONLY_ROUNDS 200000
+
+static int readonly_worker(int argl, void* args)
+{
+	volatile unsigned long sum = 0;
+	for(int r=0; r<READONLY_ROUNDS; r++)
+		sum += GetPid() + GetPPid() + ThreadSelf() + GetTerminalDevices();
+	return 0;
+}
+
+static double readonly_time;
+
+static int readonly_syscalls_boot(int argl, void* args)
+{
+	struct timeval t0;
+	Tid_t tids[MAX_CORES];
+
+	mark_time(&t0);
+	for(int i=0; i<argl; i++)
+		tids[i] = CreateThread(readonly_worker, 0, NULL);
+	for(int i=0; i<argl; i++)
+		ThreadJoin(tids[i], NULL);
+	readonly_time = time_since(&t0);
+	return 0;
+}
+
+BARE_TEST(bench_readonly_syscalls,
+	"Report the throughput of read-only system calls, made by one\n"
+	"thread per core, as the number of cores increases.",
+	.timeout = 120
+	)
+{
+	for(int i=0; i<BENCH_CORE_COUNTS; i++) {
+		uint n = bench_cores[i];
+		boot(n, 0, readonly_syscalls_boot, n, NULL);
+		MSG("cores=%2u  %10.1f calls/ms\n", n, 4.0*n*READONLY_ROUNDS/(1E3*readonly_time));
+	}
+}
+
+
+/*
+	bench_syscall_batch
+
+	A thread writes 8 bytes into a pipe and reads them back, first
+	with one system call at a time, and then with SyscallBatch, for
+	different batch sizes. Report the cost of each call, in ns.
+ */
+
+#define BATCH_CALLS  400000
+#define BATCH_MAX  64
+
+static const uint batch_sizes[] = { 2, 8, 32, 64 };
+#define BATCH_SIZES (sizeof(batch_sizes)/sizeof(batch_sizes[0]))
+
+static double batch_time[BATCH_SIZES+1];
+
+static int syscall_batch_boot(int argl, void* args)
+{
+	struct timeval t0;
+	pipe_t pipe;
+	char buf[8];
+	syscall_desc batch[BATCH_MAX];
+
+	ASSERT(Pipe(&pipe)==0);
+
+	/* Without batching */
+	mark_time(&t0);
+	for(int i=0; i<BATCH_CALLS; i+=2) {
+		Write(pipe.write, "01234567", 8);
+		Read(pipe.read, buf, 8);
+	}
+	batch_time[0] = time_since(&t0);
+
+	for(uint b=0; b<BATCH_SIZES; b++) {
+		uint size = batch_sizes[b];
+		for(uint j=0; j<size; j+=2) {
+			batch[j] = (syscall_desc){ .call = Write, .args = { pipe.write, (intptr_t) "01234567", 8 } };
+			batch[j+1] = (syscall_desc){ .call = Read, .args = { pipe.read, (intptr_t) buf, 8 } };
+		}
+		mark_time(&t0);
+		for(int i=0; i<BATCH_CALLS; i+=size)
+			SyscallBatch(batch, size);
+		batch_time[b+1] = time_since(&t0);
+	}
+	return 0;
+}
+
+BARE_TEST(bench_syscall_batch,
+	"Report the cost of small pipe Reads and Writes, made one at a time,\n"
+	"and in batches of different sizes by SyscallBatch.",
+	.timeout = 120
+	)
+{
+	boot(1, 0, syscall_batch_boot, 0, NULL);
+	MSG("unbatched   %8.1f ns/call\n", 1E9*batch_time[0]/BATCH_CALLS);
+	for(uint b=0; b<BATCH_SIZES; b++)
+		MSG("batch=%-4u  %8.1f ns/call\n", batch_sizes[b], 1E9*batch_time[b+1]/BATCH_CALLS);
+}
+
+
+/*
+	bench_ioring
+
+	Producer threads write 64-byte messages into IORING_PIPES pipes. The
+	messages are consumed either by one reader thread per pipe, blocking
+	in Read, or by a single thread that keeps a read in flight on every
+	pipe, through the asynchronous I/O rings. Report the messages per ms.
+ */
+
+#define IORING_PIPES  6
+#define IORING_MSGS  20000
+#define IORING_MSG_SIZE  64
+
+static pipe_t ioring_pipe[IORING_PIPES];
+static double ioring_time[2][BENCH_CORE_COUNTS];
+
+static int ioring_producer(int argl, void* args)
+{
+	char msg[IORING_MSG_SIZE] = { 0 };
+	for(int i=0; i<IORING_MSGS; i++)
+		Write(ioring_pipe[argl].write, msg, IORING_MSG_SIZE);
+	Close(ioring_pipe[argl].write);
+	return 0;
+}
+
+static int ioring_blocking_reader(int argl, void* args)
+{
+	char buf[IORING_MSG_SIZE];
+	while(Read(ioring_pipe[argl].read, buf, IORING_MSG_SIZE) > 0);
+	return 0;
+}
+
+static int ioring_reactor(int argl, void* args)
+{
+	char buf[IORING_PIPES][IORING_MSG_SIZE];
+	io_ring* ring = IoRingSetup(IORING_PIPES);
+	assert(ring != NULL);
+
+	for(int p=0; p<IORING_PIPES; p++)
+		IoQueue(ring, IO_READ, ioring_pipe[p].read, buf[p], IORING_MSG_SIZE, p);
+
+	int open = IORING_PIPES;
+	while(open > 0) {
+		IoRingEnter(1, -1);
+		io_cqe cqe;
+		while(IoReap(ring, &cqe)) {
+			int p = cqe.user_data;
+			if(cqe.res > 0)
+				IoQueue(ring, IO_READ, ioring_pipe[p].read, buf[p], IORING_MSG_SIZE, p);
+			else
+				open--;
+		}
+	}
+	return 0;
+}
+
+static int ioring_boot(int argl, void* args)
+{
+	int mode = argl / BENCH_CORE_COUNTS;
+	struct timeval t0;
+	Tid_t tids[2*IORING_PIPES];
+	int n = 0;
+
+	for(int p=0; p<IORING_PIPES; p++)
+		ASSERT(Pipe(&ioring_pipe[p])==0);
+
+	mark_time(&t0);
+	for(int p=0; p<IORING_PIPES; p++)
+		tids[n++] = CreateThread(ioring_producer, p, NULL);
+	if(mode==0)
+		for(int p=0; p<IORING_PIPES; p++)
+			tids[n++] = CreateThread(ioring_blocking_reader, p, NULL);
+	else
+		tids[n++] = CreateThread(ioring_reactor, 0, NULL);
+	for(int i=0; i<n; i++)
+		ThreadJoin(tids[i], NULL);
+	ioring_time[mode][argl % BENCH_CORE_COUNTS] = time_since(&t0);
+	return 0;
+}
+
+BARE_TEST(bench_ioring,
+	"Report the throughput of reading from many pipes, with one blocking\n"
+	"thread per pipe, and with one thread using the asynchronous I/O rings.",
+	.timeout = 120
+	)
+{
+	for(int i=0; i<BENCH_CORE_COUNTS; i++) {
+		uint n = bench_cores[i];
+		boot(n, 0, ioring_boot, i, NULL);
+		boot(n, 0, ioring_boot, BENCH_CORE_COUNTS + i, NULL);
+		MSG("cores=%2u  threads: %8.1f msgs/ms   rings: %8.1f msgs/ms\n", n, 
+			IORING_PIPES*IORING_MSGS/(1E3*ioring_time[0][i]),
+			IORING_PIPES*IORING_MSGS/(1E3*ioring_time[1][i]));
+	}
+}
+
+
+/*
+	bench_futex_lock
+
+	As bench_mutex_contention, but with a lock built by the program on a
+	futex, which enters the kernel only to sleep and to wake up a sleeper.
+	Report the acquisitions per ms.
+ */
+
+static int fl_lock = 0;   /* 0 free, 1 locked, 2 locked with waiters */
+
+static void futex_lock()
+{
+	int c = 0;
+	if(__atomic_compare_exchange_n(&fl_lock, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	if(c != 2) c = __atomic_exchange_n(&fl_lock, 2, __ATOMIC_ACQUIRE);
+	while(c != 0) {
+		FutexWait(&fl_lock, 2, -1);
+		c = __atomic_exchange_n(&fl_lock, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static void futex_unlock()
+{
+	if(__atomic_fetch_sub(&fl_lock, 1, __ATOMIC_RELEASE) != 1) {
+		__atomic_store_n(&fl_lock, 0, __ATOMIC_RELEASE);
+		FutexWake(&fl_lock, 1);
+	}
+}
+
+static int futex_contender(int argl, void* args)
+{
+	volatile unsigned long work = 0;
+	for(;;) {
+		futex_lock();
+		if(mc_total == MUTEX_ACQUISITIONS) {
+			futex_unlock();
+			break;
+		}
+		mc_total++;
+		for(int i=0; i<20; i++) work++;
+		futex_unlock();
+		for(int i=0; i<100; i++) work++;
+	}
+	return 0;
+}
+
+static int futex_lock_boot(int argl, void* args)
+{
+	struct timeval t0;
+	Tid_t tids[MUTEX_THREADS];
+
+	mc_total = 0;
+	mark_time(&t0);
+	for(int i=0; i<MUTEX_THREADS; i++)
+		tids[i] = CreateThread(futex_contender, i, NULL);
+	for(int i=0; i<MUTEX_THREADS; i++)
+		ThreadJoin(tids[i], NULL);
+	mutex_time = time_since(&t0);
+	return 0;
+}
+
+BARE_TEST(bench_futex_lock,
+	"Report the throughput of a contended lock built on a futex, as the\n"
+	"number of cores increases.",
+	.timeout = 120
+	)
+{
+	MSG("%d threads:  acquisitions/ms\n", MUTEX_THREADS);
+	for(int i=0; i<BENCH_CORE_COUNTS; i++) {
+		boot(bench_cores[i], 0, futex_lock_boot, 0, NULL);
+		MSG("cores=%2u   %12.1f\n", bench_cores[i], MUTEX_ACQUISITIONS/(1E3*mutex_time));
+	}
+}
+
+
+/*
+	bench_timed_waiters
+
+	Many processes sleep concurrently in Cond_TimedWait, so that the
+	scheduler holds them all in its timeout structure. In the first 
+	round, the sleepers are woken up by a broadcast long before their 
+	timeouts expire; in the second round, they all time out, at times
+	spread over a short interval.
+ */
+
+#ifndef TIMED_WAITERS
+#define TIMED_WAITERS 10000
+#endif
+
+static Mutex tw_mx = MUTEX_INIT;
+static CondVar tw_cv = COND_INIT;
+static CondVar tw_all_asleep = COND_INIT;
+static int tw_asleep;
+
+static int timed_waiter(int argl, void* args)
+{
+	assert(argl==sizeof(timeout_t));
+	timeout_t timeout = * (timeout_t*) args;
+
+	Mutex_Lock(& tw_mx);
+	if(++tw_asleep == TIMED_WAITERS)
+		Cond_Signal(& tw_all_asleep);
+	Cond_TimedWait(& tw_mx, & tw_cv, timeout);
+	Mutex_Unlock(& tw_mx);
+	return 0;
+}
+
+static double tw_sleep_time, tw_wake_time;
+
+/* If argl is nonzero, wake up the waiters by broadcast */
+static int timed_waiters_boot(int argl, void* args)
+{
+	struct timeval t0;
+	mark_time(&t0);
+	tw_asleep = 0;
+
+	for(int i=0; i<TIMED_WAITERS; i++) {
+		/* Broadcast wakeups happen well before 60 sec; else, spread over 0.1-0.5 sec */
+		timeout_t timeout = argl ? 60000 : 100 + (i*7919) % 400;
+		Exec(timed_waiter, sizeof(timeout), &timeout);
+	}
+
+	Mutex_Lock(& tw_mx);
+	while(tw_asleep < TIMED_WAITERS)
+		Cond_Wait(& tw_mx, & tw_all_asleep);
+	tw_sleep_time = time_since(&t0);
+
+	mark_time(&t0);
+	if(argl) Cond_Broadcast(& tw_cv);
+	Mutex_Unlock(& tw_mx);
+
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	tw_wake_time = time_since(&t0);
+	return 0;
+}
+
+BARE_TEST(bench_timed_waiters,
+	"Report the time to put to sleep and wake up many threads\n"
+	"with a timeout, by broadcast and by timeout expiration.",
+	.timeout = 300
+	)
+{
+	for(int i=0; i<BENCH_CORE_COUNTS; i++) {
+		boot(bench_cores[i], 0, timed_waiters_boot, 1, NULL);
+		MSG("cores=%2u  broadcast: sleep %7.1f ms  wakeup %7.1f ms\n", 
+			bench_cores[i], 1E3*tw_sleep_time, 1E3*tw_wake_time);
+		boot(bench_cores[i], 0, timed_waiters_boot, 0, NULL);
+		MSG("cores=%2u  expire:    sleep %7.1f ms  wakeup %7.1f ms (ideal < 500 ms)\n", 
+			bench_cores[i], 1E3*tw_sleep_time, 1E3*tw_wake_time);
+	}
+}
+
+
+/*
+	bench_thread_create_join
+
+	A process repeatedly creates a batch of short threads and joins them.
+	This measures the cost of thread creation and exit.
+ */
+
+#define CREATE_JOIN_BATCH 16
+#define CREATE_JOIN_ROUNDS 1000
+
+static int empty_thread(int argl, void* args)
+{
+	return argl;
+}
+
+static double create_join_time;
+
+static int create_join_boot(int argl, void* args)
+{
+	struct timeval t0;
+	mark_time(&t0);
+
+	for(int r=0; r<CREATE_JOIN_ROUNDS; r++) {
+		Tid_t tids[CREATE_JOIN_BATCH];
+		for(int i=0; i<CREATE_JOIN_BATCH; i++)
+			tids[i] = CreateThread(empty_thread, i, NULL);
+		for(int i=0; i<CREATE_JOIN_BATCH; i++)
+			ThreadJoin(tids[i], NULL);
+	}
+
+	create_join_time = time_since(&t0);
+	return 0;
+}
+
+BARE_TEST(bench_thread_create_join,
+	"Report the rate of CreateThread/ThreadJoin pairs\n"
+	"as the number of cores increases.",
+	.timeout = 120
+	)
+{
+	for(int i=0; i<BENCH_CORE_COUNTS; i++) {
+		boot(bench_cores[i], 0, create_join_boot, 0, NULL);
+		double pairs = 1.0 * CREATE_JOIN_BATCH * CREATE_JOIN_ROUNDS;
+		MSG("cores=%2u  %10.0f create/join pairs/sec\n", bench_cores[i], pairs/create_join_time);
+	}
+}
+
+
+/*
+	bench_thread_burst
+
+	A thread creates a burst of CPU-bound threads, which are all queued
+	on its own core, and joins them. The other cores get work by stealing
+	and by load balancing. Report the elapsed time, the utilisation of
+	the cores over the burst, and the threads moved by the balancer.
+ */
+
+#define BURST_THREADS 64
+#define BURST_WORK 2000000
+
+static int burst_work(int argl, void* args)
+{
+	for(volatile long i=0; i<BURST_WORK; i++);
+	return 0;
+}
+
+static double burst_time, burst_busy;
+static unsigned long burst_balanced, burst_steals;
+
+static int thread_burst_boot(int argl, void* args)
+{
+	struct timeval t0;
+	coreinfo info;
+	unsigned long busy0 = 0;
+
+	Fid_t fid = OpenCoreInfo();
+	while(Read(fid, (char*) &info, sizeof(info)) > 0) busy0 += info.busy_time;
+	Close(fid);
+
+	mark_time(&t0);
+	Tid_t tids[BURST_THREADS];
+	for(int i=0; i<BURST_THREADS; i++)
+		tids[i] = CreateThread(burst_work, 0, NULL);
+	for(int i=0; i<BURST_THREADS; i++)
+		ThreadJoin(tids[i], NULL);
+	burst_time = time_since(&t0);
+
+	unsigned long busy = 0;
+	burst_balanced = burst_steals = 0;
+	fid = OpenCoreInfo();
+	while(Read(fid, (char*) &info, sizeof(info)) > 0) {
+		busy += info.busy_time;
+		burst_balanced += info.balanced;
+		burst_steals += info.steals;
+	}
+	Close(fid);
+	burst_busy = 1E-6 * (busy - busy0);
+	return 0;
+}
+
+BARE_TEST(bench_thread_burst,
+	"Report the time and core utilisation of a burst of CPU-bound\n"
+	"threads created on one core, as the number of cores increases.",
+	.timeout = 300
+	)
+{
+	for(int i=0; i<BENCH_CORE_COUNTS; i++) {
+		boot(bench_cores[i], 0, thread_burst_boot, 0, NULL);
+		MSG("cores=%2u  %7.1f ms  utilisation %5.1f%%  balanced %4lu  stolen %4lu\n",
+			bench_cores[i], 1E3*burst_time, 100.0*burst_busy/(bench_cores[i]*burst_time),
+			burst_balanced, burst_steals);
+	}
+}
+
+
+/*
+	bench_swap_context
+
+	Two contexts on the host thread switch back and forth, without the
+	kernel. This measures the raw cost of cpu_swap_context (the hand-written
+	switch when built with ASM_CONTEXT=1), and of glibc swapcontext for
+	comparison.
+ */
+
+#define SWAP_ROUNDS 1000000
+
+static cpu_context_t swap_main, swap_peer;
+
+static void swap_peer_loop()
+{
+	for(;;) cpu_swap_context(& swap_peer, & swap_main);
+}
+
+static ucontext_t uswap_main, uswap_peer;
+
+static void uswap_peer_loop()
+{
+	for(;;) swapcontext(& uswap_peer, & uswap_main);
+}
+
+BARE_TEST(bench_swap_context,
+	"Report the time per context switch of cpu_swap_context and of\n"
+	"swapcontext, in a ping-pong between two contexts."
+	)
+{
+	size_t stack_size = 64*1024;
+	void* stack = xmalloc(stack_size);
+	struct timeval t0;
+
+	cpu_initialize_context(& swap_peer, stack, stack_size, swap_peer_loop);
+	mark_time(&t0);
+	for(int i=0; i<SWAP_ROUNDS; i++)
+		cpu_swap_context(& swap_main, & swap_peer);
+	double tcpu = time_since(&t0);
+
+	getcontext(& uswap_peer);
+	uswap_peer.uc_link = NULL;
+	uswap_peer.uc_stack.ss_sp = stack;
+	uswap_peer.uc_stack.ss_size = stack_size;
+	uswap_peer.uc_stack.ss_flags = 0;
+	makecontext(& uswap_peer, uswap_peer_loop, 0);
+	mark_time(&t0);
+	for(int i=0; i<SWAP_ROUNDS; i++)
+		swapcontext(& uswap_main, & uswap_peer);
+	double tuc = time_since(&t0);
+
+	free(stack);
+
+#ifdef BIOS_ASM_CONTEXT
+	const char* impl = "asm";
+#else
+	const char* impl = "ucontext";
+#endif
+	MSG("cpu_swap_context (%s): %6.1f ns/switch\n", impl, 1E9*tcpu/(2.0*SWAP_ROUNDS));
+	MSG("swapcontext:              %6.1f ns/switch\n", 1E9*tuc/(2.0*SWAP_ROUNDS));
+}
+
+
+/*
+	bench_fair_share
+
+	A few CPU-bound processes, with different nice values and numbers of
+	threads, share one core. Each thread counts its iterations in the
+	counter of its process. The share of each process, measured over
+	increasing intervals, should converge to its share of the total
+	weight (see SetNice), regardless of its number of threads.
+ */
+
+typedef struct fair_proc {
+	int nice;
+	int threads;
+	const char* label;
+} fair_proc;
+
+static const fair_proc fair_procs[] = {
+	{  0, 1, "nice  0 x1" },
+	{  0, 8, "nice  0 x8" },
+	{  5, 1, "nice  5 x1" },
+	{ -5, 1, "nice -5 x1" },
+};
+#define FAIR_PROCS (sizeof(fair_procs)/sizeof(fair_proc))
+
+/* Measurement points, in msec after the start */
+static const timeout_t fair_points[] = { 100, 250, 500, 1000, 2000, 4000 };
+#define FAIR_POINTS (sizeof(fair_points)/sizeof(timeout_t))
+
+/* The weights of SetNice, for the nice values used above */
+static double fair_weight(int nice)
+{
+	switch(nice) {
+		case -5: return 3121;
+		case 0: return 1024;
+		case 5: return 335;
+	}
+	assert(0);
+	return 0;
+}
+
+static unsigned long fair_counts[FAIR_PROCS];
+static unsigned long fair_samples[FAIR_POINTS][FAIR_PROCS];
+static volatile int fair_stop;
+
+static int fair_spin(int argl, void* args)
+{
+	unsigned long* counter = args;
+	while(! fair_stop) {
+		for(volatile int i=0; i<1000; i++);
+		__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+static int fair_worker(int argl, void* args)
+{
+	assert(argl==sizeof(int));
+	int p = * (int*) args;
+	Tid_t tids[fair_procs[p].threads];
+
+	SetNice(GetPid(), fair_procs[p].nice);
+	for(int i=1; i<fair_procs[p].threads; i++)
+		tids[i] = CreateThread(fair_spin, 0, & fair_counts[p]);
+	fair_spin(0, & fair_counts[p]);
+	for(int i=1; i<fair_procs[p].threads; i++)
+		ThreadJoin(tids[i], NULL);
+	return 0;
+}
+
+static int fair_share_boot(int argl, void* args)
+{
+	/* Stay above the workers, to take the samples in time */
+	SetPriority(ThreadSelf(), THREAD_PRIORITIES-1);
+
+	fair_stop = 0;
+	for(int p=0; p<FAIR_PROCS; p++) {
+		fair_counts[p] = 0;
+		Exec(fair_worker, sizeof(p), &p);
+	}
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	timeout_t elapsed = 0;
+	Mutex_Lock(&mx);
+	for(int s=0; s<FAIR_POINTS; s++) {
+		Cond_TimedWait(&mx, &cv, fair_points[s] - elapsed);
+		elapsed = fair_points[s];
+		for(int p=0; p<FAIR_PROCS; p++)
+			fair_samples[s][p] = __atomic_load_n(& fair_counts[p], __ATOMIC_RELAXED);
+	}
+	Mutex_Unlock(&mx);
+
+	fair_stop = 1;
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	return 0;
+}
+
+BARE_TEST(bench_fair_share,
+	"Report the CPU share of processes with different nice values and\n"
+	"numbers of threads on one core, as it converges to their weights.",
+	.timeout = 60
+	)
+{
+	boot(1, 0, fair_share_boot, 0, NULL);
+
+	double total_weight = 0.0;
+	for(int p=0; p<FAIR_PROCS; p++)
+		total_weight += fair_weight(fair_procs[p].nice);
+
+	for(int p=0; p<FAIR_PROCS; p++)
+		MSG("%s: ideal %5.1f%%\n", fair_procs[p].label, 
+			100.0*fair_weight(fair_procs[p].nice)/total_weight);
+
+	for(int s=0; s<FAIR_POINTS; s++) {
+		double total = 0.0, maxerr = 0.0;
+		for(int p=0; p<FAIR_PROCS; p++)
+			total += fair_samples[s][p];
+		MSG("after %4lu ms:", fair_points[s]);
+		for(int p=0; p<FAIR_PROCS; p++) {
+			double share = (total > 0) ? 100.0*fair_samples[s][p]/total : 0.0;
+			double err = fabs(share - 100.0*fair_weight(fair_procs[p].nice)/total_weight);
+			if(err > maxerr) maxerr = err;
+			MSG(" %5.1f%%", share);
+		}
+		MSG("   (max error %4.1f%%)\n", maxerr);
+	}
+}
+
+
+
+TEST_SUITE(all_benchmarks,
+	"A suite containing all benchmarks.")
+{
+	&bench_swap_context,
+	&bench_context_switch,
+	&bench_idle_wakeup,
+	&bench_broadcast,
+	&bench_mutex_contention,
+	&bench_syscall_throughput,
+	&bench_readonly_syscalls,
+	&bench_syscall_batch,
+	&bench_ioring,
+	&bench_futex_lock,
+	&bench_timed_waiters,
+	&bench_thread_create_join,
+	&bench_thread_burst,
+	&bench_fair_share,
+	NULL
+};
+
+
+int main(int argc, char** argv)
+{
+	register_test(&all_benchmarks);
+	return run_program(argc, argv, &all_benchmarks);
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <time.h>
 #include <sys/select.h>
@@ -749,6 +750,14 @@ void cpu_core_halt()
 	dispatch_interrupts(core);
 }
 
+void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+	sched_yield();
+}
+
 static inline void core_restart(Core* core)
 {
 	if(core->halted) {
@@ -774,6 +783,15 @@ void cpu_core_restart_one()
 	pthread_mutex_unlock(& core_halt_mutex);	
 }
 
+void cpu_core_restart_some(uint n)
+{
+	pthread_mutex_lock(& core_halt_mutex);
+	for(; n > 0 && ! is_rlist_empty(&halted_list); n--) {
+		core_restart((Core*) rlist_pop_front(&halted_list)->obj);
+	}
+	pthread_mutex_unlock(& core_halt_mutex);	
+}
+
 void cpu_core_restart_all()
 {
 	pthread_mutex_lock(& core_halt_mutex);
@@ -819,6 +837,74 @@ void cpu_enable_interrupts()
 }
 
 
+#ifdef BIOS_ASM_CONTEXT
+
+/*
+	void cpu_asm_swap(void** oldsp, void* newsp)
+
+	Push the callee-saved registers and the SSE/x87 control words on the 
+	current stack, save the stack pointer into *oldsp, load newsp and pop
+	the same frame from there. The final ret resumes the new context.
+ */
+void cpu_asm_swap(void** oldsp, void* newsp);
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".type cpu_asm_swap, @function\n"
+	"cpu_asm_swap:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size cpu_asm_swap, .-cpu_asm_swap\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The top of the stack, aligned as required by the ABI */
+	uint64_t* top = (uint64_t*) (((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15);
+
+	/* 
+		Build the frame popped by cpu_asm_swap. It returns into ctx_func, with 
+		the stack aligned as if ctx_func was called (ctx_func never returns).
+	*/
+	uint64_t* sp = top - 9;
+	uint32_t ctlwords[2];
+	__asm__ volatile("stmxcsr %0\n\tfnstcw %1" : "=m"(ctlwords[0]), "=m"(ctlwords[1]));
+	memcpy(&sp[0], ctlwords, sizeof(uint64_t));  /* mxcsr, x87 control word */
+	for(int i=1; i<=6; i++) sp[i] = 0;           /* r15, r14, r13, r12, rbx, rbp */
+	sp[7] = (uint64_t) ctx_func;                 /* return address */
+	sp[8] = 0;                                   /* the return address of ctx_func */
+
+	ctx->sp = sp;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	cpu_asm_swap(& oldctx->sp, newctx->sp);
+}
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -840,6 +926,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
@@ -878,6 +966,14 @@ TimerDuration bios_clock()
 }	
 
 
+TimerDuration bios_fine_clock()
+{
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_sec*1000000ul + curtime.tv_nsec/1000;
+}
+
+
 
 uint bios_serial_ports()
 {
@@ -241,6 +241,16 @@ void cpu_enable_interrupts();
 void cpu_core_halt();
 
 
+/**
+	@brief Pause inside a busy-waiting loop.
+
+	This is the equivalent of a pause instruction. Since the simulated cores
+	share the CPUs of the host, the host CPU is also offered to other cores,
+	so that a core that busy-waits does not delay the core it waits for.
+*/
+void cpu_relax();
+
+
 /**
 	@brief Restart the given core.
 
@@ -256,6 +266,15 @@ void cpu_core_restart(uint c);
 */
 void cpu_core_restart_one();
 
+/**
+	@brief Restart up to a number of halted cores.
+
+	This call is equivalent to calling @c cpu_core_restart_one() @c n
+	times, but it is cheaper.
+	@param n the maximum number of cores to restart
+*/
+void cpu_core_restart_some(uint n);
+
 /**
 	@brief Signal all halted cores to restart.
 
@@ -264,11 +283,33 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+#if defined(BIOS_ASM_CONTEXT) && !defined(__x86_64__)
+#error "BIOS_ASM_CONTEXT is only supported on x86-64"
+#endif
+
+#ifdef BIOS_ASM_CONTEXT
+
+/**
+	@brief A type for saving CPU context into.
+
+	With @c BIOS_ASM_CONTEXT, a context switch saves only the callee-saved 
+	registers (and the FPU/SSE control words) on the stack of the old 
+	context, so the context itself is just the saved stack pointer. 
+	Unlike @c swapcontext, the signal mask is not saved, avoiding a system 
+	call on each switch. This is correct because the kernel always switches
+	contexts with interrupts disabled.
+*/
+typedef struct cpu_context { void* sp; } cpu_context_t;
+
+#else
+
 /**
 	@brief A type for saving CPU context into.
 */
 typedef ucontext_t cpu_context_t;
 
+#endif
+
 
 /**
 	@brief Initialize a CPU context for a new thread.
@@ -343,6 +384,17 @@ TimerDuration bios_cancel_timer();
 TimerDuration bios_clock();
 
 
+/**
+	@brief Get the current time from a high-resolution clock.
+
+	This function returns a monotonic clock value, in usec, with a
+	resolution of 1 usec, much like the cycle counter of a CPU. 
+	Its value is unrelated to @c bios_clock(). Unlike @c bios_clock(),
+	it is appropriate for precise timing.
+ */
+TimerDuration bios_fine_clock();
+
+
 
 
 /**
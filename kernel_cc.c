@@ -19,11 +19,11 @@
   */
 
 /*
- 	Pre-emption aware mutex.
- 	-------------------------
+ 	Pre-emption aware spinlock.
+ 	---------------------------
 
- 	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	This lock will act as a spinlock if preemption is off, and a
+ 	yielding spinlock if preemption is on.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
@@ -31,30 +31,273 @@
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
-void Mutex_Lock(Mutex* lock)
+void spin_lock(Mutex* lock)
 {
-#define MUTEX_SPINS 1000
+#define SPINLOCK_SPINS 1000
 
   while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
+    int spin=SPINLOCK_SPINS;
     while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
       __builtin_ia32_pause();      
       if(spin>0) 
       	spin--; 
       else { 
-      	spin=MUTEX_SPINS; 
+      	spin=SPINLOCK_SPINS; 
       	if(get_core_preemption())
       		yield(SCHED_MUTEX); 
       }
     }
   }
-#undef MUTEX_SPINS
+#undef SPINLOCK_SPINS
+}
+
+
+/*
+	Queued mutex.
+	-------------
+
+	A Mutex is in one of three states: free, locked, or locked with 
+	(possibly) sleeping waiters. Locking a free mutex, and unlocking a mutex
+	without waiters, is a single atomic instruction.
+
+	A thread that finds the mutex locked spins for a little while, since the
+	holder is probably running on another core and will soon unlock it. If 
+	it is still locked, the thread sleeps in a queue of waiters. The queues 
+	are not kept in the mutex (a Mutex is a single byte, and MUTEX_INIT is 
+	0), but in a small hash table keyed by the address of the mutex, the
+	'parking lot'. All the waiters of a mutex are in the same bucket, in 
+	FIFO order.
+
+	A thread unlocking a mutex with waiters unlocks it and wakes up the 
+	first waiter, which then tries again to lock it. Meanwhile, a running
+	thread may lock the mutex first; this keeps the mutex busy, instead of
+	paying a context switch for every lock. But if the first waiter has 
+	waited for more than MUTEX_FAIR_WAIT, the mutex is handed directly to
+	it, and it stays locked. Thus, a thread that keeps re-locking the mutex
+	cannot starve the waiters, and the waiters get it in FIFO order.
+*/
+
+enum { MUTEX_FREE = 0, MUTEX_LOCKED = 1, MUTEX_CONTENDED = 2 };
+
+#define MUTEX_SPINS 100
+#define MUTEX_FAIR_WAIT 1000   /* microseconds */
+#define PARK_BUCKETS 64        /* a power of 2 */
+
+/** \cond HELPER Helper structures for the mutex parking lot. */
+typedef struct mutex_waiter {
+	rlnode node;			/* in the queue of a bucket */
+	Mutex* mutex;			/* the mutex we wait for */
+	TCB* thread;			/* the waiting thread */
+	TimerDuration since;	/* when the thread started waiting */
+	sig_atomic_t woken;		/* set when the waiter is removed from the queue */
+	sig_atomic_t handed;	/* set when the mutex is handed to us */
+} mutex_waiter;
+
+typedef struct park_bucket {
+	Mutex lock;				/* spinlock for waiters */
+	rlnode waiters;			/* the waiters of all addresses in the bucket */
+} __attribute__((aligned(64))) park_bucket;
+
+static park_bucket mutex_buckets[PARK_BUCKETS];
+/** \endcond */
+
+/* Return the bucket of an address in a parking lot, with its spinlock held */
+static park_bucket* park_bucket_lock(park_bucket* table, void* addr)
+{
+	uintptr_t h = ((uintptr_t) addr) * 0x9E3779B97F4A7C15ull;
+	park_bucket* b = & table[(h >> 32) & (PARK_BUCKETS-1)];
+	spin_lock(& b->lock);
+	if(b->waiters.next == NULL) rlnode_init(& b->waiters, NULL);
+	return b;
+}
+
+static void mutex_park(Mutex* lock)
+{
+	mutex_waiter waiter = { .mutex = lock, .thread = CURTHREAD, .since = bios_fine_clock(), 
+		.woken = 0, .handed = 0 };
+	rlnode_init(& waiter.node, &waiter);
+
+	park_bucket* b = park_bucket_lock(mutex_buckets, lock);
+
+	/* Announce that there are waiters; if the mutex was just unlocked, it is ours */
+	while(__atomic_exchange_n(lock, MUTEX_CONTENDED, __ATOMIC_ACQUIRE) != MUTEX_FREE) {
+
+		/* A waiter that lost the mutex to another thread keeps its place */
+		if(waiter.woken)
+			rlist_push_front(& b->waiters, & waiter.node);
+		else
+			rlist_push_back(& b->waiters, & waiter.node);
+		waiter.woken = 0;
+
+		/* As in PIMutex_Lock, the bucket spinlock is taken with preemption on */
+		int preempt = preempt_off;
+		while(! waiter.woken) {
+			sleep_releasing(STOPPED, & b->lock, SCHED_MUTEX, NO_TIMEOUT);
+			if(preempt) preempt_on;
+			spin_lock(& b->lock);
+			preempt = preempt_off;
+		}
+		if(preempt) preempt_on;
+
+		if(waiter.handed) break;
+	}
+	spin_unlock(& b->lock);
+}
+
+static void mutex_unpark(Mutex* lock)
+{
+	park_bucket* b = park_bucket_lock(mutex_buckets, lock);
+
+	/* Find the first waiter, and whether there are more */
+	mutex_waiter* first = NULL;
+	int more = 0;
+	for(rlnode* n = b->waiters.next; n != & b->waiters; n = n->next) {
+		mutex_waiter* w = n->obj;
+		if(w->mutex != lock) continue;
+		if(first == NULL) 
+			first = w;
+		else {
+			more = 1;
+			break;
+		}
+	}
+
+	if(first == NULL) {
+		__atomic_store_n(lock, MUTEX_FREE, __ATOMIC_RELEASE);
+		spin_unlock(& b->lock);
+		return;
+	}
+
+	rlist_remove(& first->node);
+	first->woken = 1;
+	if(bios_fine_clock() - first->since >= MUTEX_FAIR_WAIT) {
+		/* Hand over the mutex; it stays locked */
+		__atomic_store_n(lock, more ? MUTEX_CONTENDED : MUTEX_LOCKED, __ATOMIC_RELAXED);
+		first->handed = 1;
+	}
+	else
+		__atomic_store_n(lock, MUTEX_FREE, __ATOMIC_RELEASE);
+
+	int preempt = preempt_off;
+	wakeup(first->thread);
+	spin_unlock(& b->lock);
+	if(preempt) preempt_on;
+}
+
+
+void Mutex_Lock(Mutex* lock)
+{
+	Mutex state = MUTEX_FREE;
+	if(__atomic_compare_exchange_n(lock, &state, MUTEX_LOCKED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	/* Spin while the holder may be about to unlock, unless others sleep already */
+	for(int spin = MUTEX_SPINS; spin > 0 && state != MUTEX_CONTENDED; spin--) {
+		__builtin_ia32_pause();
+		state = __atomic_load_n(lock, __ATOMIC_RELAXED);
+		if(state == MUTEX_FREE
+			&& __atomic_compare_exchange_n(lock, &state, MUTEX_LOCKED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+	}
+
+	mutex_park(lock);
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+	Mutex state = MUTEX_LOCKED;
+	if(! __atomic_compare_exchange_n(lock, &state, MUTEX_FREE, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		mutex_unpark(lock);
+}
+
+
+/*
+	Futexes.
+	--------
+
+	The waiters of futexes are kept in a parking lot of their own, like
+	the waiters of mutexes. FutexWait checks the value of the futex with
+	the bucket locked, and FutexWake wakes up waiters with the bucket 
+	locked, so a wake-up that follows a change of the value cannot fall
+	between the check and the sleep.
+*/
+
+/** \cond HELPER Helper structure for futexes. */
+typedef struct futex_waiter {
+	rlnode node;			/* in the queue of a bucket */
+	int* addr;				/* the futex we wait for */
+	TCB* thread;			/* the waiting thread */
+	sig_atomic_t woken;		/* set when the waiter is removed from the queue */
+} futex_waiter;
+
+static park_bucket futex_buckets[PARK_BUCKETS];
+/** \endcond */
+
+
+int sys_FutexWait(int* addr, int expected, timeout_t timeout)
+{
+	if(addr == NULL) return -1;
+
+	futex_waiter waiter = { .addr = addr, .thread = CURTHREAD, .woken = 0 };
+	rlnode_init(& waiter.node, &waiter);
+
+	TimerDuration deadline = (timeout == (timeout_t)-1) ? NO_TIMEOUT : bios_fine_clock() + timeout*1000ul;
+
+	park_bucket* b = park_bucket_lock(futex_buckets, addr);
+	if(__atomic_load_n(addr, __ATOMIC_SEQ_CST) != expected) {
+		spin_unlock(& b->lock);
+		return -1;
+	}
+	rlist_push_back(& b->waiters, & waiter.node);
+
+	/* As in mutex_park */
+	int preempt = preempt_off;
+	while(! waiter.woken) {
+		TimerDuration wait = NO_TIMEOUT;
+		if(deadline != NO_TIMEOUT) {
+			TimerDuration now = bios_fine_clock();
+			if(now >= deadline) {
+				rlist_remove(& waiter.node);
+				break;
+			}
+			wait = deadline - now;
+		}
+		sleep_releasing(STOPPED, & b->lock, SCHED_USER, wait);
+		if(preempt) preempt_on;
+		spin_lock(& b->lock);
+		preempt = preempt_off;
+	}
+	if(preempt) preempt_on;
+	spin_unlock(& b->lock);
+
+	return waiter.woken ? 0 : -1;
+}
+
+
+int sys_FutexWake(int* addr, unsigned int n)
+{
+	if(addr == NULL) return -1;
+
+	park_bucket* b = park_bucket_lock(futex_buckets, addr);
+
+	unsigned int woken = 0;
+	int preempt = preempt_off;
+	rlnode* p = b->waiters.next;
+	while(p != & b->waiters && woken < n) {
+		futex_waiter* w = p->obj;
+		p = p->next;
+		if(w->addr != addr) continue;
+
+		rlist_remove(& w->node);
+		w->woken = 1;
+		wakeup(w->thread);
+		woken++;
+	}
+	spin_unlock(& b->lock);
+	if(preempt) preempt_on;
+
+	return woken;
 }
 
 
@@ -63,30 +306,64 @@ void Mutex_Unlock(Mutex* lock)
 */
 
 
-/** \cond HELPER Helper structure for condition variables. */
+/** \cond HELPER Helper structure for condition variables (and PIMutex). */
 typedef struct __cv_waiter {
 	rlnode node;				/* become part of a ring */
 	TCB* thread;				/* thread to wait */
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	sig_atomic_t morphed;		/* this is set if the waiter was moved to
+								   the waitset of a PIMutex (see Cond_BroadcastPI) */
 } __cv_waiter;
 /** \endcond */
 
 /**
    @internal
-   A helper routine to remove a condition waiter from the CondVar ring.
+   A helper routine to add a waiter to the back of a ring of waiters 
+   (e.g., cv->waitset).
+ */
+static inline void add_to_ring(void** waitset, __cv_waiter* w)
+{
+	if(*waitset) {
+		__cv_waiter* wset = *waitset;
+		rlist_push_back(& wset->node, & w->node);
+	} else {
+		*waitset = w;
+	}
+}
+
+/**
+   @internal
+   A helper routine to remove a waiter from a ring of waiters.
  */
-static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
+static inline void remove_from_ring(void** waitset, __cv_waiter* w)
 {
-	if(cv->waitset == w) {
-		/* Make cv->waitset safe */
+	if(*waitset == w) {
+		/* Make the waitset safe */
 		__cv_waiter * nextw = w->node.next->obj;
-		cv->waitset =  (nextw == w) ? NULL : nextw;
+		*waitset =  (nextw == w) ? NULL : nextw;
 	}
 	rlist_remove(& w->node);
 }
 
+/**
+   @internal
+   After a wait on a condition variable, remove the waiter from the ring,
+   unless a signal has removed it already.
+ */
+static void cv_tidy_up(CondVar* cv, __cv_waiter* w)
+{
+	spin_lock(&(cv->waitset_lock));
+	if(! w->removed) {
+		assert(! w->signalled);
+
+		/* We must remove ourselves from the ring! */
+		remove_from_ring(& cv->waitset, w);
+	}
+	spin_unlock(&(cv->waitset_lock));
+}
+
 
 /** 
    @internal
@@ -118,31 +395,19 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 static int cv_wait(Mutex* mutex, CondVar* cv, 
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=CURTHREAD, .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=CURTHREAD, .signalled = 0, .removed=0, .morphed=0 };
 	rlnode_init(& waiter.node, &waiter);
 
-	Mutex_Lock(&(cv->waitset_lock));
+	spin_lock(&(cv->waitset_lock));
 	/* We just push the current thread to the back of the list */
-	if(cv->waitset) {
-		__cv_waiter* wset = cv->waitset;
-		rlist_push_back(& wset->node, & waiter.node);
-	} else {
-		cv->waitset = &waiter;
-	}
+	add_to_ring(& cv->waitset, &waiter);
 
 	/* Now atomically release mutex and sleep */
 	Mutex_Unlock(mutex);
 	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
 
 	/* Woke up, we must check wether we were signaled, and tidy up */
-	Mutex_Lock(&(cv->waitset_lock));
-	if(! waiter.removed) {
-		assert(! waiter.signalled);
-
-		/* We must remove ourselves from the ring! */
-		remove_from_ring(cv, &waiter);
-	}
-	Mutex_Unlock(&(cv->waitset_lock));
+	cv_tidy_up(cv, &waiter);
 
 	Mutex_Lock(mutex);
 	return waiter.signalled;
@@ -160,7 +425,7 @@ static inline void cv_signal(CondVar* cv)
 	/* Wakeup first process in the waiters' queue, if it exists. */
 	while(cv->waitset) {
 		__cv_waiter* waiter = cv->waitset;
-		remove_from_ring(cv, waiter);
+		remove_from_ring(& cv->waitset, waiter);
 		waiter->removed = 1;
 		if(wakeup(waiter->thread)) {
 			waiter->signalled = 1;
@@ -185,23 +450,306 @@ int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 
 void Cond_Signal(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
+  spin_lock(&(cv->waitset_lock));
   cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  spin_unlock(&(cv->waitset_lock));
 }
 
 
+/*
+  Broadcast wakes up the waiters in batches (see wakeup_batch), so that 
+  the scheduler is entered, and other cores are notified, once per batch 
+  instead of once per waiter.
+*/
+#define CV_BROADCAST_BATCH 64
+
 void Cond_Broadcast(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  __cv_waiter* waiters[CV_BROADCAST_BATCH];
+  TCB* tcbs[CV_BROADCAST_BATCH];
+
+  spin_lock(&(cv->waitset_lock));
+  while(cv->waitset) {
+    unsigned int n = 0;
+    while(cv->waitset && n < CV_BROADCAST_BATCH) {
+      __cv_waiter* waiter = cv->waitset;
+      remove_from_ring(& cv->waitset, waiter);
+      waiter->removed = 1;
+      waiters[n] = waiter;
+      tcbs[n++] = waiter->thread;
+    }
+
+    /* The waiters tidy up under waitset_lock, so they see 'signalled' */
+    wakeup_batch(tcbs, n);
+    for(unsigned int i=0; i<n; i++)
+      if(tcbs[i] != NULL) waiters[i]->signalled = 1;
+  }
+  spin_unlock(&(cv->waitset_lock));
 }
 
 
 
 
 
+/*
+	Mutexes with priority inheritance.
+
+	The owner of a PIMutex is the TCB of the thread holding it, and its
+	waitset is a ring of __cv_waiter, protected by waitset_lock. A thread 
+	that finds the mutex busy lends its priority to the owner (see 
+	set_inherited_priority) and sleeps. On unlock, the owner hands the
+	mutex directly to the waiter of the highest priority, so that no 
+	thread can overtake it. A thread returns its inherited priority when
+	it releases the last PIMutex it holds (field pi_held of the TCB).
+
+	The slow paths call into the scheduler while holding waitset_lock,
+	with preemption off; else, the thread could be preempted (e.g., by
+	the thread it has just woken up) while holding the spinlock.
+*/
+
+/* 
+	Return the waiter of the highest priority in a ring (the first among 
+	equals). If 'rest' is not NULL, store there the highest priority among 
+	the other waiters, or -1 if there are none.
+*/
+static __cv_waiter* pi_top_waiter(__cv_waiter* waitset, int* rest)
+{
+	int second = -1;
+	__cv_waiter* top = waitset;
+	if(top == NULL) return NULL;
+	int top_prio = effective_priority(top->thread);
+	for(rlnode* n = waitset->node.next; n != & waitset->node; n = n->next) {
+		__cv_waiter* w = n->obj;
+		int prio = effective_priority(w->thread);
+		if(prio > top_prio) {
+			second = top_prio;
+			top = w;
+			top_prio = prio;
+		}
+		else if(prio > second)
+			second = prio;
+	}
+	if(rest) *rest = second;
+	return top;
+}
+
+/* Make the owner of a mutex inherit a priority, if it is higher than its own */
+static inline void pi_lend(TCB* owner, int priority)
+{
+	if(priority > effective_priority(owner))
+		set_inherited_priority(owner, priority);
+}
+
+
+/* 
+	Take a free PIMutex. Returns 0 if the mutex is busy.
+	*** MUST BE CALLED WITH mx->waitset_lock HELD ***
+*/
+static inline int pi_try_acquire(PIMutex* mx, TCB* me)
+{
+	assert(mx->owner != me);
+	if(mx->owner != NULL) return 0;
+	mx->owner = me;
+	me->pi_held++;
+	return 1;
+}
+
+/*
+	Sleep in the waitset of a mutex, until the mutex is handed to us by
+	the unlocking thread. Returns with mx->waitset_lock released, and 
+	preemption restored to 'preempt'.
+	*** MUST BE CALLED WITH mx->waitset_lock HELD AND PREEMPTION OFF ***
+*/
+static void pi_await_handoff(PIMutex* mx, TCB* me, int preempt)
+{
+	while(mx->owner != me) {
+		sleep_releasing(STOPPED, & mx->waitset_lock, SCHED_MUTEX, NO_TIMEOUT);
+		if(preempt) preempt_on;
+		spin_lock(& mx->waitset_lock);
+		preempt = preempt_off;
+	}
+	spin_unlock(& mx->waitset_lock);
+	if(preempt) preempt_on;
+}
+
+/*
+	Note on preemption: mx->waitset_lock is always acquired with preemption
+	on, so that a holder preempted on this core cannot make us spin forever.
+	Preemption is turned off only after the lock is held, around the calls 
+	to the scheduler, so that an ICI caused by a wakeup or by returning a 
+	borrowed priority is not delivered before the lock is released.
+*/
+void PIMutex_Lock(PIMutex* mx)
+{
+	TCB* me = CURTHREAD;
+
+	spin_lock(& mx->waitset_lock);
+
+	if(! pi_try_acquire(mx, me)) {
+		__cv_waiter waiter = { .thread=me, .signalled = 0, .removed=0, .morphed=0 };
+		rlnode_init(& waiter.node, &waiter);
+		add_to_ring(& mx->waitset, &waiter);
+
+		int preempt = preempt_off;
+		pi_lend(mx->owner, effective_priority(me));
+		pi_await_handoff(mx, me, preempt);
+		return;
+	}
+
+	spin_unlock(& mx->waitset_lock);
+}
+
+
+/*
+	Release a PIMutex held by the current thread.
+	*** MUST BE CALLED WITH mx->waitset_lock HELD AND PREEMPTION OFF ***
+*/
+static void pi_release(PIMutex* mx)
+{
+	TCB* me = CURTHREAD;
+	assert(mx->owner == me);
+
+	int rest;
+	__cv_waiter* top = pi_top_waiter(mx->waitset, &rest);
+	if(top != NULL) {
+		remove_from_ring(& mx->waitset, top);
+		TCB* next = top->thread;
+		mx->owner = next;
+		next->pi_held++;
+
+		/* The new owner inherits from the remaining waiters */
+		if(rest >= 0)
+			pi_lend(next, rest);
+
+		wakeup(next);
+	} 
+	else {
+		mx->owner = NULL;
+	}
+
+	/* Return the borrowed priority */
+	if(--me->pi_held == 0 && me->inherited_priority >= 0)
+		set_inherited_priority(me, -1);
+}
+
+
+void PIMutex_Unlock(PIMutex* mx)
+{
+	TCB* me = CURTHREAD;
+
+	spin_lock(& mx->waitset_lock);
+	assert(mx->owner == me);
+
+	/* Without waiters or a priority to return, the scheduler is not involved */
+	if(mx->waitset == NULL && (me->pi_held > 1 || me->inherited_priority < 0)) {
+		mx->owner = NULL;
+		me->pi_held--;
+		spin_unlock(& mx->waitset_lock);
+		return;
+	}
+
+	int preempt = preempt_off;
+	pi_release(mx);
+	spin_unlock(& mx->waitset_lock);
+	if(preempt) preempt_on;
+}
+
+
+/*
+	This is cv_wait, for a PIMutex. 
+
+	Unlike cv_wait, the mutex is released while cv->waitset_lock is not held,
+	since releasing it may preempt us. A signal that arrives before we sleep
+	finds us running and passes to the next waiter; we notice that we were 
+	removed from the ring, and return without sleeping.
+*/
+static int cv_wait_pi(PIMutex* mx, CondVar* cv, 
+		enum SCHED_CAUSE cause, TimerDuration timeout)
+{
+	__cv_waiter waiter = { .thread=CURTHREAD, .signalled = 0, .removed=0, .morphed=0 };
+	rlnode_init(& waiter.node, &waiter);
+
+	spin_lock(&(cv->waitset_lock));
+	add_to_ring(& cv->waitset, &waiter);
+	spin_unlock(&(cv->waitset_lock));
+
+	PIMutex_Unlock(mx);
+
+	spin_lock(&(cv->waitset_lock));
+	if(! waiter.removed)
+		sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
+	else
+		spin_unlock(&(cv->waitset_lock));
+
+	cv_tidy_up(cv, &waiter);
+
+	/* A morphed waiter is in the waitset of the mutex already */
+	if(waiter.morphed) {
+		spin_lock(& mx->waitset_lock);
+		int preempt = preempt_off;
+		pi_await_handoff(mx, waiter.thread, preempt);
+	}
+	else
+		PIMutex_Lock(mx);
+	return waiter.signalled;
+}
+
+
+/*
+	Wait morphing: broadcast to the waiters of cv_wait_pi, which will all
+	re-acquire the same mutex. Waking them all up would only make most of 
+	them block again on the mutex, so, instead, they are moved from the 
+	waitset of the condition variable to the waitset of the mutex, and are 
+	woken up one at a time, as the mutex is handed to each of them. If the
+	mutex is free, the first waiter is handed the mutex and woken up at once.
+
+	A moved waiter may be awake (e.g., its timeout has expired, or it has
+	not gone to sleep yet). Therefore, when it finds itself 'morphed', it 
+	waits until it owns the mutex, as in PIMutex_Lock.
+
+	This must not be called from an interrupt handler, which may have
+	interrupted a holder of mx->waitset_lock.
+*/
+void Cond_BroadcastPI(PIMutex* mx, CondVar* cv)
+{
+	spin_lock(&(cv->waitset_lock));
+	if(cv->waitset == NULL) {
+		spin_unlock(&(cv->waitset_lock));
+		return;
+	}
+
+	spin_lock(& mx->waitset_lock);
+	int preempt = preempt_off;
+	while(cv->waitset) {
+		__cv_waiter* w = cv->waitset;
+		remove_from_ring(& cv->waitset, w);
+		w->removed = 1;
+		w->signalled = 1;
+		w->morphed = 1;
+
+		if(mx->owner == NULL) {
+			mx->owner = w->thread;
+			w->thread->pi_held++;
+			wakeup(w->thread);
+		}
+		else {
+			add_to_ring(& mx->waitset, w);
+			pi_lend(mx->owner, effective_priority(w->thread));
+		}
+	}
+	spin_unlock(& mx->waitset_lock);
+	spin_unlock(&(cv->waitset_lock));
+	if(preempt) preempt_on;
+}
+
+
+int Cond_WaitPI(PIMutex* mx, CondVar* cv)
+{
+	return cv_wait_pi(mx, cv, SCHED_USER, NO_TIMEOUT);
+}
+
+
+
 /*
  *  Pre-emption control
  */ 
@@ -232,57 +780,19 @@ int get_core_preemption()
  *
  * The kernel locks
  *
- */
-
-/**
- * @brief The kernel lock.
+ * There is no global kernel lock. Each subsystem, or object, of the kernel
+ * is protected by its own mutex with priority inheritance (e.g., the 
+ * process table, each pipe, the port map), so that system calls on 
+ * different objects run in parallel on different cores. Since the mutexes
+ * have priority inheritance, a thread of low priority that is preempted 
+ * while holding one does not hold up threads of higher priority for long.
  *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has the advantage that 
  */
 
-
-/* Semaphore counter */
-static int kernel_sem = 1;
-
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
-
-void kernel_lock()
-{
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
-}
-
-void kernel_unlock()
-{
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
-}
-
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(PIMutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
-
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
-
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
-
-	return ret;
+	return cv_wait_pi(mx, cv, cause, timeout);
 }
 
 void kernel_signal(CondVar* cv) 
@@ -290,17 +800,19 @@ void kernel_signal(CondVar* cv)
 	Cond_Signal(cv); 
 }
 
-void kernel_broadcast(CondVar* cv) 
+void kernel_broadcast(PIMutex* mx, CondVar* cv) 
 { 
-	Cond_Broadcast(cv); 
+	Cond_BroadcastPI(mx, cv);
 }
 
-void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
+void kernel_sleep(PIMutex* mx, Thread_state newstate, enum SCHED_CAUSE cause)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	/* Atomically release the lock and sleep */
+	spin_lock(& mx->waitset_lock);
+	int preempt = preempt_off;
+	pi_release(mx);
+	sleep_releasing(newstate, & mx->waitset_lock, cause, NO_TIMEOUT);
+	if(preempt) preempt_on;
 }
 
 
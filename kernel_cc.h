@@ -30,35 +30,109 @@
 #include "kernel_sched.h"
 
 
-extern Mutex kernel_mutex;
-
-
 /*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
+ * Kernel spinlocks.
  */
 
 /**
-	@brief Lock the kernel.
- */
-void kernel_lock();
+	@brief Lock a spinlock.
+
+	The kernel's own locks, which must never block (e.g., those taken by the
+	scheduler, or those that protect the waiters of a @c Mutex), are of type
+	@c Mutex but are used as spinlocks, with this call and @c spin_unlock, 
+	instead of @c Mutex_Lock. In the non-preemptive domain, this is a pure 
+	spinlock; in the preemptive domain, it yields after spinning for a while.
+
+	@see spin_unlock
+  */
+void spin_lock(Mutex* lock);
+
+/**
+	@brief Unlock a spinlock locked by @c spin_lock.
+  */
+static inline void spin_unlock(Mutex* lock)
+{
+	__atomic_clear(lock, __ATOMIC_RELEASE);
+}
 
 /**
-	@brief Unlock the kernel.
+	@brief Try to lock a spinlock, without waiting.
+	@returns 1 if the lock was acquired, 0 if it is busy
+  */
+static inline int spin_trylock(Mutex* lock)
+{
+	return ! __atomic_test_and_set(lock, __ATOMIC_ACQUIRE);
+}
+
+
+/**
+	@brief Lock a ticket spinlock.
+
+	This must be called in the non-preemptive domain (see @c ticketlock).
+  */
+static inline void ticket_lock(ticketlock* lock)
+{
+#define TICKET_SPINS 100
+	uint16_t ticket = __atomic_fetch_add(& lock->next, 1, __ATOMIC_RELAXED);
+	int spin = TICKET_SPINS;
+	while(__atomic_load_n(& lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+		/* The holder may be a core that the host has descheduled */
+		if(--spin > 0)
+			__builtin_ia32_pause();
+		else {
+			spin = TICKET_SPINS;
+			cpu_relax();
+		}
+	}
+#undef TICKET_SPINS
+}
+
+/**
+	@brief Unlock a ticket spinlock.
+  */
+static inline void ticket_unlock(ticketlock* lock)
+{
+	__atomic_store_n(& lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+/**
+	@brief Try to lock a ticket spinlock, without waiting.
+	@returns 1 if the lock was acquired, 0 if it is busy
+  */
+static inline int ticket_trylock(ticketlock* lock)
+{
+	ticketlock old, new;
+	old.word = __atomic_load_n(& lock->word, __ATOMIC_RELAXED);
+	if(old.owner != old.next) return 0;
+	new = old;
+	new.next++;
+	return __atomic_compare_exchange_n(& lock->word, & old.word, new.word, 0, 
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Kernel monitors.
+ *
+ * There is no global kernel lock; system calls lock the objects that 
+ * they use, each of which is protected by a @c PIMutex (e.g., 
+ * @c proc_lock for the process table, or the lock of a pipe). These are 
+ * wrappers for waiting and signalling in these monitors.
  */
-void kernel_unlock();
 
 /**
-	@brief Wait on a condition variable using the kernel lock.
+	@brief Wait on a condition variable, releasing a kernel lock.
+
+	The lock must be held by the caller, and it is held again on return.
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(PIMutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
 
 /**
 	@brief Signal a kernel condition to one waiter.
@@ -69,17 +143,22 @@ void kernel_signal(CondVar* cv);
 
 /**
 	@brief Signal a kernel condition to all waiters.
+
+	The waiters must be waiting with lock @c mx, which the caller holds;
+	they are handed the lock one at a time (see @c Cond_BroadcastPI). 
+	This must not be called from an interrupt handler; use 
+	@c Cond_Broadcast there.
   */
-void kernel_broadcast(CondVar* cv);
+void kernel_broadcast(PIMutex* mx, CondVar* cv);
 
 
 /**
-	@brief Put thread to sleep, unlocking the kernel.
+	@brief Put thread to sleep, releasing a kernel lock.
 
 	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
+	as the kernel locks are not spinlocks.
   */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
+void kernel_sleep(PIMutex* mx, Thread_state state, enum SCHED_CAUSE cause);
 
 
 
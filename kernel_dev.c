@@ -15,6 +15,62 @@
 DCB DT[MAX_TERMINALS];
 
 
+/* ===================================
+
+  Wait queues for asynchronous I/O
+
+  ====================================*/
+
+void io_waitqueue_init(io_waitqueue* q)
+{
+  q->lock = MUTEX_INIT;
+  rlnode_init(& q->waiters, NULL);
+}
+
+void io_wait(io_waitqueue* q, io_waiter* w)
+{
+  int preempt = preempt_off;
+  spin_lock(& q->lock);
+  assert(w->node.next == & w->node);
+  w->queue = q;
+  rlist_push_back(& q->waiters, & w->node);
+  spin_unlock(& q->lock);
+  if(preempt) preempt_on;
+}
+
+void io_wait_cancel(io_waiter* w)
+{
+  io_waitqueue* q = __atomic_load_n(& w->queue, __ATOMIC_ACQUIRE);
+  if(q == NULL) return;
+
+  /* 
+    Always take the lock, even if io_notify has removed the waiter: its 
+    notify may still be running, and then the caller must not free w.
+  */
+  int preempt = preempt_off;
+  spin_lock(& q->lock);
+  if(w->node.next != & w->node)
+    rlist_remove(& w->node);
+  spin_unlock(& q->lock);
+  if(preempt) preempt_on;
+}
+
+void io_notify(io_waitqueue* q)
+{
+  /* This is called often, e.g., on each pipe write, and there are rarely waiters */
+  if(is_rlist_empty(& q->waiters)) return;
+
+  int preempt = preempt_off;
+  spin_lock(& q->lock);
+  while(! is_rlist_empty(& q->waiters)) {
+    io_waiter* w = rlist_pop_front(& q->waiters)->obj;
+    w->notify(w);
+  }
+  spin_unlock(& q->lock);
+  if(preempt) preempt_on;
+}
+
+
 /* ===================================
 
   The null device driver
@@ -37,6 +93,18 @@ int nulldev_write(void* dev, const char* buf, unsigned int size)
 }
 
 
+/* The null device never blocks */
+int nulldev_try_read(void* dev, char *buf, unsigned int size, io_waiter* w)
+{
+  return nulldev_read(dev, buf, size);
+}
+
+int nulldev_try_write(void* dev, const char* buf, unsigned int size, io_waiter* w)
+{
+  return nulldev_write(dev, buf, size);
+}
+
+
 int nulldev_close(void* dev) 
 {
   return 0;
@@ -51,7 +119,9 @@ static file_ops nulldev_fops = {
   .Open = nulldev_open,
   .Read = nulldev_read,
   .Write = nulldev_write,
-  .Close = nulldev_close
+  .Close = nulldev_close,
+  .TryRead = nulldev_try_read,
+  .TryWrite = nulldev_try_write
 };
 
 
@@ -68,8 +138,10 @@ void serial_tx_handler();
 
 typedef struct serial_device_control_block {
   uint devno;
-  Mutex spinlock;
+  PIMutex lock;         /* rx_ready waits with this */
   CondVar rx_ready;
+  io_waitqueue rx_waiters;  /* Asynchronous reads, waiting for data */
+  io_waitqueue tx_waiters;  /* Asynchronous writes, waiting for the port */
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -91,6 +163,7 @@ void serial_rx_handler()
   for(int i=0;i<bios_serial_ports();i++) {
     serial_dcb_t* dcb = &serial_dcb[i];
     Cond_Broadcast(&dcb->rx_ready);
+    io_notify(&dcb->rx_waiters);
   }
   if(pre) preempt_on;
 }
@@ -102,6 +175,7 @@ int serial_read(void* dev, char *buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
+  PIMutex_Lock(&dcb->lock);
   preempt_off;            /* Stop preemption */
 
   uint count =  0;
@@ -113,17 +187,41 @@ int serial_read(void* dev, char *buf, unsigned int size)
       count++;
     }
     else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+      kernel_wait(&dcb->lock, &dcb->rx_ready, SCHED_IO);
     }
     else
       break;
   }
 
   preempt_on;           /* Restart preemption */
+  PIMutex_Unlock(&dcb->lock);
 
   return count;
 }
 
+/*
+  Read from the device without sleeping. As with serial_read, a
+  notification may be missed if data arrives right before we wait,
+  but the device raises the interrupt again after a while.
+ */
+int serial_try_read(void* dev, char *buf, unsigned int size, io_waiter* w)
+{
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  PIMutex_Lock(&dcb->lock);
+
+  uint count = 0;
+  while(count<size && bios_read_serial(dcb->devno, &buf[count]))
+    count++;
+
+  if(count==0)
+    io_wait(&dcb->rx_waiters, w);
+
+  PIMutex_Unlock(&dcb->lock);
+
+  return count>0 ? count : IO_AGAIN;
+}
+
 
 /*
   A polling driver for serial writes
@@ -132,7 +230,11 @@ int serial_read(void* dev, char *buf, unsigned int size)
 /* Interrupt driver */
 void serial_tx_handler()
 {
-  /* There is nothing to do */
+  /* Only the asynchronous writes wait for this */
+  int pre = preempt_off;
+  for(int i=0;i<bios_serial_ports();i++)
+    io_notify(&serial_dcb[i].tx_waiters);
+  if(pre) preempt_on;
 }
 
 /* 
@@ -152,7 +254,7 @@ int serial_write(void* dev, const char* buf, unsigned int size)
     } 
     else if(count==0)
     {
-      yield(SCHED_IO);
+      yield(SCHED_POLL);
     }
     else
       break;
@@ -161,6 +263,21 @@ int serial_write(void* dev, const char* buf, unsigned int size)
   return count;  
 }
 
+/* Write without polling; wait for the interrupt instead */
+int serial_try_write(void* dev, const char* buf, unsigned int size, io_waiter* w)
+{
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  unsigned int count = 0;
+  while(count < size && bios_write_serial(dcb->devno, buf[count]))
+    count++;
+
+  if(count==0)
+    io_wait(&dcb->tx_waiters, w);
+
+  return count>0 ? count : IO_AGAIN;
+}
+
 
 int serial_close(void* dev) 
 {
@@ -180,7 +297,9 @@ file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
-  .Close = serial_close
+  .Close = serial_close,
+  .TryRead = serial_try_read,
+  .TryWrite = serial_try_write
 };
 
 
@@ -210,7 +329,9 @@ void initialize_devices()
   for(int i=0; i<bios_serial_ports(); i++) {
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
-    serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].lock = PIMUTEX_INIT;
+    io_waitqueue_init(&serial_dcb[i].rx_waiters);
+    io_waitqueue_init(&serial_dcb[i].tx_waiters);
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
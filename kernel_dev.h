@@ -7,6 +7,7 @@
  *
  *****************************/ 
 
+#include "tinyos.h"
 #include "util.h"
 #include "bios.h"
 
@@ -34,6 +35,65 @@
 */
 
 
+/**
+  @brief The value returned by @c TryRead and @c TryWrite when the
+  operation would block.
+  */
+#define IO_AGAIN (-2)
+
+typedef struct io_waiter io_waiter;
+
+/**
+  @brief A queue of asynchronous operations waiting on a stream.
+
+  A stream that supports @c TryRead or @c TryWrite keeps the waiters of
+  the operations that would block in such queues, and calls @c io_notify
+  when it may be ready for them again (e.g., when data arrives).
+  */
+typedef struct io_waitqueue {
+  Mutex lock;        /**< @brief A spinlock, always taken with preemption off */
+  rlnode waiters;    /**< @brief The list of @c io_waiter objects */
+} io_waitqueue;
+
+/**
+  @brief A waiter of an asynchronous operation.
+  */
+struct io_waiter {
+  rlnode node;            /**< @brief Intrusive node for @c io_waitqueue */
+  io_waitqueue* queue;    /**< @brief The last queue of the waiter (kept after @c io_notify), or NULL */
+  void* owner;            /**< @brief The object waiting, for @c notify */
+  void (*notify)(io_waiter* w);  /**< @brief Called when the waiter is removed by @c io_notify.
+                            It is called with the queue locked and preemption off, 
+                            possibly from an interrupt handler, so it must not block. */
+};
+
+/** @brief Initialize a waitqueue. */
+void io_waitqueue_init(io_waitqueue* q);
+
+/** 
+  @brief Add a waiter to a queue.
+
+  To avoid lost notifications, the stream must call this and 
+  @c io_notify under a common lock (e.g., the lock of a pipe), or else
+  be prepared for a waiter to miss a notification (e.g., the serial
+  devices raise their interrupts periodically).
+  */
+void io_wait(io_waitqueue* q, io_waiter* w);
+
+/**
+  @brief Remove a waiter from its queue, if it is still in one.
+
+  When this returns, the @c notify of the waiter is not running, and
+  it will not be called (unless @c io_wait is called again). It must 
+  not be called concurrently with @c io_wait for the same waiter, and
+  the last queue of the waiter must still exist.
+  */
+void io_wait_cancel(io_waiter* w);
+
+/** @brief Remove all the waiters of a queue, calling their @c notify. */
+void io_notify(io_waitqueue* q);
+
+
 /**
   @brief The device-specific file operations table.
 
@@ -92,6 +152,29 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+  /** @brief Non-blocking read operation, for asynchronous I/O.
+
+    Like @c Read, but if no data is available, instead of blocking, 
+    add the waiter 'w' to a queue of the stream (see @c io_wait) and
+    return @c IO_AGAIN. The stream calls @c io_notify on the queue 
+    when the read may succeed.
+
+    This may be NULL for streams that do not support asynchronous I/O;
+    then, asynchronous reads from the stream fail.
+  */
+    int (*TryRead)(void* this, char *buf, unsigned int size, io_waiter* w);
+
+  /** @brief Non-blocking write operation, for asynchronous I/O.
+
+    Like @c Write, but it may write fewer than 'size' bytes, and if
+    no data can be written, it adds the waiter 'w' to a queue of the
+    stream and returns @c IO_AGAIN, as @c TryRead.
+
+    This may be NULL for streams that do not support asynchronous I/O;
+    then, asynchronous writes to the stream fail.
+  */
+    int (*TryWrite)(void* this, const char* buf, unsigned int size, io_waiter* w);
 } file_ops;
 
 
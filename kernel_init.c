@@ -9,6 +9,8 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_sys.h"
+#include "kernel_trace.h"
 
 
 
@@ -39,9 +41,10 @@ void boot_tinyos_kernel()
     initialize_devices();
     initialize_files();
     initialize_scheduler();
+    initialize_trace();
 
-    /* The boot task is executed normally! */
-    if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
+    /* The boot task is executed normally! (There is no thread yet to hold proc_lock) */
+    if(process_create(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
       FATAL("The init process does not have PID==1");
   }
 
@@ -55,6 +58,7 @@ void boot_tinyos_kernel()
 
   if(cpu_core_id==0) {
     /* Here, we could add cleanup after the scheduler has ended. */    
+    finalize_trace();
   }
 }
 
@@ -0,0 +1,263 @@
+
+#include "kernel_ioring.h"
+#include "kernel_cc.h"
+#include "kernel_sched.h"
+
+
+/*
+	Locking: the thread in IoRingEnter holds enter_lock, and it is the
+	only one that submits, tries and completes requests. The streams
+	call ioring_notify with the lock of their waitqueue held, so the
+	lock order is: waitqueue lock, then ring lock. The ring lock is never
+	held while calling a stream method.
+ */
+
+
+/* Called by a stream when the request may proceed */
+static void ioring_notify(io_waiter* w)
+{
+	io_request* req = w->owner;
+	IO_RING_CB* ring = req->ring;
+
+	spin_lock(& ring->lock);
+	req->state = IOREQ_READY;
+	rlist_push_back(& ring->ready, & req->node);
+	if(ring->sleeper != NULL) {
+		wakeup(ring->sleeper);
+		ring->sleeper = NULL;
+	}
+	spin_unlock(& ring->lock);
+}
+
+
+/* Queue the result of a request, and free it */
+static void ioring_complete(IO_RING_CB* ring, io_request* req, int res)
+{
+	io_ring* sh = & ring->shared;
+
+	if(req->fcb != NULL)
+		FCB_decref(req->fcb);
+	req->fcb = NULL;
+
+	/* There is room, because submissions are limited by the size of cq */
+	io_cqe* cqe = & sh->cq[sh->cq_tail & (sh->cq_entries-1)];
+	cqe->user_data = req->sqe.user_data;
+	cqe->res = res;
+	__atomic_store_n(& sh->cq_tail, sh->cq_tail+1, __ATOMIC_RELEASE);
+
+	req->state = IOREQ_FREE;
+	rlist_push_back(& ring->free, & req->node);
+	ring->inflight--;
+}
+
+
+/* Try a request, and complete it, unless it would block */
+static void ioring_try(IO_RING_CB* ring, io_request* req)
+{
+	file_ops* ops = req->fcb->streamfunc;
+	void* sobj = req->fcb->streamobj;
+	io_sqe* sqe = & req->sqe;
+	int res = -1;
+
+	req->state = IOREQ_WAITING;
+
+	/* 
+		A stream without TryRead or TryWrite fails: its Read or Write
+		might block the thread in IoRingEnter, and with it the ring.
+	*/
+	if(sqe->opcode == IO_READ) {
+		if(ops->TryRead)
+			res = ops->TryRead(sobj, sqe->buf, sqe->size, & req->waiter);
+	}
+	else {
+		if(ops->TryWrite)
+			res = ops->TryWrite(sobj, sqe->buf, sqe->size, & req->waiter);
+	}
+
+	/* Else, the stream has the waiter, and it may have notified it already */
+	if(res != IO_AGAIN)
+		ioring_complete(ring, req, res);
+}
+
+
+/* Take the submitted entries, as long as there is room for their results */
+static int ioring_submit(IO_RING_CB* ring)
+{
+	io_ring* sh = & ring->shared;
+	unsigned int head = sh->sq_head;
+	unsigned int tail = __atomic_load_n(& sh->sq_tail, __ATOMIC_ACQUIRE);
+	int submitted = 0;
+
+	while(head != tail) {
+		unsigned int results = sh->cq_tail - __atomic_load_n(& sh->cq_head, __ATOMIC_ACQUIRE);
+		if(ring->inflight + results >= sh->cq_entries)
+			break;
+
+		io_request* req = rlist_pop_front(& ring->free)->obj;
+		req->sqe = sh->sq[head & (sh->sq_entries-1)];
+		ring->inflight++;
+		head++;
+		submitted++;
+
+		switch(req->sqe.opcode) {
+		case IO_NOP:
+			ioring_complete(ring, req, 0);
+			break;
+		case IO_READ:
+		case IO_WRITE:
+			req->fcb = get_fcb_ref(req->sqe.fd);
+			if(req->fcb == NULL)
+				ioring_complete(ring, req, -1);
+			else
+				ioring_try(ring, req);
+			break;
+		default:
+			ioring_complete(ring, req, -1);
+		}
+	}
+
+	__atomic_store_n(& sh->sq_head, head, __ATOMIC_RELEASE);
+	return submitted;
+}
+
+
+/* Try the requests that were notified */
+static void ioring_run(IO_RING_CB* ring)
+{
+	for(;;) {
+		int preempt = preempt_off;
+		spin_lock(& ring->lock);
+		io_request* req = is_rlist_empty(& ring->ready) ? NULL : rlist_pop_front(& ring->ready)->obj;
+		spin_unlock(& ring->lock);
+		if(preempt) preempt_on;
+
+		if(req == NULL) break;
+		ioring_try(ring, req);
+	}
+}
+
+
+/* Wait for a notification, or the timeout */
+static void ioring_wait(IO_RING_CB* ring, TimerDuration timeout)
+{
+	int preempt = preempt_off;
+	spin_lock(& ring->lock);
+	if(is_rlist_empty(& ring->ready)) {
+		ring->sleeper = CURTHREAD;
+		sleep_releasing(STOPPED, & ring->lock, SCHED_IO, timeout);
+		spin_lock(& ring->lock);
+		ring->sleeper = NULL;
+	}
+	spin_unlock(& ring->lock);
+	if(preempt) preempt_on;
+}
+
+
+io_ring* sys_IoRingSetup(unsigned int entries)
+{
+	if(entries == 0 || entries > IO_RING_MAX_ENTRIES)
+		return NULL;
+
+	PCB* pcb = CURPROC;
+	if(__atomic_load_n(& pcb->ioring, __ATOMIC_ACQUIRE) != NULL)
+		return NULL;
+
+	unsigned int sq_entries = 1;
+	while(sq_entries < entries) sq_entries <<= 1;
+	unsigned int cq_entries = 2*sq_entries;
+
+	IO_RING_CB* ring = xmalloc(sizeof(IO_RING_CB));
+	ring->shared = (io_ring) {
+		.sq_entries = sq_entries, .cq_entries = cq_entries,
+		.sq_head = 0, .sq_tail = 0, .cq_head = 0, .cq_tail = 0,
+		.sq = xmalloc(sq_entries*sizeof(io_sqe)),
+		.cq = xmalloc(cq_entries*sizeof(io_cqe))
+	};
+	ring->enter_lock = PIMUTEX_INIT;
+	ring->lock = MUTEX_INIT;
+	rlnode_init(& ring->ready, NULL);
+	ring->sleeper = NULL;
+	rlnode_init(& ring->free, NULL);
+	ring->inflight = 0;
+
+	/* A request for each result that may be pending */
+	ring->requests = xmalloc(cq_entries*sizeof(io_request));
+	for(unsigned int i=0; i<cq_entries; i++) {
+		io_request* req = & ring->requests[i];
+		req->fcb = NULL;
+		req->state = IOREQ_FREE;
+		req->ring = ring;
+		rlnode_init(& req->waiter.node, & req->waiter);
+		req->waiter.queue = NULL;
+		req->waiter.owner = req;
+		req->waiter.notify = ioring_notify;
+		rlnode_init(& req->node, req);
+		rlist_push_back(& ring->free, & req->node);
+	}
+
+	/* Another thread may have set up the rings meanwhile */
+	IO_RING_CB* none = NULL;
+	if(! __atomic_compare_exchange_n(& pcb->ioring, &none, ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		free(ring->requests);
+		free(ring->shared.sq);
+		free(ring->shared.cq);
+		free(ring);
+		return NULL;
+	}
+
+	return & ring->shared;
+}
+
+
+int sys_IoRingEnter(unsigned int min_complete, timeout_t timeout)
+{
+	IO_RING_CB* ring = __atomic_load_n(& CURPROC->ioring, __ATOMIC_ACQUIRE);
+	if(ring == NULL)
+		return -1;
+	io_ring* sh = & ring->shared;
+
+	TimerDuration deadline = (timeout == (timeout_t)-1) ? NO_TIMEOUT : bios_fine_clock() + timeout*1000ul;
+
+	PIMutex_Lock(& ring->enter_lock);
+
+	int submitted = ioring_submit(ring);
+	ioring_run(ring);
+
+	while(sh->cq_tail - __atomic_load_n(& sh->cq_head, __ATOMIC_ACQUIRE) < min_complete
+		&& ring->inflight > 0)
+	{
+		TimerDuration wait = NO_TIMEOUT;
+		if(deadline != NO_TIMEOUT) {
+			TimerDuration now = bios_fine_clock();
+			if(now >= deadline) break;
+			wait = deadline - now;
+		}
+		ioring_wait(ring, wait);
+		ioring_run(ring);
+	}
+
+	PIMutex_Unlock(& ring->enter_lock);
+	return submitted;
+}
+
+
+void ioring_destroy(PCB* pcb)
+{
+	IO_RING_CB* ring = pcb->ioring;
+	if(ring == NULL) return;
+	pcb->ioring = NULL;
+
+	/* After io_wait_cancel, the streams no longer notify the requests */
+	for(unsigned int i=0; i<ring->shared.cq_entries; i++) {
+		io_request* req = & ring->requests[i];
+		if(req->state == IOREQ_FREE) continue;
+		io_wait_cancel(& req->waiter);
+		if(req->fcb != NULL)
+			FCB_decref(req->fcb);
+	}
+
+	free(ring->requests);
+	free(ring->shared.sq);
+	free(ring->shared.cq);
+	free(ring);
+}
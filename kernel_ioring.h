@@ -0,0 +1,77 @@
+#ifndef __KERNEL_IORING_H
+#define __KERNEL_IORING_H
+
+#include "tinyos.h"
+#include "kernel_dev.h"
+#include "kernel_streams.h"
+#include "kernel_proc.h"
+
+/**
+	@file kernel_ioring.h
+	@brief Asynchronous I/O rings.
+
+	@defgroup ioring Asynchronous I/O.
+	@ingroup kernel
+	@brief Asynchronous I/O rings.
+
+	A process may have a pair of rings (see @c IoRingSetup), through
+	which it submits read and write operations, and receives their
+	results. An operation is a @c io_request of the ring.
+
+	The kernel tries an operation with the @c TryRead or @c TryWrite
+	method of the stream. If it would block, the stream keeps the
+	waiter of the request, and notifies it when it is ready (e.g., when
+	a pipe gets data, or from the interrupt handler of a serial port).
+	The notification moves the request to the @c ready list of the ring,
+	and wakes up the thread waiting in @c IoRingEnter, if any. That thread
+	tries the ready requests again, and queues the results. Therefore,
+	no thread is needed for an operation in flight; the operations are
+	carried out by the thread that enters the ring.
+
+	@{
+*/
+
+/** @brief The state of a request */
+typedef enum {
+	IOREQ_FREE,		/**< Not in use */
+	IOREQ_READY,	/**< To be tried, in the @c ready list of the ring */
+	IOREQ_WAITING	/**< Waiting for its stream, or being tried */
+} io_request_state;
+
+typedef struct io_ring_control_block IO_RING_CB;
+
+/** @brief An operation in flight. */
+typedef struct io_request {
+	io_sqe sqe;				/**< A copy of the submitted entry */
+	FCB* fcb;				/**< The stream, whose reference is held until completion */
+	io_request_state state;	/**< The state of the request */
+	io_waiter waiter;		/**< Added to a queue of the stream, when the operation would block */
+	rlnode node;			/**< Intrusive node for the @c ready and @c free lists */
+	IO_RING_CB* ring;		/**< The ring of the request */
+} io_request;
+
+/** @brief The kernel side of the rings of a process. */
+struct io_ring_control_block {
+	io_ring shared;			/**< The rings, shared with the process */
+	PIMutex enter_lock;		/**< Held by the thread in @c IoRingEnter */
+
+	Mutex lock;				/**< Spinlock for @c ready and @c sleeper, taken with preemption off */
+	rlnode ready;			/**< Requests whose streams notified them */
+	TCB* sleeper;			/**< The thread waiting for @c ready, or NULL */
+
+	rlnode free;			/**< Unused requests (protected by @c enter_lock) */
+	unsigned int inflight;	/**< Requests submitted and not completed (protected by @c enter_lock) */
+	io_request* requests;	/**< All the requests, one per entry of the completion ring */
+};
+
+/**
+	@brief Destroy the rings of a process, if it has any.
+
+	The operations in flight are cancelled. This is called by @c Exit,
+	after the other threads of the process have exited.
+*/
+void ioring_destroy(PCB* pcb);
+
+/** @} */
+
+#endif
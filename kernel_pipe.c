@@ -11,14 +11,16 @@ file_ops pipe_reader = {
   .Open = NULL,
   .Read = pipe_read,
   .Write = NULL,
-  .Close = pipe_reader_close
+  .Close = pipe_reader_close,
+  .TryRead = pipe_try_read
 };
 
 file_ops pipe_writer = {
   .Open = NULL,
   .Read = NULL,
   .Write = pipe_write,
-  .Close = pipe_writer_close
+  .Close = pipe_writer_close,
+  .TryWrite = pipe_try_write
 };
 
 int sys_Pipe(pipe_t* pipe)
@@ -51,8 +53,11 @@ int Initialize_Pipe(FCB* fcb1,FCB* fcb2)
     fcb[1]->streamfunc = &pipe_writer;
     pipe_cb->reader=fcb[0];
     pipe_cb->writer=fcb[1];
+    pipe_cb->lock=PIMUTEX_INIT;
     pipe_cb->In_Cv=COND_INIT;
     pipe_cb->Out_Cv=COND_INIT;
+    io_waitqueue_init(&pipe_cb->readq);
+    io_waitqueue_init(&pipe_cb->writeq);
     pipe_cb->w=0; //Write pointer on this ring buffer
     pipe_cb->r=0; //Read pointer - HEAD on this ring buffer
     
@@ -71,14 +76,14 @@ char get_char(PIPE_CB* pipe)
   
   while ((pipe->w)==0)
   {
-    kernel_wait(&pipe->Out_Cv,SCHED_PIPE);//Wait on Output-consumer cv
+    kernel_wait(&pipe->lock,&pipe->Out_Cv,SCHED_PIPE);//Wait on Output-consumer cv
   }
 
   retVal=(pipe->buffer)[pipe->r];
   pipe->r=(pipe->r+1)%BUF_SIZE; //We use buffer as ring instaid of a simple array
   pipe->w--;
 
-  Cond_Broadcast(&pipe->In_Cv);//Broadcast Input-producer cv
+  kernel_broadcast(&pipe->lock,&pipe->In_Cv);//Broadcast Input-producer cv
 
   return retVal;
 
@@ -91,28 +96,30 @@ void put_char(char ch, PIPE_CB* pipe)
 {
     while((pipe->w)==BUF_SIZE)
     {
-      kernel_wait(&pipe->In_Cv,SCHED_PIPE); // Buffer is full! Wait on Input Cv
+      io_notify(&pipe->readq); // Asynchronous readers must not wait for the end of the write
+      kernel_wait(&pipe->lock,&pipe->In_Cv,SCHED_PIPE); // Buffer is full! Wait on Input Cv
     }
     
     (pipe->buffer)[(pipe->r+pipe->w)%BUF_SIZE]=ch;//We use buffer as ring instaid of a simple array
     pipe->w++;
 
     
-    Cond_Broadcast(&pipe->Out_Cv);//Broadcast consumer cv
+    kernel_broadcast(&pipe->lock,&pipe->Out_Cv);//Broadcast consumer cv
 }
 
 int pipe_write(void* pipe, const char* buf, unsigned int size)
 {
   	PIPE_CB* pipe_cb = (PIPE_CB*) pipe;
 
-  	 if(pipe_cb->writer==NULL || pipe_cb->reader==NULL) 
+  	PIMutex_Lock(&pipe_cb->lock);
+  	 if(pipe_cb->writer==NULL || pipe_cb->reader==NULL) {
+  	   PIMutex_Unlock(&pipe_cb->lock);
   	   return -1; //Fail!
+  	 }
   	
 	 int i=0;
    int noOfWr=0;
 
-   pipe_cb->r=0;
-
 	 while(i < size)
      { 
        put_char(buf[i],pipe_cb);//Call put_char every single time
@@ -120,6 +127,8 @@ int pipe_write(void* pipe, const char* buf, unsigned int size)
        i++;
      }
 
+	io_notify(&pipe_cb->readq);
+	PIMutex_Unlock(&pipe_cb->lock);
 	return noOfWr;
 }
 
@@ -128,40 +137,115 @@ int pipe_read(void* pipe, char *buf, unsigned int size)///den prepei na pairnei
         
   PIPE_CB* pipe_cb= (PIPE_CB*) pipe;
 
-  char *temp=(char*)malloc(sizeof(char)*size);
-
   int i=-1;
-  char ch; 
   int counter=size;//We count how much elements have we read
   int noOfRd=0;
   
 
-   if(pipe_cb->reader==NULL)
+  PIMutex_Lock(&pipe_cb->lock);
+   if(pipe_cb->reader==NULL) {
+    PIMutex_Unlock(&pipe_cb->lock);
     return -1; //Fail!  	
+   }
 
-  if(pipe_cb->writer!=NULL)
-  {
-    do
-    {
-      i=i+1;
-      ch=get_char(pipe_cb);//Call get_char every single time 
-      temp[i]=ch;
-      counter--;
-      noOfRd++;
-    }while(pipe_cb->w!=0 && counter>0);
-          
-    memcpy(buf,temp,strlen(temp));
-    return noOfRd;
-  }        
-  else
+  /* Data written before the writer closed must still be read */
+  while(pipe_cb->w==0 && pipe_cb->writer!=NULL)
+    kernel_wait(&pipe_cb->lock,&pipe_cb->Out_Cv,SCHED_PIPE);
+
+  if(pipe_cb->w==0) {
+    PIMutex_Unlock(&pipe_cb->lock);
     return 0; //EOF
+  }
+
+  do
+  {
+    i=i+1;
+    buf[i]=get_char(pipe_cb);//Call get_char every single time 
+    counter--;
+    noOfRd++;
+  }while(pipe_cb->w!=0 && counter>0);
+
+  io_notify(&pipe_cb->writeq);
+  PIMutex_Unlock(&pipe_cb->lock);
+  return noOfRd;
+}
+
+/* Read without blocking, for asynchronous I/O */
+int pipe_try_read(void* pipe, char *buf, unsigned int size, io_waiter* w)
+{
+  PIPE_CB* pipe_cb = (PIPE_CB*) pipe;
+
+  PIMutex_Lock(&pipe_cb->lock);
+  if(pipe_cb->reader==NULL) {
+    PIMutex_Unlock(&pipe_cb->lock);
+    return -1;
+  }
+
+  if(pipe_cb->w==0) {
+    int ret = 0; //EOF
+    if(pipe_cb->writer!=NULL) {
+      io_wait(&pipe_cb->readq, w);
+      ret = IO_AGAIN;
+    }
+    PIMutex_Unlock(&pipe_cb->lock);
+    return ret;
+  }
+
+  uint n = (size < pipe_cb->w) ? size : pipe_cb->w;
+  for(uint i=0; i<n; i++) {
+    buf[i] = pipe_cb->buffer[pipe_cb->r];
+    pipe_cb->r = (pipe_cb->r+1)%BUF_SIZE;
+  }
+  pipe_cb->w -= n;
+
+  kernel_broadcast(&pipe_cb->lock,&pipe_cb->In_Cv);
+  io_notify(&pipe_cb->writeq);
+  PIMutex_Unlock(&pipe_cb->lock);
+  return n;
+}
+
+/* Write as much as fits without blocking, for asynchronous I/O */
+int pipe_try_write(void* pipe, const char* buf, unsigned int size, io_waiter* w)
+{
+  PIPE_CB* pipe_cb = (PIPE_CB*) pipe;
+
+  PIMutex_Lock(&pipe_cb->lock);
+  if(pipe_cb->writer==NULL || pipe_cb->reader==NULL) {
+    PIMutex_Unlock(&pipe_cb->lock);
+    return -1;
+  }
+
+  if(pipe_cb->w==BUF_SIZE) {
+    io_wait(&pipe_cb->writeq, w);
+    PIMutex_Unlock(&pipe_cb->lock);
+    return IO_AGAIN;
+  }
+
+  uint n = (size < BUF_SIZE-pipe_cb->w) ? size : BUF_SIZE-pipe_cb->w;
+  for(uint i=0; i<n; i++)
+    pipe_cb->buffer[(pipe_cb->r+pipe_cb->w+i)%BUF_SIZE] = buf[i];
+  pipe_cb->w += n;
+
+  kernel_broadcast(&pipe_cb->lock,&pipe_cb->Out_Cv);
+  io_notify(&pipe_cb->readq);
+  PIMutex_Unlock(&pipe_cb->lock);
+  return n;
 }
 
 int pipe_writer_close(void* pipe)
 {
  	PIPE_CB* new_pipe= (PIPE_CB*) pipe;//an kai ta dio fid einai adeia
+ 	PIMutex_Lock(&new_pipe->lock);
  	new_pipe->writer=NULL;
- 	if(new_pipe->reader==NULL)
+ 	int last = (new_pipe->reader==NULL);
+ 	if(! last) {
+ 		kernel_broadcast(&new_pipe->lock,&new_pipe->Out_Cv); //The reader must see EOF
+ 		io_notify(&new_pipe->readq);
+ 	}
+ 	PIMutex_Unlock(&new_pipe->lock);
+
+ 	/* The other end is closed too, so nobody else uses the pipe */
+ 	if(last)
  		free(pipe);
    
      return 0;
@@ -171,9 +255,14 @@ int pipe_reader_close(void* pipe)
 {
 
   	PIPE_CB* new_pipe= (PIPE_CB*) pipe;
+  	PIMutex_Lock(&new_pipe->lock);
   	new_pipe->reader=NULL;
+  	int last = (new_pipe->writer==NULL);
+  	if(! last)
+  		io_notify(&new_pipe->writeq); //Asynchronous writes fail
+  	PIMutex_Unlock(&new_pipe->lock);
 
-  	if(new_pipe->writer==NULL) 
+  	if(last) 
     	free(pipe);
     return 0;
 }
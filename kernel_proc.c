@@ -4,6 +4,7 @@
 #include "kernel_streams.h"
 #include "kernel_threads.h"
 #include "kernel_dev.h"
+#include "kernel_ioring.h"
 
 
 /* 
@@ -19,6 +20,9 @@
 /* The process table */
 PCB PT[MAX_PROC];
 
+/* The lock of the process table (see kernel_proc.h) */
+PIMutex proc_lock = PIMUTEX_INIT;
+
 unsigned int process_count;
 
 PCB* get_pcb(Pid_t pid)
@@ -35,11 +39,18 @@ Pid_t get_pid(PCB* pcb)
 static inline void initialize_PCB(PCB* pcb)
 {
   pcb->pstate = FREE;
+  pcb->nice = 0;
+  pcb->vruntime = 0;
+  pcb->run_time = 0;
+  pcb->vol_switches = 0;
+  pcb->invol_switches = 0;
   pcb->argl = 0;
   pcb->args = NULL;
 
   for(int i=0;i<MAX_FILEID;i++)
     pcb->FIDT[i] = NULL;
+  pcb->FIDT_lock = MUTEX_INIT;
+  pcb->ioring = NULL;
 
   rlnode_init(& pcb->ptcbs, NULL);
   rlnode_init(& pcb->children_list, NULL);
@@ -47,6 +58,7 @@ static inline void initialize_PCB(PCB* pcb)
   rlnode_init(& pcb->children_node, pcb);
   rlnode_init(& pcb->exited_node, pcb);
   pcb->child_exit = COND_INIT;
+  pcb->thread_exit = COND_INIT;
 
   rlnode_init(& pcb->ptcbs, NULL);
 }
@@ -70,8 +82,8 @@ void initialize_processes()
 
   process_count = 0;
 
-  /* Execute a null "idle" process */
-  if(Exec(NULL,0,NULL)!=0)
+  /* Execute a null "idle" process (there is no thread yet to hold proc_lock) */
+  if(process_create(NULL,0,NULL)!=0)
     FATAL("The scheduler process does not have pid==0");
 }
 
@@ -79,7 +91,7 @@ void initialize_processes()
 
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 PCB* acquire_PCB()
 {
@@ -96,7 +108,7 @@ PCB* acquire_PCB()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 void release_PCB(PCB* pcb)
 {
@@ -126,8 +138,10 @@ void start_main_thread()
   
   exitval = call(argl,args);
 
+  PIMutex_Lock(& proc_lock);
   rlist_pop_front(&CURPROC->ptcbs);
   free(CURTHREAD->owner_ptcb);
+  PIMutex_Unlock(& proc_lock);
 
   Exit(exitval);
 }
@@ -143,7 +157,7 @@ void start_new_thread()
 
  // CURTHREAD->owner_ptcb->exitval=exitval;
 
-  sys_ThreadExit(exitval);
+  ThreadExit(exitval);
 }
 
 /*
@@ -151,6 +165,15 @@ void start_new_thread()
  */
 
 Pid_t sys_Exec(Task call, int argl, void* args)
+{
+  PIMutex_Lock(& proc_lock);
+  Pid_t pid = process_create(call, argl, args);
+  PIMutex_Unlock(& proc_lock);
+  return pid;
+}
+
+
+Pid_t process_create(Task call, int argl, void* args)
 { PCB *curproc, *newproc;
   
   /* The new process PCB */
@@ -158,6 +181,14 @@ Pid_t sys_Exec(Task call, int argl, void* args)
 
   if(newproc == NULL) goto finish;  /* We have run out of PIDs! */
 
+  newproc->migrations = 0;
+  newproc->deadline_misses = 0;
+  newproc->nice = 0;
+  newproc->vruntime = 0;   /* Moved forward when first queued */
+  newproc->run_time = 0;
+  newproc->vol_switches = 0;
+  newproc->invol_switches = 0;
+
   if(get_pid(newproc)<=1) {
     /* Processes with pid<=1 (the scheduler and the init process) 
        are parentless and are treated specially. */
@@ -172,12 +203,17 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     newproc->parent = curproc;
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
+    /* Inherit the nice value */
+    newproc->nice = curproc->nice;
+
     /* Inherit file streams from parent */
+    spin_lock(& curproc->FIDT_lock);
     for(int i=0; i<MAX_FILEID; i++) {
        newproc->FIDT[i] = curproc->FIDT[i];
        if(newproc->FIDT[i])
           FCB_incref(newproc->FIDT[i]);
     }
+    spin_unlock(& curproc->FIDT_lock);
   }
 
 
@@ -203,7 +239,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
 
     PTCB *  main_ptcb =(PTCB*)xmalloc(sizeof(PTCB));
 
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
+    newproc->main_thread = spawn_thread(newproc, start_main_thread, THREAD_STACK_SIZE);
 
     newproc->thread_counter=1;
 
@@ -233,16 +269,35 @@ finish:
 }
 
 
-/* System call */
+/* System call (read-only, see kernel_sys.h) */
 Pid_t sys_GetPid()
 {
-  return get_pid(CURPROC);
+  return get_pid(cur_thread()->owner_pcb);
 }
 
 
+/* System call (read-only). The parent changes, atomically, when it exits. */
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  PCB* parent = __atomic_load_n(& cur_thread()->owner_pcb->parent, __ATOMIC_RELAXED);
+  return get_pid(parent);
+}
+
+
+int sys_SetNice(Pid_t pid, int nice)
+{
+  if(pid<0 || pid>=MAX_PROC || nice<NICE_MIN || nice>NICE_MAX)
+    return -1;
+
+  int ret = -1;
+  PIMutex_Lock(& proc_lock);
+  PCB* pcb = get_pcb(pid);
+  if(pcb != NULL && pcb->pstate == ALIVE && (pcb == CURPROC || pcb->parent == CURPROC)) {
+    pcb->nice = nice;
+    ret = 0;
+  }
+  PIMutex_Unlock(& proc_lock);
+  return ret;
 }
 
 
@@ -277,7 +332,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(& proc_lock, & parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
   
@@ -299,7 +354,7 @@ static Pid_t wait_for_any_child(int* status)
   }
 
   while(is_rlist_empty(& parent->exited_list)) {
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(& proc_lock, & parent->child_exit, SCHED_USER);
   }
 
   PCB* child = parent->exited_list.next->pcb;
@@ -314,15 +369,19 @@ finish:
 
 Pid_t sys_WaitChild(Pid_t cpid, int* status)
 {
+  PIMutex_Lock(& proc_lock);
+
   /* Wait for specific child. */
   if(cpid != NOPROC) {
-    return wait_for_specific_child(cpid, status);
+    cpid = wait_for_specific_child(cpid, status);
   }
   /* Wait for any child */
   else {
-    return wait_for_any_child(status);
+    cpid = wait_for_any_child(status);
   }
 
+  PIMutex_Unlock(& proc_lock);
+  return cpid;
 }
 
 
@@ -336,26 +395,52 @@ void sys_Exit(int exitval)
 
   PCB *curproc = CURPROC;  /* cache for efficiency */
 
+  PIMutex_Lock(& proc_lock);
+
+  /* 
+    The other threads of the process use the PCB until they exit, so 
+    the process must not become a zombie (which the parent may reap) 
+    before they do.
+  */
+  for(;;) {
+    int running = 0;
+    for(rlnode* n = curproc->ptcbs.next; n != & curproc->ptcbs; n = n->next)
+      if(! n->ptcb->exited && n->ptcb->thread != CURTHREAD) { running = 1; break; }
+    if(! running) break;
+    kernel_wait(& proc_lock, & curproc->thread_exit, SCHED_USER);
+  }
+
+  /* Free the PTCBs left over (of threads that were never joined) */
+  while(! is_rlist_empty(& curproc->ptcbs))
+    free(rlist_pop_front(& curproc->ptcbs)->ptcb);
+
   /* Do all the other cleanup we want here, close files etc. */
   if(curproc->args) {
     free(curproc->args);
     curproc->args = NULL;
   }
 
-  /* Clean up FIDT */
+  /* Clean up FIDT. Closing a stream may block (e.g., on the lock of a
+     pipe), so this is done without holding proc_lock. The operations
+     of the I/O rings hold streams too, so they are cancelled first. */
+  PIMutex_Unlock(& proc_lock);
+  ioring_destroy(curproc);
   for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
+    spin_lock(& curproc->FIDT_lock);
+    FCB* fcb = curproc->FIDT[i];
+    curproc->FIDT[i] = NULL;
+    spin_unlock(& curproc->FIDT_lock);
+    if(fcb != NULL)
+      FCB_decref(fcb);
   }
+  PIMutex_Lock(& proc_lock);
 
   /* Reparent any children of the exiting process to the 
      initial task */
   PCB* initpcb = get_pcb(1);
   while(!is_rlist_empty(& curproc->children_list)) {
     rlnode* child = rlist_pop_front(& curproc->children_list);
-    child->pcb->parent = initpcb;
+    __atomic_store_n(& child->pcb->parent, initpcb, __ATOMIC_RELAXED);  /* see sys_GetPPid */
     rlist_push_front(& initpcb->children_list, child);
   }
 
@@ -363,13 +448,13 @@ void sys_Exit(int exitval)
      and signal the initial task */
   if(!is_rlist_empty(& curproc->exited_list)) {
     rlist_append(& initpcb->exited_list, &curproc->exited_list);
-    kernel_broadcast(& initpcb->child_exit);
+    kernel_broadcast(& proc_lock, & initpcb->child_exit);
   }
 
   /* Put me into my parent's exited list */
   if(curproc->parent != NULL) {   /* Maybe this is init */
     rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
-    kernel_broadcast(& curproc->parent->child_exit);
+    kernel_broadcast(& proc_lock, & curproc->parent->child_exit);
   }
 
   /* Disconnect my main_thread */
@@ -380,7 +465,7 @@ void sys_Exit(int exitval)
   curproc->exitval = exitval;
 
   /* Bye-bye cruel world */
-  kernel_sleep(EXITED, SCHED_USER);
+  kernel_sleep(& proc_lock, EXITED, SCHED_USER);
 }
 
 /* 
@@ -411,12 +496,11 @@ int cthulhu_close (void *pi)
 int cthulhu_read (void *pi, char* buf, unsigned int size)
 {
   procinfo* pinfo = (procinfo*)pi;
-  void* pi_args = PT[pinfo->read_count].args;
-  int i;
 
   if(pinfo->read_count>=MAX_PROC)
     return 0;
 
+  PIMutex_Lock(& proc_lock);
   while(pinfo->read_count<MAX_PROC)
   {
     if (PT[pinfo->read_count].pstate != FREE)
@@ -427,26 +511,31 @@ int cthulhu_read (void *pi, char* buf, unsigned int size)
       pinfo->alive=PT[pinfo->read_count].pstate==ALIVE ? 1 :  0;
 
       pinfo->thread_count=(unsigned long) PT[pinfo->read_count].thread_counter+1;
+      pinfo->migrations=PT[pinfo->read_count].migrations;
+      pinfo->deadline_misses=PT[pinfo->read_count].deadline_misses;
+      pinfo->nice=PT[pinfo->read_count].nice;
+      pinfo->run_time=PT[pinfo->read_count].run_time;
+      pinfo->vol_switches=PT[pinfo->read_count].vol_switches;
+      pinfo->invol_switches=PT[pinfo->read_count].invol_switches;
       pinfo->main_task=PT[pinfo->read_count].main_task;
       pinfo->argl=PT[pinfo->read_count].argl;
 
       if (PT[pinfo->read_count].args)
       {
-        for (i=0; i<PROCINFO_MAX_ARGS_SIZE; i++)
-        {
-          pinfo->args[i] = *(char*)pi_args;
-
-          pi_args++; //size of char = 1
-        }
+        int argl = PT[pinfo->read_count].argl;
+        memcpy(pinfo->args, PT[pinfo->read_count].args, 
+          (argl < PROCINFO_MAX_ARGS_SIZE) ? argl : PROCINFO_MAX_ARGS_SIZE);
       } 
       memcpy(buf,(char*)pinfo,size); //READ
       size=sizeof(pinfo);
       pinfo->read_count++;
 
+      PIMutex_Unlock(& proc_lock);
       return size;
     }
     pinfo->read_count++;  
   }
+  PIMutex_Unlock(& proc_lock);
   return 0;
 }
 
@@ -466,3 +555,66 @@ Fid_t sys_OpenInfo()
   return fid;
 }
 
+
+/* 
+  The core information stream returns one coreinfo block per core. 
+  The stream object is the index of the next core to read.
+*/
+
+static int coreinfo_read(void* ci, char* buf, unsigned int size)
+{
+  uint* next = (uint*) ci;
+
+  if(*next >= cpu_cores() || size < sizeof(coreinfo))
+    return 0;
+
+  CCB* ccb = & cctx[*next];
+  coreinfo info = {
+    .core = *next,
+    .busy_time = ccb->busy_time,
+    .idle_time = ccb->idle_time,
+    .switches = ccb->switches,
+    .invol_switches = ccb->invol_switches,
+    .steals = ccb->steals,
+    .migrations = ccb->migrations,
+    .balanced = ccb->balanced,
+    .idle_halts = ccb->idle_halts,
+    .idle_spin_hits = ccb->idle_spin_hits,
+    .idle_wakeups = ccb->idle_wakeups,
+    .idle_latency = ccb->idle_latency,
+    .idle_latency_max = ccb->idle_latency_max
+  };
+  memcpy(buf, &info, sizeof(info));
+  (*next)++;
+  return sizeof(info);
+}
+
+static int coreinfo_close(void* ci)
+{
+  free(ci);
+  return 0;
+}
+
+static file_ops coreinfo_ops = {
+  .Open = NULL,
+  .Read = coreinfo_read,
+  .Write = NULL,
+  .Close = coreinfo_close
+};
+
+Fid_t sys_OpenCoreInfo()
+{
+  FCB* fcb;
+  Fid_t fid;
+
+  if(!FCB_reserve(1,&fid,&fcb))
+    return NOFILE;
+
+  uint* next = xmalloc(sizeof(uint));
+  *next = 0;
+  fcb->streamobj = next;
+  fcb->streamfunc = &coreinfo_ops;
+
+  return fid;
+}
+
@@ -12,6 +12,10 @@
   This file defines the PCB structure and basic helpers for
   process access.
 
+  The process table, the tree of processes and the threads of each
+  process (the PTCBs) are protected by @c proc_lock. The fileid table 
+  of a process is protected by its own spinlock, @c FIDT_lock.
+
   @{
 */ 
 
@@ -56,13 +60,29 @@ typedef struct process_control_block {
   rlnode children_node;   /**< Intrusive node for @c children_list */
   rlnode exited_node;     /**< Intrusive node for @c exited_list */
   CondVar child_exit;     /**< Condition variable for @c WaitChild */
+  CondVar thread_exit;    /**< Condition variable signalled when a thread of this process exits */
 
   FCB* FIDT[MAX_FILEID];  /**< The fileid table of the process */
+  Mutex FIDT_lock;        /**< Spinlock for @c FIDT (see @c spin_lock) */
+  struct io_ring_control_block* ioring;  /**< The asynchronous I/O rings (see kernel_ioring.h), or NULL */
 
   int thread_counter; //Need to sysinfo!!!
+
+  unsigned long migrations; /**< Times the threads of this process moved to another core */
+  unsigned long deadline_misses; /**< Deadlines missed by the periodic threads of this process */
+
+  int nice;               /**< The nice value, which sets the weight of the process in scheduling */
+  TimerDuration vruntime; /**< The execution time of the threads, scaled by the weight (see @c sched_charge) */
+
+  TimerDuration run_time;       /**< The execution time of the threads of this process, in microseconds */
+  unsigned long vol_switches;   /**< Times the threads of this process blocked (see @c TCB.vol_switches) */
+  unsigned long invol_switches; /**< Times the threads of this process were switched out while ready */
 } PCB;
 
 
+/** @brief The lock of the process table */
+extern PIMutex proc_lock;
+
 void start_new_thread();
 
 int cthulhu_read ();
@@ -76,6 +96,14 @@ int cthulhu_close ();
 */
 void initialize_processes();
 
+/**
+  @brief Create a new process, as @c Exec.
+
+  *** MUST BE CALLED WITH proc_lock HELD ***, except at boot, when there
+  is no thread yet to hold it (see @c boot_tinyos_kernel).
+*/
+Pid_t process_create(Task call, int argl, void* args);
+
 /**
   @brief Get the PCB for a PID.
 
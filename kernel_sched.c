@@ -5,6 +5,7 @@
 #include "kernel_cc.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_trace.h"
 
 #ifndef NVALGRIND
 #include <valgrind/valgrind.h>
@@ -48,15 +49,18 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 /* The memory allocated for the TCB must be a multiple of SYSTEM_PAGE_SIZE */
 #define THREAD_TCB_SIZE   (((sizeof(TCB)+SYSTEM_PAGE_SIZE-1)/SYSTEM_PAGE_SIZE)*SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE  (THREAD_TCB_SIZE+THREAD_STACK_SIZE)
-
-//#define MMAPPED_THREAD_MEM 
+#define MMAPPED_THREAD_MEM 
 #ifdef MMAPPED_THREAD_MEM 
 
+/* A guard page separates the stack from the TCB, below the stack */
+#define THREAD_GUARD_SIZE  SYSTEM_PAGE_SIZE
+
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread. The block is only a reservation of
+  address space (MAP_NORESERVE): pages are committed by the host as they 
+  are touched, so a thread uses only as much memory as its stack depth.
+  The guard page below the stack is made inaccessible, so that a stack 
+  overflow is detected as seg.fault, instead of corrupting the TCB.
  */
 void free_thread(void* ptr, size_t size)
 {
@@ -67,14 +71,18 @@ void* allocate_thread(size_t size)
 {
   void* ptr = mmap(NULL, size, 
       PROT_READ|PROT_WRITE|PROT_EXEC,  
-      MAP_ANONYMOUS  | MAP_PRIVATE 
+      MAP_ANONYMOUS  | MAP_PRIVATE | MAP_NORESERVE
       , -1,0);
   
   CHECK((ptr==MAP_FAILED)?-1:0);
+  CHECK(mprotect(ptr+THREAD_TCB_SIZE, THREAD_GUARD_SIZE, PROT_NONE));
 
   return ptr;
 }
 #else
+
+#define THREAD_GUARD_SIZE  0
+
 /*
   Use malloc to allocate a thread. This is probably faster than  mmap, but cannot
   be made easily to 'detect' stack overflow.
@@ -92,6 +100,57 @@ void* allocate_thread(size_t size)
 }
 #endif
 
+/* The size of the memory block of a thread with the given stack size */
+#define THREAD_SIZE(stack_size)  (THREAD_TCB_SIZE+THREAD_GUARD_SIZE+(stack_size))
+
+
+/*
+  Per-core cache of thread blocks.
+
+  Each core keeps up to THREAD_POOL_WATERMARK blocks of exited threads,
+  linked through the rt_node of their (dead) TCB. Only the owner core
+  touches its pool, with preemption off, so no lock is needed.
+  Only blocks with the default stack size are cached.
+*/
+static TCB* thread_pool_get(size_t stack_size)
+{
+  if(stack_size != THREAD_STACK_SIZE)
+    return (TCB*) allocate_thread(THREAD_SIZE(stack_size));
+
+  int preempt = preempt_off;
+  CCB* ccb = & CURCORE;
+  TCB* tcb = NULL;
+  if(ccb->thread_pool_size > 0) {
+    tcb = rlist_pop_front(& ccb->thread_pool)->tcb;
+    ccb->thread_pool_size--;
+  }
+  if(preempt) preempt_on;
+
+  return (tcb != NULL) ? tcb : (TCB*) allocate_thread(THREAD_SIZE(THREAD_STACK_SIZE));
+}
+
+/* This is called in the non-preemptive domain */
+static void thread_pool_put(TCB* tcb)
+{
+  CCB* ccb = & CURCORE;
+  if(tcb->stack_size == THREAD_STACK_SIZE && ccb->thread_pool_size < THREAD_POOL_WATERMARK) {
+    rlnode_init(& tcb->rt_node, tcb);
+    rlist_push_front(& ccb->thread_pool, & tcb->rt_node);
+    ccb->thread_pool_size++;
+  } 
+  else
+    free_thread(tcb, THREAD_SIZE(tcb->stack_size));
+}
+
+/* Release all blocks of the core's pool */
+static void thread_pool_drain()
+{
+  CCB* ccb = & CURCORE;
+  while(ccb->thread_pool_size > 0) {
+    free_thread(rlist_pop_front(& ccb->thread_pool)->tcb, THREAD_SIZE(THREAD_STACK_SIZE));
+    ccb->thread_pool_size--;
+  }
+}
 
 
 /*
@@ -110,14 +169,23 @@ static void thread_start()
 }
 
 
+static void sched_reserve_timeouts(size_t n);
+
 /*
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb, void (*func)())
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size)
 {
   /* The allocated thread size must be a multiple of page size */
-  TCB* tcb = (TCB*) allocate_thread(THREAD_SIZE);
+  if(stack_size == 0) 
+    stack_size = THREAD_STACK_SIZE;
+  if(stack_size < THREAD_STACK_MIN)
+    stack_size = THREAD_STACK_MIN;
+  stack_size = ((stack_size+SYSTEM_PAGE_SIZE-1)/SYSTEM_PAGE_SIZE)*SYSTEM_PAGE_SIZE;
+
+  TCB* tcb = thread_pool_get(stack_size);
+  tcb->stack_size = stack_size;
 
   /* Set the owner */
   tcb->owner_pcb = pcb;
@@ -126,33 +194,55 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
   tcb->type = NORMAL_THREAD;
   tcb->state = INIT;
   tcb->phase = CTX_CLEAN;
+  tcb->state_spinlock = MUTEX_INIT;
+  tcb->thread_priority = DEFAULT_PRIORITY;
+  tcb->inherited_priority = -1;
+  tcb->pi_held = 0;
+  tcb->feedback_level = LEVEL_MAX;
+  tcb->rt_period = 0;
+  tcb->rt_left = 0;
+  tcb->rt_misses = 0;
+  rlnode_init(& tcb->rt_node, tcb);
   tcb->thread_func = func;
   tcb->wakeup_time = NO_TIMEOUT;
-  rlnode_init(& tcb->sched_node, tcb);  /* Intrusive list node */
+  tcb->timeout_index = -1;
+  tcb->last_core = cpu_core_id;
+  tcb->last_waker = NULL;
+  tcb->affinity = (CURTHREAD != NULL) ? CURTHREAD->affinity : ALL_CORES;
+  tcb->queue_core = -1;
+  tcb->run_start = 0;
+  tcb->sched_key = 0;
+  tcb->run_time = 0;
+  tcb->vol_switches = 0;
+  tcb->invol_switches = 0;
+  rtnode_init(& tcb->sched_node, tcb);  /* Intrusive tree node */
 
 
   /* Compute the stack segment address and size */
-  void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+  void* sp = ((void*)tcb) + THREAD_TCB_SIZE + THREAD_GUARD_SIZE;
 
   /* Init the context */
-  cpu_initialize_context(& tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+  cpu_initialize_context(& tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
   tcb->valgrind_stack_id = 
-    VALGRIND_STACK_REGISTER(sp, sp+THREAD_STACK_SIZE);
+    VALGRIND_STACK_REGISTER(sp, sp+stack_size);
 #endif
 
   /* increase the count of active threads */
-  Mutex_Lock(&active_threads_spinlock);
-  active_threads++;
-  Mutex_Unlock(&active_threads_spinlock);
+  spin_lock(&active_threads_spinlock);
+  size_t nthreads = ++active_threads;
+  spin_unlock(&active_threads_spinlock);
+
+  /* Make room for every thread in the timeout heap */
+  sched_reserve_timeouts(nthreads);
  
   return tcb;
 }
 
 
 /*
-  This is called with tcb->state_spinlock locked !
+  This is called after the thread has exited, with no scheduler locks held.
  */
 void release_TCB(TCB* tcb)
 {
@@ -160,11 +250,11 @@ void release_TCB(TCB* tcb)
   VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);    
 #endif
 
-  free_thread(tcb, THREAD_SIZE);
+  thread_pool_put(tcb);
 
-  Mutex_Lock(&active_threads_spinlock);
+  spin_lock(&active_threads_spinlock);
   active_threads--;
-  Mutex_Unlock(&active_threads_spinlock);
+  spin_unlock(&active_threads_spinlock);
 }
 
 
@@ -185,19 +275,244 @@ CCB cctx[MAX_CORES];
 
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
-  
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
-  Both of these structures are protected by @c sched_spinlock.
+  Each core keeps its own scheduler queue, which is protected by the 
+  core's ready_spinlock. Threads are pushed to the queue of the 
+  core that readies them and popped by the same core; a core whose queue 
+  is empty steals from the queues of other cores.
+
+  The scheduler queue of a core is an array of ordered trees (field 
+  ready_queue of the CCB), one per thread priority, plus a bitmap of the
+  non-empty trees (field ready_mask). The index of a thread's tree is its 
+  priority (see rq_index), so the first thread of the highest non-empty 
+  tree is found in O(1) time, and threads of a higher priority always 
+  come first.
+
+  Within a priority, threads are scheduled fairly between processes, 
+  rather than between threads. Each process has a virtual runtime (field
+  vruntime of the PCB), which grows by the execution time of its threads,
+  scaled by the weight of the process (see SetNice). It is charged
+  whenever a thread leaves the core (see sched_charge). A thread is 
+  queued with the virtual runtime of its process as its key, so the 
+  process which received the least service, for its weight, runs first.
+  A process with many threads gets no more than a process with one.
+
+  Among the threads of a process, the queue is a multilevel feedback 
+  queue: the key of a thread is  vruntime*FEEDBACK_LEVELS + LEVEL_MAX-level
+  (see rq_key). The key of a queued thread becomes stale when its process
+  runs elsewhere; the first thread of a queue is brought up to date before
+  it is selected (see rq_refresh), and then all the queued threads of its
+  process have the same virtual runtime, and the highest level goes first.
+  The level of a thread is adjusted on each yield, according to the cause:
+  - SCHED_QUANTUM  lowers the level by one (CPU-bound threads sink)
+  - SCHED_IO       raises the thread to the top level (interactive threads)
+  - SCHED_PIPE     raises the level by one
+  Also, every PRIORITY_BOOST_PERIOD each core raises all its threads to
+  the top level, so that CPU-bound threads do not starve.
+
+  The state and phase of each thread are protected by the thread's own
+  state_spinlock.
+
+  Also, the scheduler contains a binary min-heap of all the sleeping
+  threads with a timeout, ordered by wakeup_time and protected by 
+  @c timeout_spinlock. Each thread in the heap records its position
+  (field timeout_index), so that it can be removed in O(log n) time
+  when it is woken up before its timeout.
+
+  The scheduler is tickless: the core timer is not armed for a quantum 
+  when no other thread waits for the core, but it is always armed for 
+  the earliest timeout in the heap (see sched_arm_timer). Timeouts are
+  measured by bios_fine_clock(), whose resolution suits periodic threads.
+
+  Each thread has an affinity mask of the cores it may run on. A thread
+  is only queued on an allowed core (see sched_choose_core) and only 
+  stolen by an allowed core; each thread records the core whose queue 
+  holds it (field queue_core), so that set_thread_affinity() can move it.
+
+  Stealing only helps a core that calls the scheduler. When a thread 
+  creates a burst of threads, they all land on its core, while other cores
+  may be halted or busy with a single thread. Therefore, a core whose 
+  threads use up their quantum periodically compares its load with the 
+  other cores, moves ready threads to the less loaded ones, and sends them
+  an ICI to schedule the threads at once (see sched_balance). A thread 
+  moves between queues while both ready_spinlocks are held, so it is never
+  out of a queue; sched_queue_remove() follows it by queue_core.
+
+  An idle core polls the queues of all cores for a short, adaptive window
+  before it halts (see idle_wait), because a polling core notices a new
+  thread (its own, or one to steal) much sooner than a halted core is
+  restarted. The time from the queueing of a thread until an idle core
+  runs it is recorded per core (field idle_latency).
+
+  Periodic threads (see set_thread_periodic) with budget left are kept 
+  in one more tree, EDF_QUEUE, above all priorities and keyed by deadline.
+  A periodic thread is charged for its execution time (field rt_left) 
+  whenever it leaves the core, and the core timer is armed to end its 
+  execution when its budget runs out. Then, the thread falls back to its
+  priority, until its deadline passes (see edf_charge). A queued thread 
+  in this situation is also linked to the list edf_throttled of the core,
+  which is checked on every selection (see rq_replenish).
+
+  The locking order is:  tcb->state_spinlock, timeout_spinlock, ready_spinlock.
+  The timeout heap is drained while holding timeout_spinlock, therefore
+  the state_spinlock of a timed-out thread is only tried, never waited for.
+
+  The ready_spinlock of each core and the timeout_spinlock are the most
+  contended locks of the kernel, and they are ticket locks: the waiting
+  cores get them in FIFO order, so that a busy core cannot starve another
+  one. They are always taken in the non-preemptive domain. A state_spinlock
+  is mostly uncontended, and it is a plain spinlock (see spin_lock).
+*/
+
+
+/* The heap of threads with a timeout */
+static struct {
+  TCB** node;        /* node[0] has the earliest wakeup_time */
+  size_t size;       /* number of threads in the heap */
+  size_t capacity;   /* allocated size of the node array */
+} TIMEOUT_HEAP;
+
+ticketlock timeout_spinlock = TICKETLOCK_INIT;  /* spinlock for the timeout heap */
+
+
+/* Return true if the thread is periodic, with budget left in its current period */
+static inline int edf_thread(TCB* tcb)
+{
+  return tcb->rt_period > 0 && tcb->rt_left > 0;
+}
+
+
+/*
+  Charge a periodic thread for @c used time of execution. If the deadline 
+  of its current job has passed, the job has missed it (maybe more than 
+  once); the job is then given the deadline and budget of the current 
+  period.
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD, OR, FOR A QUEUED 
+      THREAD, WITH THE ready_spinlock OF ITS CORE HELD ***
 */
+static void edf_charge(TCB* tcb, TimerDuration used, TimerDuration now)
+{
+  if(tcb->rt_period == 0) return;
 
+  tcb->rt_left = (used < tcb->rt_left) ? tcb->rt_left - used : 0;
+
+  if(now >= tcb->rt_deadline) {
+    unsigned long missed = (now - tcb->rt_deadline) / tcb->rt_period + 1;
+    tcb->rt_deadline += missed * tcb->rt_period;
+    tcb->rt_left = tcb->rt_budget;
+    tcb->rt_misses += missed;
+    __atomic_fetch_add(& tcb->owner_pcb->deadline_misses, missed, __ATOMIC_RELAXED);
+  }
+}
 
-rlnode SCHED;                         /* The scheduler queue */
-rlnode TIMEOUT_LIST;          /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT;    /* spinlock for scheduler queue */
 
+/* The weights of processes, by nice value (as in Linux, about 1.25x per step) */
+static const unsigned int nice_weight[NICE_MAX-NICE_MIN+1] = {
+  /* -20 */ 88761, 71755, 56483, 46273, 36291,
+  /* -15 */ 29154, 23254, 18705, 14949, 11916,
+  /* -10 */  9548,  7620,  6100,  4904,  3906,
+  /*  -5 */  3121,  2501,  1991,  1586,  1277,
+  /*   0 */  1024,   820,   655,   526,   423,
+  /*   5 */   335,   272,   215,   172,   137,
+  /*  10 */   110,    87,    70,    56,    45,
+  /*  15 */    36,    29,    23,    18,    15,
+};
+
+/*
+  Charge the current thread for its execution since it was last charged.
+  The execution time is added to the thread, its process and the core; 
+  the process also advances in virtual runtime, at a rate inverse to its
+  weight, and a periodic thread uses up its budget.
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_charge(TCB* tcb, TimerDuration now)
+{
+  TimerDuration used = now - tcb->run_start;
+  tcb->run_start = now;
+  tcb->run_time += used;
+  CURCORE.busy_time += used;
+
+  PCB* pcb = tcb->owner_pcb;
+  __atomic_fetch_add(& pcb->run_time, used, __ATOMIC_RELAXED);
+  TimerDuration vused = used * NICE_0_WEIGHT / nice_weight[pcb->nice - NICE_MIN];
+  __atomic_fetch_add(& pcb->vruntime, vused, __ATOMIC_RELAXED);
+
+  edf_charge(tcb, used, now);
+}
+
+/*
+  Return the key of a thread in the fair queue of a core: the virtual 
+  runtime of its process. A process which was not running (e.g., it was
+  asleep, or it is new) is first moved forward to within VRUNTIME_LAG of 
+  the core's virtual clock, so that it cannot claim the time it missed.
+*/
+static TimerDuration sched_fair_key(TCB* tcb, CCB* ccb)
+{
+  PCB* pcb = tcb->owner_pcb;
+  TimerDuration vclock = __atomic_load_n(& ccb->vclock, __ATOMIC_RELAXED);
+  TimerDuration floor = (vclock > VRUNTIME_LAG) ? vclock - VRUNTIME_LAG : 0;
+  TimerDuration vruntime = __atomic_load_n(& pcb->vruntime, __ATOMIC_RELAXED);
+  while(vruntime < floor
+    && ! __atomic_compare_exchange_n(& pcb->vruntime, & vruntime, floor, 0, 
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return (vruntime < floor) ? floor : vruntime;
+}
+
+
+/*
+  Program the core timer for the next event that the core must handle
+  (tickless scheduling). These events are
+  - the end of the quantum, when other threads are waiting for the core
+    (for the idle thread, when some core has waiting threads to steal)
+  - the earliest timeout of a sleeping thread
+  - the end of the budget of a periodic thread.
+  When there is no such event, the timer is not armed: the current thread
+  runs (or the idle core halts) until some interrupt arrives. If a thread
+  is later added to the core's queue, sched_queue_add() arms the timer.
+*/
+static void sched_arm_timer(TCB* current)
+{
+  CCB* ccb = & CURCORE;
+  TimerDuration timer = NO_TIMEOUT;
+
+  if(current->type == IDLE_THREAD) {
+    for(uint c=0; c<cpu_cores(); c++)
+      if(cctx[c].ready_count > 0) { timer = QUANTUM; break; }
+  } 
+  else if(edf_thread(current))
+    timer = current->rt_left;   /* Enforce the budget of the job */
+  else if(ccb->ready_count > 0)
+    timer = QUANTUM;
+
+  ccb->ticking = (timer != NO_TIMEOUT);
+
+  /* Do not sleep past the deadline of a throttled periodic thread */
+  if(! is_rlist_empty(& ccb->edf_throttled)) {
+    ticket_lock(& ccb->ready_spinlock);
+    TimerDuration curtime = bios_fine_clock();
+    rlnode* list = & ccb->edf_throttled;
+    for(rlnode* n = list->next; n != list; n = n->next) {
+      TimerDuration deadline = n->tcb->rt_deadline;
+      TimerDuration left = (deadline > curtime) ? deadline - curtime : 1;
+      if(left < timer) timer = left;
+    }
+    ticket_unlock(& ccb->ready_spinlock);
+  }
+
+  /* Do not sleep past the earliest timeout */
+  if(TIMEOUT_HEAP.size > 0) {
+    ticket_lock(& timeout_spinlock);
+    if(TIMEOUT_HEAP.size > 0) {
+      TimerDuration curtime = bios_fine_clock();
+      TimerDuration deadline = TIMEOUT_HEAP.node[0]->wakeup_time;
+      TimerDuration left = (deadline > curtime) ? deadline - curtime : 1;
+      if(left < timer) timer = left;
+    }
+    ticket_unlock(& timeout_spinlock);
+  }
+
+  if(timer != NO_TIMEOUT)
+    bios_set_timer(timer);
+}
 
 
 /* Interrupt handler for ALARM */
@@ -209,60 +524,379 @@ void yield_handler()
 /* Interrupt handle for inter-core interrupts */
 void ici_handler() 
 {
-  /* noop for now... */
+  /* Some thread of higher priority may have become ready */
+  yield(SCHED_PREEMPT);
+}
+
+
+/*
+  Helpers for the timeout heap.
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static inline void th_place(size_t i, TCB* tcb)
+{
+  TIMEOUT_HEAP.node[i] = tcb;
+  tcb->timeout_index = i;
+}
+
+/* Move the thread at position i towards the root, as far as needed */
+static void th_sift_up(size_t i)
+{
+  TCB* tcb = TIMEOUT_HEAP.node[i];
+  while(i > 0) {
+    size_t parent = (i-1)/2;
+    if(TIMEOUT_HEAP.node[parent]->wakeup_time <= tcb->wakeup_time) break;
+    th_place(i, TIMEOUT_HEAP.node[parent]);
+    i = parent;
+  }
+  th_place(i, tcb);
+}
+
+/* Move the thread at position i towards the leaves, as far as needed */
+static void th_sift_down(size_t i)
+{
+  TCB* tcb = TIMEOUT_HEAP.node[i];
+  size_t size = TIMEOUT_HEAP.size;
+  for(;;) {
+    size_t child = 2*i+1;
+    if(child >= size) break;
+    if(child+1 < size && 
+      TIMEOUT_HEAP.node[child+1]->wakeup_time < TIMEOUT_HEAP.node[child]->wakeup_time)
+      child++;
+    if(tcb->wakeup_time <= TIMEOUT_HEAP.node[child]->wakeup_time) break;
+    th_place(i, TIMEOUT_HEAP.node[child]);
+    i = child;
+  }
+  th_place(i, tcb);
+}
+
+static void th_insert(TCB* tcb)
+{
+  assert(TIMEOUT_HEAP.size < TIMEOUT_HEAP.capacity);
+  TIMEOUT_HEAP.node[TIMEOUT_HEAP.size++] = tcb;
+  th_sift_up(TIMEOUT_HEAP.size-1);
+}
+
+static void th_remove(TCB* tcb)
+{
+  size_t i = tcb->timeout_index;
+  assert(i < TIMEOUT_HEAP.size && TIMEOUT_HEAP.node[i] == tcb);
+
+  TCB* last = TIMEOUT_HEAP.node[--TIMEOUT_HEAP.size];
+  if(last != tcb) {
+    /* Move the last thread into the hole, then restore the heap order */
+    th_place(i, last);
+    if(i > 0 && TIMEOUT_HEAP.node[(i-1)/2]->wakeup_time > last->wakeup_time)
+      th_sift_up(i);
+    else
+      th_sift_down(i);
+  }
+  tcb->timeout_index = -1;
 }
 
 
 /*
-  Possibly add TCB to the scheduler timeout list.
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  Make sure that the timeout heap can hold n threads.
+
+  The heap is never grown while a thread sleeps, because the scheduler
+  runs in the non-preemptive domain, where calling malloc is unsafe
+  (the thread preempted on this core may hold the allocator's lock).
+  Instead, it is grown as threads are spawned, so that there is always
+  room for every thread.
+*/
+static void sched_reserve_timeouts(size_t n)
+{
+  if(n <= TIMEOUT_HEAP.capacity) return;
+
+  size_t newcap = (TIMEOUT_HEAP.capacity==0) ? 64 : TIMEOUT_HEAP.capacity;
+  while(newcap < n) newcap *= 2;
+  TCB** newnode = xmalloc(newcap*sizeof(TCB*));
+
+  int preempt = preempt_off;
+  ticket_lock(& timeout_spinlock);
+  if(newcap > TIMEOUT_HEAP.capacity) {
+    memcpy(newnode, TIMEOUT_HEAP.node, TIMEOUT_HEAP.size*sizeof(TCB*));
+    TCB** oldnode = TIMEOUT_HEAP.node;
+    TIMEOUT_HEAP.node = newnode;
+    TIMEOUT_HEAP.capacity = newcap;
+    newnode = oldnode;
+  }
+  ticket_unlock(& timeout_spinlock);
+  if(preempt) preempt_on;
+
+  free(newnode);
+}
+
+
+/*
+  Possibly add TCB to the scheduler timeout heap.
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
   if(timeout!=NO_TIMEOUT){
 
     /* set the wakeup time */
-    TimerDuration curtime = bios_clock();
-    tcb->wakeup_time = (timeout==NO_TIMEOUT) ? NO_TIMEOUT : curtime+timeout;
+    TimerDuration curtime = bios_fine_clock();
+    tcb->wakeup_time = curtime+timeout;
+
+    ticket_lock(& timeout_spinlock);
+    th_insert(tcb);
+    ticket_unlock(& timeout_spinlock);
+  }
+}
+
+
+/* The index of the scheduler queue of a thread; a larger index is scheduled first */
+static inline int rq_index(TCB* tcb)
+{
+  if(edf_thread(tcb)) return EDF_QUEUE;
+  return effective_priority(tcb);
+}
+
+/* 
+  Return true if thread a must run before thread b. Within a priority, a 
+  must be of a higher feedback level, if both threads belong to the same
+  process, else ahead in virtual runtime by VRUNTIME_GRANULARITY.
+*/
+static inline int sched_precedes(TCB* a, TCB* b)
+{
+  int qa = rq_index(a), qb = rq_index(b);
+  if(qa != qb)
+    return qa > qb;
+  if(qa == EDF_QUEUE)
+    return a->rt_deadline < b->rt_deadline;
+  if(a->owner_pcb == b->owner_pcb)
+    return a->feedback_level > b->feedback_level;
+  return a->sched_key + VRUNTIME_GRANULARITY < b->sched_key;
+}
+
+/* The key of a thread in the queue of its priority */
+static inline unsigned long rq_key(TCB* tcb)
+{
+  return tcb->sched_key*FEEDBACK_LEVELS + (LEVEL_MAX - tcb->feedback_level);
+}
+
+/*
+  Helpers for the ready queue of a core.
+  *** MUST BE CALLED WITH ccb->ready_spinlock HELD ***
+*/
+static inline void rq_push(CCB* ccb, TCB* tcb)
+{
+  int q = rq_index(tcb);
+  if(q != EDF_QUEUE)
+    tcb->sched_key = sched_fair_key(tcb, ccb);
+  rtree_insert(& ccb->ready_queue[q], & tcb->sched_node, 
+    (q == EDF_QUEUE) ? tcb->rt_deadline : rq_key(tcb));
+  ccb->ready_mask |= (1ul << q);
+  if(tcb->rt_period > 0 && q != EDF_QUEUE)
+    rlist_push_back(& ccb->edf_throttled, & tcb->rt_node);
+  ccb->ready_count++;
+  tcb->queue_core = ccb - cctx;
+}
+
+/* Return the index of the highest non-empty queue, or -1 if none exists */
+static inline int rq_top(CCB* ccb)
+{
+  return (ccb->ready_mask == 0) ? -1 : (int)(8*sizeof(long)) - 1 - __builtin_clzl(ccb->ready_mask);
+}
+
+/* Remove a thread from any position of the queue */
+static inline void rq_remove(CCB* ccb, TCB* tcb)
+{
+  int q = rq_index(tcb);
+  rtree_remove(& ccb->ready_queue[q], & tcb->sched_node);
+  if(is_rtree_empty(& ccb->ready_queue[q]))
+    ccb->ready_mask &= ~(1ul << q);
+  if(tcb->rt_period > 0 && q != EDF_QUEUE)
+    rlist_remove(& tcb->rt_node);
+  ccb->ready_count--;
+  tcb->queue_core = -1;
+}
+
+static inline TCB* rq_pop(CCB* ccb, int q)
+{
+  TCB* tcb = rtree_first(& ccb->ready_queue[q])->tcb;
+  rq_remove(ccb, tcb);
+  return tcb;
+}
+
+/* 
+  Return to the EDF queue the queued periodic threads which have used up 
+  their budget, and whose deadline has passed.
+*/
+static void rq_replenish(CCB* ccb, TimerDuration now)
+{
+  rlnode* list = & ccb->edf_throttled;
+  for(rlnode* n = list->next; n != list; ) {
+    TCB* tcb = n->tcb;
+    n = n->next;
+    if(now >= tcb->rt_deadline) {
+      rq_remove(ccb, tcb);
+      tcb->run_start = now;   /* Not charged for waiting */
+      edf_charge(tcb, 0, now);
+      rq_push(ccb, tcb);
+    }
+  }
+}
+
+/*
+  Queue again the first thread of queue q, as long as its process has run
+  since it was queued. Then, the first thread belongs to the process 
+  furthest behind in virtual runtime, and it is the first thread of the
+  highest feedback level among the queued threads of its process.
+*/
+static void rq_refresh(CCB* ccb, int q)
+{
+  rtree* T = & ccb->ready_queue[q];
+  for(size_t n = T->size; n > 0; n--) {
+    TCB* tcb = rtree_first(T)->tcb;
+    if(tcb->sched_key >= __atomic_load_n(& tcb->owner_pcb->vruntime, __ATOMIC_RELAXED))
+      break;
+    rtree_remove(T, & tcb->sched_node);
+    tcb->sched_key = sched_fair_key(tcb, ccb);
+    rtree_insert(T, & tcb->sched_node, rq_key(tcb));
+  }
+}
 
-    /* add to the TIMEOUT_LIST in sorted order */
-    rlnode* n = TIMEOUT_LIST.next;
-    for( ; n!=&TIMEOUT_LIST; n=n->next) 
-      /* skip earlier entries */
-      if(tcb->wakeup_time < n->tcb->wakeup_time) break;
-    /* insert before n */
-  rl_splice(n->prev, & tcb->sched_node);
+/* Raise all ready threads of the core to the top level */
+static void rq_boost(CCB* ccb)
+{
+  for(int q=0; q<SCHED_QUEUES; q++) {
+    rtree* T = & ccb->ready_queue[q];
+    rtree boosted;
+    rtree_init(& boosted);
+    while(! is_rtree_empty(T)) {
+      TCB* tcb = rtree_first(T)->tcb;
+      rtree_remove(T, & tcb->sched_node);
+      tcb->feedback_level = LEVEL_MAX;
+      rtree_insert(& boosted, & tcb->sched_node, rq_key(tcb));
+    }
+    *T = boosted;
   }
 }
 
 
+/* Return true if the thread may run on core c */
+static inline int sched_allowed(TCB* tcb, uint c)
+{
+  return (tcb->affinity >> c) & 1;
+}
+
+/* The load of a core is the number of its ready threads, plus one if it is not idle */
+static inline uint sched_load(CCB* ccb)
+{
+  return ccb->ready_count + (ccb->current_thread != & ccb->idle_thread);
+}
+
+/* Return the least loaded core that the thread may run on */
+static CCB* sched_least_loaded(TCB* tcb)
+{
+  CCB* best = NULL;
+  for(uint c=0; c<cpu_cores(); c++)
+    if(sched_allowed(tcb, c) && (best==NULL || sched_load(&cctx[c]) < sched_load(best)))
+      best = & cctx[c];
+  assert(best != NULL);
+  return best;
+}
+
+/*
+  Choose the core whose queue will receive a thread that becomes ready.
+  This is the core the thread last ran on (whose cache may still hold
+  the thread's data), if that core is less loaded than the current core.
+
+  However, threads that wake each other in turn (e.g., the two ends of a
+  pipe) share data, so when the waker is the same as the last time, the 
+  thread is kept on the waker's core.
+
+  Only cores in the thread's affinity mask are chosen; when neither the
+  current nor the last core is allowed, the least loaded allowed core
+  is chosen.
+*/
+static CCB* sched_choose_core(TCB* tcb)
+{
+  CCB* here = & CURCORE;
+  CCB* last = & cctx[tcb->last_core];
+  if(! sched_allowed(tcb, last - cctx)) 
+    last = sched_least_loaded(tcb);
+  if(last == here) return here;
+  if(! sched_allowed(tcb, cpu_core_id)) return last;
+
+  TCB* waker = here->current_thread;
+  int partner = (tcb->last_waker == waker);
+  tcb->last_waker = waker;
+  if(partner) return here;
+
+  return (sched_load(last) < sched_load(here)) ? last : here;
+}
+
+
 /*
-  Add TCB to the end of the scheduler list.
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  Add TCB to the end of a scheduler list and return the core that owns
+  the list (see sched_choose_core).
+
+  Cores are not notified here, because that may block on the BIOS halt 
+  mutex while holding spinlocks; the caller must call sched_notify() 
+  on the returned core after releasing its locks.
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
-static void sched_queue_add(TCB* tcb)
+static CCB* sched_queue_add(TCB* tcb)
 {
+  CCB* ccb = sched_choose_core(tcb);
+
+  tcb->queue_time = bios_clock();
+  tcb->ready_time = bios_fine_clock();
+
   /* Insert at the end of the scheduling list */
-  rlist_push_back(& SCHED, & tcb->sched_node);
+  ticket_lock(& ccb->ready_spinlock);
+  rq_push(ccb, tcb);
+  ticket_unlock(& ccb->ready_spinlock);
+
+  /* The current thread must now share the core: end its quantum in time */
+  if(ccb == & CURCORE && ! ccb->ticking) {
+    ccb->ticking = 1;
+    TimerDuration left = bios_set_timer(QUANTUM);
+    if(left > 0 && left < QUANTUM) bios_set_timer(left);
+  }
+  return ccb;
+}
 
-  /* Restart possibly halted cores */
-  cpu_core_restart_one();
+
+/*
+  Make sure that a core which received a ready thread will notice it.
+  For the current core, restart some halted core, which may steal the
+  thread (cores which poll in idle_wait() notice it by themselves). Another core is sent an ICI, which restarts it if halted, and
+  makes it reschedule (and arm its quantum) if busy. Unlike a plain
+  restart, the ICI is not lost if the core is just about to halt.
+  *** MUST BE CALLED WITHOUT SPINLOCKS HELD ***
+*/
+static void sched_notify(CCB* ccb)
+{
+  if(ccb == & CURCORE)
+    cpu_core_restart_one();
+  else
+    cpu_ici(ccb - cctx);
 }
 
 
 /*
   Adjust the state of a thread to make it READY.
-    *** MUST BE CALLED WITH sched_spinlock HELD *** 
+  The caller must indicate whether it holds timeout_spinlock.
+  Returns the core whose scheduler queue received the thread, or 
+  NULL if the thread was not queued.
+    *** MUST BE CALLED WITH tcb->state_spinlock HELD *** 
  */
-static void sched_make_ready(TCB* tcb)
+static CCB* sched_make_ready_locked(TCB* tcb, int have_timeout_lock)
 {
   assert(tcb->state == STOPPED || tcb->state == INIT);
 
-  /* Possibly remove from TIMEOUT_LIST */
+  /* Possibly remove from the timeout heap */
   if(tcb->wakeup_time != NO_TIMEOUT) {
-    /* tcb is in TIMEOUT_LIST, fix it */
-    assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-    rlist_remove(& tcb->sched_node);
+    /* tcb is in the timeout heap, fix it */
+    assert(tcb->timeout_index >= 0 && tcb->state == STOPPED);
+    if(! have_timeout_lock) ticket_lock(& timeout_spinlock);
+    th_remove(tcb);
+    if(! have_timeout_lock) ticket_unlock(& timeout_spinlock);
     tcb->wakeup_time = NO_TIMEOUT;
   }
 
@@ -270,55 +904,254 @@ static void sched_make_ready(TCB* tcb)
   tcb->state = READY;
 
   /* Possibly add to the scheduler queue */
-  if(tcb->phase == CTX_CLEAN) 
-    sched_queue_add(tcb);
+  if(tcb->phase == CTX_CLEAN)
+    return sched_queue_add(tcb);
+  return NULL;
 }
 
+#define sched_make_ready(tcb)  sched_make_ready_locked((tcb), 0)
+
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  Wake up every thread in the timeout heap whose timeout has expired.
+  A thread whose state_spinlock is busy is left for a later call.
 */
-static TCB* sched_queue_select()
+static void sched_wakeup_expired_timeouts()
 {
+  /* Avoid touching the shared lock when there is nothing to do */
+  if(TIMEOUT_HEAP.size == 0)
+    return;
 
-  /* Empty the timeout list up to the current time and wake up each thread */
-  TimerDuration curtime = bios_clock();
-  while(! is_rlist_empty(&TIMEOUT_LIST)) {
-      TCB* tcb = TIMEOUT_LIST.next->tcb;
+  TimerDuration curtime = bios_fine_clock();
+  uint32_t queued = 0;    /* A bitmap of the cores that received threads */
+
+  ticket_lock(& timeout_spinlock);
+  while(TIMEOUT_HEAP.size > 0) {
+      TCB* tcb = TIMEOUT_HEAP.node[0];
       if(tcb->wakeup_time > curtime)
         break;
-      sched_make_ready(tcb);
+      if(! spin_trylock(& tcb->state_spinlock))
+        break;
+      CCB* ccb = sched_make_ready_locked(tcb, 1);
+      if(ccb != NULL) queued |= 1u << (ccb - cctx);
+      spin_unlock(& tcb->state_spinlock);
   }
+  ticket_unlock(& timeout_spinlock);
 
-  /* Get the head of the SCHED list */
-  rlnode * sel = rlist_pop_front(& SCHED);
+  for(uint c=0; queued != 0; c++, queued >>= 1)
+    if(queued & 1) sched_notify(& cctx[c]);
+}
+
+
+/*
+  Return the first thread of the highest queue of the core, which may 
+  run on core c and whose queue index is at least minq, or NULL.
+  *** MUST BE CALLED WITH ccb->ready_spinlock HELD ***
+*/
+static TCB* rq_find_allowed(CCB* ccb, uint c, int minq)
+{
+  for(int q = rq_top(ccb); q >= minq; q--) {
+    for(rtnode* n = rtree_first(& ccb->ready_queue[q]); n != NULL; n = rtree_next(n))
+      if(sched_allowed(n->tcb, c)) return n->tcb;
+  }
+  return NULL;
+}
+
+/*
+  Try to steal a thread from the scheduler queue of some other core.
+  Busy queues are skipped, rather than waited for. Only threads whose
+  queue index is at least @c minq, which may run on the thief, are stolen.
+
+  The only ready thread of a core is left alone until the clock has 
+  advanced since it was queued: the owner core will run it at its next 
+  switch anyway, and a thread stolen right after its wakeup usually 
+  contends for the locks still held by the thread that woke it.
+*/
+static TCB* sched_queue_steal(CCB* thief, int minq)
+{
+  uint ncores = cpu_cores();
+  TimerDuration curtime = bios_clock();
+
+  for(uint i=1; i<ncores; i++) {
+    CCB* victim = & cctx[(thief->id + i) % ncores];
+
+    if(victim->ready_count == 0) continue;
+    if(! ticket_trylock(& victim->ready_spinlock)) continue;
+
+    TCB* tcb = rq_find_allowed(victim, thief - cctx, minq);
+    if(tcb != NULL) {
+      if(victim->ready_count > 1 || tcb->queue_time < curtime)
+        rq_remove(victim, tcb);
+      else
+        tcb = NULL;
+    }
+    ticket_unlock(& victim->ready_spinlock);
+
+    if(tcb != NULL) {
+      thief->steals++;
+      return tcb;
+    }
+  }
+  return NULL;
+}
+
+
+/*
+  Move ready threads of the current core to less loaded cores, if it is
+  time to balance (see BALANCE_PERIOD). Half the difference in load is
+  moved to each core whose load is smaller by at least 2, and the core
+  is sent an ICI. Busy queues are skipped, rather than waited for.
+*/
+static void sched_balance(CCB* ccb, TimerDuration now)
+{
+  if(now < ccb->balance_time + BALANCE_PERIOD)
+    return;
+  ccb->balance_time = now;
+
+  uint ncores = cpu_cores();
+  uint32_t moved = 0;    /* A bitmap of the cores that received threads */
+
+  ticket_lock(& ccb->ready_spinlock);
+  for(uint i=1; i<ncores && ccb->ready_count > 0; i++) {
+    CCB* target = & cctx[(ccb->id + i) % ncores];
+    uint load = sched_load(ccb), tload = sched_load(target);
+
+    if(load < tload + 2) continue;
+    if(! ticket_trylock(& target->ready_spinlock)) continue;
+
+    for(uint n = (load - tload)/2; n > 0; n--) {
+      TCB* tcb = rq_find_allowed(ccb, target->id, 0);
+      if(tcb == NULL) break;
+      rq_remove(ccb, tcb);
+      rq_push(target, tcb);
+      ccb->balanced++;
+      moved |= 1u << target->id;
+    }
+    ticket_unlock(& target->ready_spinlock);
+  }
+  ticket_unlock(& ccb->ready_spinlock);
+
+  for(uint c=0; moved != 0; c++, moved >>= 1)
+    if(moved & 1) sched_notify(& cctx[c]);
+}
+
+
+/*
+  Remove the first thread of the highest-priority non-empty queue of the 
+  current core, if any, and return it. If the local queues are empty, try
+  to steal from other cores.
+
+  If @c current is not NULL, it is a thread that can keep running; then,
+  only threads that it does not precede (see sched_precedes) are returned,
+  i.e., threads of a higher priority, of an earlier deadline, of a 
+  process behind in virtual runtime, or of the same process and at least
+  the same feedback level. Return NULL if no ready thread was found.
+*/
+static TCB* sched_queue_select(TCB* current)
+{
+  CCB* ccb = & CURCORE;
+
+  /* Empty the timeout heap up to the current time and wake up each thread */
+  sched_wakeup_expired_timeouts();
+
+  TimerDuration curtime = bios_clock();
+  TCB* sel = NULL;
+
+  ticket_lock(& ccb->ready_spinlock);
+
+  /* Periodically boost everybody, to avoid starvation */
+  if(curtime >= ccb->boost_time + PRIORITY_BOOST_PERIOD) {
+    rq_boost(ccb);
+    ccb->boost_time = curtime;
+    if(current != NULL)
+      current->feedback_level = LEVEL_MAX;
+  }
+
+  /* Periodic threads return to the EDF queue at their deadline */
+  if(! is_rlist_empty(& ccb->edf_throttled))
+    rq_replenish(ccb, bios_fine_clock());
+
+  /* Get the first thread of the best local queue */
+  int q = rq_top(ccb);
+  if(q >= 0 && q != EDF_QUEUE)
+    rq_refresh(ccb, q);
+  if(q >= 0 && (current == NULL 
+      || ! sched_precedes(current, rtree_first(& ccb->ready_queue[q])->tcb)))
+    sel = rq_pop(ccb, q);
+
+  ticket_unlock(& ccb->ready_spinlock);
+
+  int stolen = 0;
+  if(sel == NULL && q < 0) {
+    /* A periodic thread with budget is not preempted by stolen threads */
+    int minq = (current==NULL) ? 0 : rq_index(current);
+    if(minq != EDF_QUEUE)
+      stolen = ((sel = sched_queue_steal(ccb, minq)) != NULL);
+  }
+  TRACE(TRACE_SELECT, sel, -1, stolen);
+
+  /* Advance the virtual clock of the core (only the owner core writes it) */
+  if(sel != NULL && ! edf_thread(sel) && sel->sched_key > ccb->vclock)
+    __atomic_store_n(& ccb->vclock, sel->sched_key, __ATOMIC_RELAXED);
 
-  return sel->tcb;  /* When the list is empty, this is NULL */
+  return sel;  /* When no queue has a thread, this is NULL */
 } 
 
 
+/*
+  Adjust the feedback level of the current thread, according to the cause
+  of a call to yield.
+*/
+static void sched_adjust_level(TCB* tcb, enum SCHED_CAUSE cause)
+{
+  switch(cause) {
+    case SCHED_QUANTUM:
+      if(tcb->feedback_level > 0) tcb->feedback_level--;
+      break;
+    case SCHED_IO:
+      tcb->feedback_level = LEVEL_MAX;
+      break;
+    case SCHED_PIPE:
+      if(tcb->feedback_level < LEVEL_MAX) tcb->feedback_level++;
+      break;
+    default:
+      break;
+  }
+}
+
+
 /*
   Make the process ready. 
  */
 int wakeup(TCB* tcb)
 {
   int ret = 0;
+  CCB* queued = NULL;
 
   /* Preemption off */
   int oldpre = preempt_off;
 
   /* To touch tcb->state, we must get the spinlock. */
-  Mutex_Lock(& sched_spinlock);
+  spin_lock(& tcb->state_spinlock);
 
   if(tcb->state==STOPPED || tcb->state==INIT) {
-    sched_make_ready(tcb);
+    queued = sched_make_ready(tcb);
     ret = 1;    
   }
+  TRACE(TRACE_WAKEUP, tcb, -1, queued ? (int) queued->id : -1);
+
+  /* Does the thread deserve to preempt the current thread? (during boot, there is none) */
+  TCB* current = CURTHREAD;
+  int preempt = queued == & CURCORE && current != NULL && current->type != IDLE_THREAD 
+    && sched_precedes(tcb, current);
+
+  spin_unlock(& tcb->state_spinlock);
 
+  /* Notify the core that will run the thread */
+  if(queued) sched_notify(queued);
 
-  Mutex_Unlock(& sched_spinlock);
+  /* The ICI is delivered when this core turns preemption on */
+  if(preempt) cpu_ici(cpu_core_id);
 
   /* Restore preemption state */
   if(oldpre) preempt_on;
@@ -327,6 +1160,220 @@ int wakeup(TCB* tcb)
 }
 
 
+/*
+  Make a batch of threads ready. Unlike wakeup(), each core that received
+  threads is notified once, after all threads are queued. The threads
+  queued on this core may be stolen by halted cores, which are restarted,
+  one for each such thread.
+ */
+unsigned int wakeup_batch(TCB* tcbs[], unsigned int n)
+{
+  unsigned int woken = 0, here = 0;
+  uint32_t queued = 0;    /* A bitmap of the other cores that received threads */
+  int preempt = 0;
+
+  int oldpre = preempt_off;
+  TCB* current = CURTHREAD;
+
+  for(unsigned int i=0; i<n; i++) {
+    TCB* tcb = tcbs[i];
+    CCB* ccb = NULL;
+
+    spin_lock(& tcb->state_spinlock);
+    if(tcb->state==STOPPED || tcb->state==INIT) {
+      ccb = sched_make_ready(tcb);
+      woken++;
+    } else
+      tcbs[i] = NULL;
+    TRACE(TRACE_WAKEUP, tcb, -1, ccb ? (int) ccb->id : -1);
+
+    if(ccb == & CURCORE) {
+      here++;
+      preempt = preempt || (current != NULL && current->type != IDLE_THREAD 
+        && sched_precedes(tcb, current));
+    }
+    else if(ccb != NULL)
+      queued |= 1u << (ccb - cctx);
+    spin_unlock(& tcb->state_spinlock);
+  }
+
+  /* Notify the cores that will run the threads */
+  for(uint c=0; queued != 0; c++, queued >>= 1)
+    if(queued & 1) cpu_ici(c);
+  if(here > 0) 
+    cpu_core_restart_some(here);
+
+  /* The ICI is delivered when this core turns preemption on */
+  if(preempt) cpu_ici(cpu_core_id);
+
+  if(oldpre) preempt_on;
+  return woken;
+}
+
+
+/*
+  Remove a ready thread from the scheduler queue that holds it. Returns 0
+  if the thread is in no queue (e.g., it has just been selected to run).
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static int sched_queue_remove(TCB* tcb)
+{
+  if(tcb->state != READY || tcb->phase != CTX_CLEAN)
+    return 0;
+
+  /* The thread may be stolen, or moved by the balancer, meanwhile */
+  for(;;) {
+    int c = __atomic_load_n(& tcb->queue_core, __ATOMIC_RELAXED);
+    if(c < 0) return 0;
+
+    CCB* ccb = & cctx[c];
+    ticket_lock(& ccb->ready_spinlock);
+    int removed = (tcb->queue_core == c);
+    if(removed) rq_remove(ccb, tcb);
+    ticket_unlock(& ccb->ready_spinlock);
+    if(removed) return 1;
+  }
+}
+
+/*
+  Return the core where the thread is running, or -1.
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static int sched_running_core(TCB* tcb)
+{
+  if(tcb->phase == CTX_DIRTY)
+    for(uint c=0; c<cpu_cores(); c++)
+      if(cctx[c].current_thread == tcb) return c;
+  return -1;
+}
+
+
+void set_thread_affinity(TCB* tcb, cpumask_t mask)
+{
+  CCB* queued = NULL;
+
+  int oldpre = preempt_off;
+  spin_lock(& tcb->state_spinlock);
+  tcb->affinity = mask;
+
+  /* A thread queued on a core that it must leave is moved */
+  int c = tcb->queue_core;
+  if(c >= 0 && ! sched_allowed(tcb, c) && sched_queue_remove(tcb))
+    queued = sched_queue_add(tcb);
+
+  /* A thread running on a core that it must leave is preempted */
+  int running = sched_running_core(tcb);
+  if(running >= 0 && sched_allowed(tcb, running))
+    running = -1;
+
+  spin_unlock(& tcb->state_spinlock);
+
+  if(queued) sched_notify(queued);
+  if(running >= 0) cpu_ici(running);
+
+  if(oldpre) preempt_on;
+}
+
+
+/*
+  Change the scheduling attributes of a thread, by calling update(tcb, arg)
+  with tcb->state_spinlock held. A queued thread moves to its new list.
+*/
+static void sched_update(TCB* tcb, void (*update)(TCB*, intptr_t), intptr_t arg)
+{
+  CCB* queued = NULL;
+
+  int oldpre = preempt_off;
+  spin_lock(& tcb->state_spinlock);
+
+  /* A queued thread must move to the list of its new attributes */
+  int requeue = sched_queue_remove(tcb);
+  update(tcb, arg);
+  if(requeue)
+    queued = sched_queue_add(tcb);
+
+  /* Does the thread now deserve to preempt the current thread? */
+  TCB* current = CURTHREAD;
+  int preempt = queued == & CURCORE && current->type != IDLE_THREAD 
+    && sched_precedes(tcb, current);
+
+  /* A running thread reconsiders, in case its priority was lowered */
+  int running = sched_running_core(tcb);
+
+  spin_unlock(& tcb->state_spinlock);
+
+  if(queued) sched_notify(queued);
+  if(preempt) cpu_ici(cpu_core_id);
+  if(running >= 0) cpu_ici(running);
+
+  if(oldpre) preempt_on;
+}
+
+static void update_priority(TCB* tcb, intptr_t priority)
+{
+  tcb->thread_priority = priority;
+}
+
+void set_thread_priority(TCB* tcb, int priority)
+{
+  sched_update(tcb, update_priority, priority);
+}
+
+static void update_inherited_priority(TCB* tcb, intptr_t priority)
+{
+  tcb->inherited_priority = priority;
+}
+
+void set_inherited_priority(TCB* tcb, int priority)
+{
+  sched_update(tcb, update_inherited_priority, priority);
+}
+
+
+typedef struct { TimerDuration period, budget; } periodic_params;
+
+static void update_periodic(TCB* tcb, intptr_t arg)
+{
+  periodic_params* p = (periodic_params*) arg;
+  TimerDuration now = bios_fine_clock();
+  tcb->rt_period = p->period;
+  tcb->rt_budget = p->budget;
+  tcb->rt_deadline = now + p->period;
+  tcb->rt_left = p->budget;
+  tcb->run_start = now;
+}
+
+void set_thread_periodic(TCB* tcb, TimerDuration period, TimerDuration budget)
+{
+  assert(period == 0 || (budget > 0 && budget <= period));
+  periodic_params p = { period, budget };
+  sched_update(tcb, update_periodic, (intptr_t) &p);
+}
+
+TimerDuration end_periodic_job()
+{
+  TCB* tcb = CURTHREAD;
+  assert(tcb->rt_period > 0);
+
+  int oldpre = preempt_off;
+  spin_lock(& tcb->state_spinlock);
+
+  /* A late job misses its deadline here */
+  TimerDuration now = bios_fine_clock();
+  sched_charge(tcb, now);
+
+  /* The next job is released at the deadline of this one */
+  TimerDuration release = tcb->rt_deadline;
+  tcb->rt_deadline = release + tcb->rt_period;
+  tcb->rt_left = tcb->rt_budget;
+
+  spin_unlock(& tcb->state_spinlock);
+  if(oldpre) preempt_on;
+
+  return release - now;
+}
+
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
@@ -342,20 +1389,21 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
     domain.
    */
   int preempt = preempt_off;
-  Mutex_Lock(& sched_spinlock);
+  spin_lock(& tcb->state_spinlock);
 
   /* mark the thread as stopped or exited */
   tcb->state = state;
+  TRACE(TRACE_SLEEP, tcb, cause, 0);
 
   /* register the timeout (if any) for the sleeping thread */
   if(state!=EXITED) 
     sched_register_timeout(tcb, timeout);
 
   /* Release mx */
-  if(mx!=NULL) Mutex_Unlock(mx);
+  if(mx!=NULL) spin_unlock(mx);
 
-  /* Release the schduler spinlock before calling yield() !!! */
-  Mutex_Unlock(& sched_spinlock);
+  /* Release the state spinlock before calling yield() !!! */
+  spin_unlock(& tcb->state_spinlock);
   
   /* call this to schedule someone else */
   yield(cause);
@@ -365,6 +1413,25 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
 }
 
 
+/*
+  Count a switch away from a thread: it is voluntary if the thread blocked
+  or exited, and involuntary if the thread was still ready to run.
+*/
+static void sched_count_switch(TCB* tcb, int ready, int exited)
+{
+  if(ready) {
+    CURCORE.invol_switches++;
+    tcb->invol_switches++;
+    __atomic_fetch_add(& tcb->owner_pcb->invol_switches, 1, __ATOMIC_RELAXED);
+  }
+  else {
+    tcb->vol_switches++;
+    if(! exited)  /* Its process may be gone */
+      __atomic_fetch_add(& tcb->owner_pcb->vol_switches, 1, __ATOMIC_RELAXED);
+  }
+}
+
+
 /* This function is the entry point to the scheduler's context switching */
 
 void yield(enum SCHED_CAUSE cause)
@@ -379,7 +1446,7 @@ void yield(enum SCHED_CAUSE cause)
 
   int current_ready = 0;
 
-  Mutex_Lock(& sched_spinlock);
+  spin_lock(& current->state_spinlock);
   switch(current->state)
   {
     case RUNNING:
@@ -396,13 +1463,40 @@ void yield(enum SCHED_CAUSE cause)
       fprintf(stderr, "BAD STATE for current thread %p in yield: %d\n", current, current->state);
       assert(0);  /* It should not be READY or EXITED ! */
   }
+  int exited = (current->state == EXITED);
+  TimerDuration now = bios_fine_clock();
+  if(current->type == IDLE_THREAD)
+    CURCORE.idle_time += now - current->run_start;
+  else if(exited)
+    CURCORE.busy_time += now - current->run_start;  /* Its process may be gone */
+  else {
+    sched_charge(current, now);
+    current->sched_key = current->owner_pcb->vruntime;
+  }
+  TRACE(TRACE_YIELD, current, cause, 0);
+  spin_unlock(& current->state_spinlock);
+
+  if(current->type != IDLE_THREAD)
+    sched_adjust_level(current, cause);
+
+  /* A core which is too busy shares its threads */
+  if(cause == SCHED_QUANTUM)
+    sched_balance(& CURCORE, now);
+
+  /* A thread whose affinity excludes this core must leave it */
+  int allowed = sched_allowed(current, cpu_core_id);
 
-  /* Get next */
-  TCB* next = sched_queue_select();
+  /* 
+    Get next. On preemption, the current thread keeps the core unless
+    some ready thread has at least its priority.
+  */
+  int may_keep = current_ready && allowed && current->type != IDLE_THREAD 
+    && (cause==SCHED_QUANTUM || cause==SCHED_PREEMPT);
+  TCB* next = sched_queue_select(may_keep ? current : NULL);
 
   /* Maybe there was nothing ready in the scheduler queue ? */
   if(next==NULL) {
-    if(current_ready)
+    if(current_ready && allowed)
       next = current;
     else
       next = & CURCORE.idle_thread;
@@ -412,10 +1506,11 @@ void yield(enum SCHED_CAUSE cause)
   current->next = next;
   next->prev = current;
 
-  Mutex_Unlock(& sched_spinlock);
-
   /* Switch contexts */
   if(current!=next) {
+    CURCORE.switches++;
+    if(current->type != IDLE_THREAD)
+      sched_count_switch(current, current_ready, exited);
     CURTHREAD = next;
     cpu_swap_context( & current->context , & next->context );
   }
@@ -440,40 +1535,127 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-  Mutex_Lock(& sched_spinlock);
-
   /* Mark current state */
   TCB* current = CURTHREAD; 
   TCB* prev = current->prev;
 
+  spin_lock(& current->state_spinlock);
   current->state = RUNNING;
   current->phase = CTX_DIRTY;
 
+  /* A thread is not charged for the time it was off the core */
+  TimerDuration now = bios_fine_clock();
+  current->run_start = now;
+  edf_charge(current, 0, now);
+  TRACE(TRACE_GAIN, current, -1, current->last_core);
+  spin_unlock(& current->state_spinlock);
+
+  /* Measure how long an idle core took to run a queued thread */
+  if(prev->type == IDLE_THREAD && current != prev) {
+    TimerDuration latency = now - current->ready_time;
+    CURCORE.idle_wakeups++;
+    CURCORE.idle_latency += latency;
+    if(latency > CURCORE.idle_latency_max) CURCORE.idle_latency_max = latency;
+  }
+
+  /* Count the thread's moves between cores */
+  if(current->type != IDLE_THREAD && current->last_core != cpu_core_id) {
+    CURCORE.migrations++;
+    __atomic_fetch_add(& current->owner_pcb->migrations, 1, __ATOMIC_RELAXED);
+    current->last_core = cpu_core_id;
+  }
+
   if(current != prev) {
     /* Take care of the previous thread */
+    CCB* queued = NULL;
+    spin_lock(& prev->state_spinlock);
     prev->phase = CTX_CLEAN;
-    switch(prev->state) 
+    Thread_state prev_state = prev->state;
+    switch(prev_state) 
     {
       case READY:
-        if(prev->type != IDLE_THREAD) sched_queue_add(prev);
+        if(prev->type != IDLE_THREAD) queued = sched_queue_add(prev);
         break;
       case EXITED:
-        release_TCB(prev);
-        break;
       case STOPPED:
         break;
       default:
         assert(0);  /* prev->state should not be INIT or RUNNING ! */
     }
+    spin_unlock(& prev->state_spinlock);
+
+    /* Nobody else may touch an exited thread, release it unlocked */
+    if(prev_state == EXITED)
+      release_TCB(prev);
+    else if(queued)
+      sched_notify(queued);
   }
 
-  Mutex_Unlock(& sched_spinlock);
+  /* 
+    The affinity of the thread may have changed after it was selected;
+    then, the ICI makes it yield as soon as preemption is on.
+  */
+  if(! sched_allowed(current, cpu_core_id))
+    cpu_ici(cpu_core_id);
+
+  /* Set the alarm for the next event */
+  sched_arm_timer(current);
 
   /* Reset preemption as needed */
   if(preempt) preempt_on;
+}
+
 
-  /* Set a 1-quantum alarm */
-  bios_set_timer(QUANTUM);
+/* The number of threads in the queues of the other cores */
+static inline uint idle_others_load(CCB* ccb)
+{
+  uint load = 0;
+  for(uint c=0; c<cpu_cores(); c++)
+    if(c != ccb->id) load += cctx[c].ready_count;
+  return load;
+}
+
+/*
+  Wait for work, as the idle thread. First, poll the scheduler queues for
+  the core's polling window, then halt the core. The window is adapted to
+  the time that the core waited: if the core was restarted within the
+  largest window, polling a little longer would have avoided the halt,
+  so the window grows to cover the wait; if it waited longer than that,
+  polling was wasted and the window is halved.
+
+  The threads already queued on other cores were there when the core
+  last failed to steal (e.g., their affinity excludes this core), so 
+  only new threads end the wait. Polling is done with preemption on, so
+  an ICI will preempt the idle thread; then, a context switch ends the 
+  wait.
+*/
+static void idle_wait(CCB* ccb)
+{
+  TimerDuration start = bios_fine_clock();
+  unsigned long switches = ccb->switches;
+  uint others = idle_others_load(ccb);
+
+  for(TimerDuration now = start; now - start < ccb->idle_spin; now = bios_fine_clock()) {
+    if(ccb->ready_count > 0 || ccb->switches != switches || idle_others_load(ccb) > others) {
+      ccb->idle_spin_hits++;
+      return;
+    }
+    /* The last core to exit the scheduler restarts only the halted cores */
+    if(active_threads == 0) return;
+    cpu_relax();
+  }
+  if(active_threads == 0) return;
+
+  ccb->idle_halts++;
+  cpu_core_halt();
+
+  TimerDuration waited = bios_fine_clock() - start;
+  if(waited < IDLE_SPIN_MAX)
+    ccb->idle_spin = (2*waited < IDLE_SPIN_MAX) ? 2*waited : IDLE_SPIN_MAX;
+  else
+    ccb->idle_spin /= 2;
+  if(ccb->idle_spin < IDLE_SPIN_MIN && IDLE_SPIN_MIN <= IDLE_SPIN_MAX)
+    ccb->idle_spin = IDLE_SPIN_MIN;
 }
 
 
@@ -484,7 +1666,7 @@ static void idle_thread()
 
   /* We come here whenever we cannot find a ready thread for our core */
   while(active_threads>0) {
-    cpu_core_halt();
+    idle_wait(& CURCORE);
     yield(SCHED_IDLE);
   }
 
@@ -499,8 +1681,34 @@ static void idle_thread()
  */
 void initialize_scheduler()
 {
-  rlnode_init(&SCHED, NULL);
-  rlnode_init(&TIMEOUT_LIST, NULL);
+  for(uint c=0; c<MAX_CORES; c++) {
+    for(int q=0; q<=EDF_QUEUE; q++)
+      rtree_init(& cctx[c].ready_queue[q]);
+    cctx[c].ready_mask = 0;
+    cctx[c].ready_count = 0;
+    rlnode_init(& cctx[c].edf_throttled, NULL);
+    cctx[c].vclock = 0;
+    cctx[c].boost_time = 0;
+    cctx[c].ticking = 0;
+    rlnode_init(& cctx[c].thread_pool, NULL);
+    cctx[c].thread_pool_size = 0;
+    cctx[c].ready_spinlock = TICKETLOCK_INIT;
+    cctx[c].switches = 0;
+    cctx[c].invol_switches = 0;
+    cctx[c].busy_time = 0;
+    cctx[c].idle_time = 0;
+    cctx[c].steals = 0;
+    cctx[c].migrations = 0;
+    cctx[c].balanced = 0;
+    cctx[c].balance_time = 0;
+    cctx[c].idle_spin = (IDLE_SPIN_MIN < IDLE_SPIN_MAX) ? IDLE_SPIN_MIN : IDLE_SPIN_MAX;
+    cctx[c].idle_halts = 0;
+    cctx[c].idle_spin_hits = 0;
+    cctx[c].idle_wakeups = 0;
+    cctx[c].idle_latency = 0;
+    cctx[c].idle_latency_max = 0;
+  }
+  TIMEOUT_HEAP.size = 0;
 }
 
 
@@ -518,8 +1726,26 @@ void run_scheduler()
   curcore->idle_thread.type = IDLE_THREAD;
   curcore->idle_thread.state = RUNNING;
   curcore->idle_thread.phase = CTX_DIRTY;
+  curcore->idle_thread.state_spinlock = MUTEX_INIT;
+  curcore->idle_thread.thread_priority = 0;
+  curcore->idle_thread.inherited_priority = -1;
+  curcore->idle_thread.pi_held = 0;
+  curcore->idle_thread.feedback_level = 0;
+  curcore->idle_thread.rt_period = 0;
+  curcore->idle_thread.rt_left = 0;
+  curcore->idle_thread.rt_misses = 0;
+  rlnode_init(& curcore->idle_thread.rt_node, & curcore->idle_thread);
   curcore->idle_thread.wakeup_time = NO_TIMEOUT;
-  rlnode_init(& curcore->idle_thread.sched_node, & curcore->idle_thread);
+  curcore->idle_thread.timeout_index = -1;
+  curcore->idle_thread.last_core = cpu_core_id;
+  curcore->idle_thread.affinity = ALL_CORES;
+  curcore->idle_thread.queue_core = -1;
+  curcore->idle_thread.run_start = bios_fine_clock();
+  curcore->idle_thread.sched_key = 0;
+  curcore->idle_thread.run_time = 0;
+  curcore->idle_thread.vol_switches = 0;
+  curcore->idle_thread.invol_switches = 0;
+  rtnode_init(& curcore->idle_thread.sched_node, & curcore->idle_thread);
 
   /* Initialize interrupt handler */
   cpu_interrupt_handler(ALARM, yield_handler);
@@ -531,6 +1757,7 @@ void run_scheduler()
 
   /* Finished scheduling */
   assert(CURTHREAD == &CURCORE.idle_thread);
+  thread_pool_drain();
   cpu_interrupt_handler(ALARM, NULL);
   cpu_interrupt_handler(ICI, NULL);
 }
@@ -25,6 +25,28 @@
 #include "bios.h"
 #include "tinyos.h"
 
+
+/** 
+  @brief A ticket spinlock.
+
+  Threads acquire a ticket spinlock in the order they arrive, so that a
+  busy lock cannot starve a core. It must be held only in the 
+  non-preemptive domain, as a waiter preempted while holding its ticket
+  would delay every waiter behind it. The scheduler locks which are 
+  shared between cores are ticket spinlocks (see @c ticket_lock).
+*/
+typedef union ticketlock {
+  struct {
+    uint16_t owner;   /**< The ticket allowed into the critical section */
+    uint16_t next;    /**< The next ticket to give out */
+  };
+  uint32_t word;      /**< Both tickets, for compare-and-swap */
+} ticketlock;
+
+/** @brief Initializer for ticket spinlocks */
+#define TICKETLOCK_INIT ((ticketlock){ .word = 0 })
+
+
 /*****************************
  *
  *  The Thread Control Block
@@ -65,16 +87,18 @@ typedef enum {
   @brief Designate different origins of scheduler invocation.
 
   This is used in the scheduler heuristics to determine how to
-  adjust the dynamic priority of the current thread.
+  adjust the dynamic priority of the current thread, and whether
+  it may keep the core.
  */
 enum SCHED_CAUSE {
   SCHED_QUANTUM,  /**< The quantum has expired */
   SCHED_IO,       /**< The thread is waiting for I/O */
-  SCHED_MUTEX,    /**< Mutex_Lock yielded on contention */
+  SCHED_MUTEX,    /**< A thread yielded, or blocked, waiting for a lock */
   SCHED_PIPE,     /**< Sleep at a pipe or socket */
   SCHED_POLL,     /**< The thread is polling a device */
   SCHED_IDLE,     /**< The idle thread called yield */
-  SCHED_USER      /**< User-space code called yield */
+  SCHED_USER,     /**< User-space code called yield */
+  SCHED_PREEMPT   /**< A thread of higher priority became ready */
 };
 
 
@@ -90,7 +114,24 @@ typedef struct thread_control_block
   PCB* owner_pcb;       /**< This is null for a free TCB */
   PTCB* owner_ptcb;      //We declare the ptcb <<owner>>
 
-  int thread_priority; //The threat priority
+  int thread_priority;  /**< The priority of the thread, set by @c SetPriority */
+  int inherited_priority; /**< The priority lent by threads waiting for a @c PIMutex held by this thread, or -1 */
+  int pi_held;          /**< The number of @c PIMutex held by this thread */
+  int feedback_level;   /**< The dynamic feedback queue level of the thread, among the threads of its process */
+
+  TimerDuration rt_period;   /**< The period of a periodic thread (see @c set_thread_periodic), or 0 */
+  TimerDuration rt_budget;   /**< The execution time of a periodic thread in each period */
+  TimerDuration rt_deadline; /**< The deadline of the current job of a periodic thread */
+  TimerDuration rt_left;     /**< The budget left to the current job */
+  unsigned long rt_misses;   /**< The deadlines missed by the jobs of the thread */
+  rlnode rt_node;            /**< node to use when queueing in @c CCB.edf_throttled, or in a thread pool */
+
+  TimerDuration run_start;   /**< The time the thread was last charged for its execution */
+  TimerDuration sched_key;   /**< The key of the thread in the scheduler queues */
+
+  TimerDuration run_time;       /**< The execution time of the thread, in microseconds */
+  unsigned long vol_switches;   /**< Times the thread left its core because it blocked or exited */
+  unsigned long invol_switches; /**< Times the thread left its core while ready (e.g., at the end of its quantum) */
 
   cpu_context_t context;     /**< The thread context */
 
@@ -103,9 +144,19 @@ typedef struct thread_control_block
   Thread_phase phase;    /**< The phase of the thread */
 
   void (*thread_func)();   /**< The function executed by this thread */
+  size_t stack_size;       /**< The size of the thread's stack */
+
+  Mutex state_spinlock;   /**< Protects @c state and @c phase against concurrent wakeups */
 
   TimerDuration wakeup_time; /**< The time this thread will be woken up by the scheduler */
-  rlnode sched_node;      /**< node to use when queueing in the scheduler lists */
+  long timeout_index;        /**< Position in the scheduler's timeout heap, or -1 */
+  TimerDuration queue_time;  /**< The time this thread was last added to a scheduler queue */
+  TimerDuration ready_time;  /**< The same, from @c bios_fine_clock, to measure wakeup latency */
+  uint last_core;            /**< The core this thread last ran on */
+  cpumask_t affinity;        /**< The cores this thread may run on */
+  int queue_core;            /**< The core whose scheduler queue holds this thread, or -1 */
+  struct thread_control_block* last_waker; /**< The thread that last woke this thread to another core (only compared) */
+  rtnode sched_node;      /**< node to use when queueing in the scheduler queues */
 
   struct thread_control_block * prev;  /**< previous context */
   struct thread_control_block * next;  /**< next context */
@@ -116,9 +167,94 @@ typedef struct thread_control_block
 
 
 
-/** Thread stack size */
+/** Default thread stack size */
 #define THREAD_STACK_SIZE  (128*1024)
 
+/** Minimum thread stack size (interrupt handlers also run on thread stacks) */
+#define THREAD_STACK_MIN  (32*1024)
+
+/** Maximum thread stack size */
+#define THREAD_STACK_MAX  (64*1024*1024)
+
+/**
+  @brief Maximum number of free thread blocks cached by each core.
+
+  The memory of exited threads (TCB and stack) is kept by the core
+  that released it, up to this number of blocks, and reused by 
+  @c spawn_thread. Define as 0 to disable caching.
+*/
+#ifndef THREAD_POOL_WATERMARK
+#define THREAD_POOL_WATERMARK 16
+#endif
+
+
+/** 
+  @brief Number of feedback levels of the scheduler.
+
+  Within a priority, the threads of each process are scheduled by a
+  multilevel feedback queue. Level 0 is the lowest and level 
+  @c FEEDBACK_LEVELS-1 the highest. The level of a thread is kept in 
+  @c TCB.feedback_level.
+*/
+#define FEEDBACK_LEVELS  8
+
+/** @brief The feedback level of new threads */
+#define LEVEL_MAX  (FEEDBACK_LEVELS-1)
+
+/** 
+  @brief Number of ready queues of a core, one per priority.
+
+  The threads of each priority (see @c SetPriority) are scheduled 
+  fairly between processes: the queue is ordered by the virtual runtime
+  of the processes (see @c PCB.vruntime), and then by the feedback level
+  of the threads. Together with @c EDF_QUEUE, this must not exceed the 
+  bits of @c CCB.ready_mask.
+*/
+#define SCHED_QUEUES  THREAD_PRIORITIES
+
+/**
+  @brief The ready queue of periodic threads, above all priorities.
+
+  Periodic threads with budget left in their current period are kept in
+  this queue, ordered by deadline (Earliest Deadline First). A periodic 
+  thread that has used up its budget is scheduled by its priority until
+  its deadline.
+*/
+#define EDF_QUEUE  SCHED_QUEUES
+
+/** @brief The weight of a process of nice 0 (see @c SetNice) */
+#define NICE_0_WEIGHT  1024
+
+/**
+  @brief The most virtual runtime (in microseconds) a process may lag behind.
+
+  A process which becomes ready after a long sleep has fallen behind in 
+  virtual runtime. Its virtual runtime is raised to at most this much 
+  behind the @c CCB.vclock of the core, so that it does not monopolize 
+  the core, while it still runs ahead of CPU-bound processes.
+*/
+#define VRUNTIME_LAG  (2*QUANTUM)
+
+/**
+  @brief The virtual runtime (in microseconds) that a thread must be ahead by, to preempt.
+
+  A thread which becomes ready preempts the current thread of the same 
+  priority and of another process if its key is smaller by more than this
+  amount. Also, the current thread keeps the core at the end of its 
+  quantum only if it is this much ahead of the threads of other processes.
+*/
+#define VRUNTIME_GRANULARITY  (QUANTUM/2)
+
+/**
+  @brief Period (in microseconds) of the priority boost.
+
+  Every so often, every core raises all of its ready threads to 
+  @c LEVEL_MAX, so that CPU-bound threads do not starve behind the
+  interactive threads of their process. Threads of a lower priority 
+  are not raised above a higher priority.
+*/
+#define PRIORITY_BOOST_PERIOD  (50*QUANTUM)
+
 
 /************************
  *
@@ -138,6 +274,34 @@ typedef struct core_control_block {
   TCB idle_thread;            /**< Used by the scheduler to handle the core's idle thread */
   sig_atomic_t preemption;    /**< Marks preemption, used by the locking code */
 
+  rtree ready_queue[SCHED_QUEUES+1]; /**< The core-local queues of @c READY threads, one per priority, and the @c EDF_QUEUE */
+  unsigned long ready_mask;   /**< Bit @c q is set when @c ready_queue[q] is not empty */
+  rlnode edf_throttled;       /**< The periodic threads in @c ready_queue which have used up their budget */
+  unsigned int ready_count;   /**< Number of threads in @c ready_queue */
+  ticketlock ready_spinlock;  /**< Spinlock protecting @c ready_queue */
+  TimerDuration vclock;       /**< The largest virtual runtime of a thread selected by this core */
+  TimerDuration boost_time;   /**< Last time the feedback levels of this core's threads were boosted */
+  int ticking;                /**< Set when the core timer is armed to end the current quantum */
+
+  rlnode thread_pool;         /**< Free thread blocks cached by this core */
+  unsigned int thread_pool_size; /**< Number of blocks in @c thread_pool */
+
+  unsigned long switches;     /**< Context switches performed by this core */
+  unsigned long invol_switches; /**< Context switches away from a thread that was still ready */
+  TimerDuration busy_time;    /**< Time spent running threads, in microseconds */
+  TimerDuration idle_time;    /**< Time spent in the idle thread, in microseconds */
+  unsigned long steals;       /**< Threads this core stole from other cores */
+  unsigned long migrations;   /**< Threads that started running on this core after running on another */
+  unsigned long balanced;     /**< Threads this core moved to the queues of less loaded cores */
+  TimerDuration balance_time; /**< The last time this core balanced its load */
+
+  TimerDuration idle_spin;    /**< The current polling window of the idle thread (see @c IDLE_SPIN_MAX) */
+  unsigned long idle_halts;   /**< Times the idle thread halted the core */
+  unsigned long idle_spin_hits; /**< Times the idle thread found work while polling */
+  unsigned long idle_wakeups; /**< Switches from the idle thread to a thread */
+  TimerDuration idle_latency; /**< Total time those threads waited in a queue, in microseconds */
+  TimerDuration idle_latency_max; /**< The longest of those waits */
+
 } CCB;
  
 
@@ -163,6 +327,28 @@ extern CCB cctx[MAX_CORES];
 */
 #define CURPROC  (CURTHREAD->owner_pcb)
 
+/**
+  @brief The current thread, read without locking, with preemption on.
+
+  @c CURTHREAD reads the id of the current core, and then the current
+  thread of that core. If the thread is preempted in between, and it 
+  resumes on another core, it reads the current thread of the wrong core.
+  This call reads the current thread like a seqlock, using the count of
+  context switches of the core as the sequence number: if the thread was
+  switched out meanwhile, it reads it again.
+*/
+static inline TCB* cur_thread()
+{
+  for(;;) {
+    uint core = cpu_core_id;
+    unsigned long seq = __atomic_load_n(& cctx[core].switches, __ATOMIC_ACQUIRE);
+    TCB* tcb = __atomic_load_n(& cctx[core].current_thread, __ATOMIC_RELAXED);
+    __atomic_signal_fence(__ATOMIC_ACQ_REL);
+    if(cpu_core_id == core && __atomic_load_n(& cctx[core].switches, __ATOMIC_ACQUIRE) == seq)
+      return tcb;
+  }
+}
+
 
 /**
   @brief A timeout constant, denoting no timeout for sleep.
@@ -177,8 +363,15 @@ extern CCB cctx[MAX_CORES];
   The thread will belong to process @c pcb and execute @c func.
   Note that, the new thread is returned in the @c INIT state.
   The caller must use @c wakeup() to start it.
+
+  The stack of the thread has size @c stack_size, rounded up to a 
+  multiple of the page size and to at least @c THREAD_STACK_MIN. 
+  If @c stack_size is 0, the default @c THREAD_STACK_SIZE is used.
+
+  The new thread has the default priority, and inherits the affinity
+  of the current thread.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size);
 
 /**
   @brief Wakeup a blocked thread.
@@ -192,6 +385,99 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup a batch of blocked threads.
+
+  This is equivalent to calling @c wakeup() for each thread of the array,
+  but the cost of entering the scheduler and of notifying other cores is
+  paid once for the whole batch: each core that received threads is
+  notified once, and only as many halted cores are restarted as there
+  are threads for them to steal.
+
+  @param tcbs the threads to be made @c READY. On return, the entries 
+     of the threads that were not @c STOPPED or @c INIT are @c NULL.
+  @param n the number of threads in @c tcbs
+  @returns the number of threads that were made @c READY
+*/
+unsigned int wakeup_batch(TCB* tcbs[], unsigned int n);
+
+
+/**
+  @brief Set the cores where a thread may run.
+
+  The thread will only be scheduled on the cores in @c mask, which
+  must contain some existing core. A ready thread queued on a core
+  outside the mask is moved to an allowed core, and a thread running
+  on such a core is preempted, so that it moves as well.
+
+  @param tcb the thread, which must not be @c EXITED
+  @param mask the new affinity mask
+*/
+void set_thread_affinity(TCB* tcb, cpumask_t mask);
+
+/**
+  @brief Set the priority of a thread.
+
+  A ready thread is moved to the queue of its new priority. The cores 
+  concerned are interrupted, so that a thread of higher priority runs 
+  at once, and a running thread whose priority was lowered may be 
+  preempted.
+
+  @param tcb the thread, which must not be @c EXITED
+  @param priority the new priority, between 0 and @c THREAD_PRIORITIES-1
+*/
+void set_thread_priority(TCB* tcb, int priority);
+
+/**
+  @brief Set the priority that a thread inherits.
+
+  A thread holding a @c PIMutex inherits the priority of the threads 
+  waiting for it, when that is higher than its own priority. This call 
+  is like @c set_thread_priority, but sets @c TCB.inherited_priority.
+
+  @param tcb the thread, which must not be @c EXITED
+  @param priority the inherited priority, or -1 for none
+*/
+void set_inherited_priority(TCB* tcb, int priority);
+
+/**
+  @brief Make a thread periodic, or normal.
+
+  A periodic thread runs a job in each period, which must complete 
+  within the period, using at most @c budget of execution time. While
+  it has budget left, it is scheduled ahead of all normal threads, 
+  Earliest Deadline First. The first period starts now. A job that 
+  is not completed by its deadline counts as a missed deadline, in 
+  @c TCB.rt_misses, and continues with the budget of the next period.
+
+  @param tcb the thread, which must not be @c EXITED
+  @param period the period, or 0 to make the thread normal
+  @param budget the budget, at most the period
+*/
+void set_thread_periodic(TCB* tcb, TimerDuration period, TimerDuration budget);
+
+/**
+  @brief End the current job of the current (periodic) thread.
+
+  The thread is set up for the next job, which is released at the end 
+  of the current period. The caller must sleep until then.
+
+  @returns the time until the release of the next job
+*/
+TimerDuration end_periodic_job();
+
+/**
+  @brief The priority by which the scheduler orders a thread.
+
+  This is the priority of the thread, or the priority it inherited, 
+  if that is higher.
+*/
+static inline int effective_priority(TCB* tcb)
+{
+  return (tcb->inherited_priority > tcb->thread_priority) ? 
+    tcb->inherited_priority : tcb->thread_priority;
+}
+
 
 /** 
   @brief Block the current thread.
@@ -219,7 +505,7 @@ int wakeup(TCB* tcb);
     @c wakeup() by another thread.
 
     @param newstate the new state for the thread
-    @param mx the mutex to unlock.
+    @param mx the spinlock to unlock (see @c spin_lock), or NULL.
     @param cause the cause of the sleep
     @param timeout a timeout for the sleep, or 
    */
@@ -258,6 +544,33 @@ void initialize_scheduler(void);
   */
 #define QUANTUM (10000L)
 
+/**
+  @brief The period of load balancing (in microseconds).
+
+  A core whose threads keep using up their quantum checks, at most once 
+  in this period, whether it has more ready threads than other cores, and
+  moves some of them over (see @c CCB.balanced).
+  */
+#define BALANCE_PERIOD (4*QUANTUM)
+
+/**
+  @brief The bounds of the polling window of the idle thread (in microseconds).
+
+  Before it halts its core, the idle thread polls the scheduler queues for
+  a while, since waking up a halted core takes much longer than noticing
+  work while polling. The window of each core adapts between these bounds:
+  it grows when the core was woken up soon after halting, so that polling
+  a little longer would have found the work, and it shrinks when the
+  core stayed halted for long. Define @c IDLE_SPIN_MAX as 0 to always halt
+  at once.
+  */
+#ifndef IDLE_SPIN_MAX
+#define IDLE_SPIN_MAX 200
+#endif
+#ifndef IDLE_SPIN_MIN
+#define IDLE_SPIN_MIN 5
+#endif
+
 /** @} */
 
 #endif
@@ -7,6 +7,9 @@
 #include "kernel_streams.h"
 
 
+PIMutex port_lock = PIMUTEX_INIT;
+
+
 void initialize_PORT_MAP (){
 
 for(int i=0;i<MAX_PORT+1; i++)
@@ -35,10 +38,13 @@ int socket_write(void* socket, const char* buf, unsigned int size)
     return -1;
 
  int write_count=0;
- if(the_socket->peercb==NULL)
+ PIMutex_Lock(&the_socket->lock);
+ PEER_CB* peer = the_socket->peercb;
+ PIMutex_Unlock(&the_socket->lock);
+ if(peer==NULL)
    return -1;
 
- write_count=pipe_write(the_socket->peercb->pipe->writer,buf,size);    
+ write_count=pipe_write(peer->pipe->writer->streamobj,buf,size);    
  return write_count;
 }
 
@@ -46,17 +52,51 @@ int socket_read(void* socket, char *buf, unsigned int size)
 {
   int read_count=0;
   SCB* the_socket= (SCB*) socket;/*  convert to SCB*/
-  if(the_socket==NULL || the_socket->peercb==NULL)
+  if(the_socket==NULL)
+   	return -1;
+  PIMutex_Lock(&the_socket->lock);
+  PEER_CB* peer = the_socket->peercb;
+  PIMutex_Unlock(&the_socket->lock);
+  if(peer==NULL)
    	return -1;
-  read_count=pipe_read(the_socket->peercb->pipe->reader,buf,size);//call pipe_read for the receiver
+  read_count=pipe_read(peer->pipe->reader->streamobj,buf,size);//call pipe_read for the receiver
   return read_count;
 }
 
+/* The peer of a socket, or NULL if it is not connected */
+static PEER_CB* socket_peer(SCB* the_socket)
+{
+  if(the_socket==NULL)
+    return NULL;
+  PIMutex_Lock(&the_socket->lock);
+  PEER_CB* peer = the_socket->peercb;
+  PIMutex_Unlock(&the_socket->lock);
+  return peer;
+}
+
+int socket_try_write(void* socket, const char* buf, unsigned int size, io_waiter* w)
+{
+  PEER_CB* peer = socket_peer((SCB*) socket);
+  if(peer==NULL)
+    return -1;
+  return pipe_try_write(peer->pipe->writer->streamobj,buf,size,w);
+}
+
+int socket_try_read(void* socket, char *buf, unsigned int size, io_waiter* w)
+{
+  PEER_CB* peer = socket_peer((SCB*) socket);
+  if(peer==NULL)
+    return -1;
+  return pipe_try_read(peer->pipe->reader->streamobj,buf,size,w);
+}
+
 file_ops socket_ops = {
   .Open = NULL,
   .Read = socket_read,
   .Write = socket_write,
-  .Close = socket_close
+  .Close = socket_close,
+  .TryRead = socket_try_read,
+  .TryWrite = socket_try_write
 };
 
 
@@ -82,6 +122,8 @@ Fid_t sys_Socket(port_t port)
     
   socket->sfcb=fcb;
   socket->refcount = 0;
+  socket->lock = PIMUTEX_INIT;
+  socket->peercb = NULL;
   socket->type=UNBOUND;
 
   socket->port=port==NOPORT ? NOPORT : port;
@@ -97,22 +139,26 @@ int sys_Listen(Fid_t sock)
   {                       
     SCB* sobj = fcb->streamobj;
     SCB* new_socket =  sobj;
+    int ret = -1;
+
+    PIMutex_Lock(&port_lock);
+    PIMutex_Lock(&new_socket->lock);
   
     if(new_socket->type==PEER )
     {        
-      return -1;          
+      goto finish;          
     }
 
     if(new_socket!=NULL)
     {     
       if(new_socket->port==NOPORT)
-        return -1;
+        goto finish;
     
       if(PORT_MAP[new_socket->port]!=NULL)
         {
           SCB* temp=PORT_MAP[new_socket->port]; 
           if(temp->type==LISTENER )             
-            return -1;          
+            goto finish;          
         }
         PORT_MAP[new_socket->port]=new_socket;
         new_socket->type=LISTENER;
@@ -121,8 +167,12 @@ int sys_Listen(Fid_t sock)
 
         rlnode_init(&(new_socket->lcb->queue), NULL);
 
-        return 0;
+        ret = 0;
         }
+finish:
+    PIMutex_Unlock(&new_socket->lock);
+    PIMutex_Unlock(&port_lock);
+    return ret;
     }
     return -1; 
 }
@@ -138,18 +188,20 @@ Fid_t sys_Accept(Fid_t lsock)
 
      if(slisten!=NULL && slisten->type==LISTENER)
      { 
+        PIMutex_Lock(&port_lock);
         while(is_rlist_empty(&PORT_MAP[slisten->port]->lcb->queue))
-          kernel_wait(&(PORT_MAP[slisten->port]->lcb->req),SCHED_PIPE);
+          kernel_wait(&port_lock,&(PORT_MAP[slisten->port]->lcb->req),SCHED_PIPE);
           
 
         rlnode* request=rlist_pop_front(&(PORT_MAP[slisten->port]->lcb->queue));
+        int flag = PORT_MAP[slisten->port]->lcb->flag;
+        PIMutex_Unlock(&port_lock);
         
          //PEERS
 
         SCB* peer1 = (SCB*) request->scb;
-        peer1->type=PEER; //From UNB to PEER
 
-        Fid_t newf=Socket(slisten->port);
+        Fid_t newf=sys_Socket(slisten->port);
         
         if (newf>=MAX_FILEID)
           return -1;   
@@ -159,7 +211,6 @@ Fid_t sys_Accept(Fid_t lsock)
         void *sobj2 = fcb1->streamobj;
 
         SCB* peer2=(SCB*) sobj2;
-        peer2->type=PEER; //From UNB to PEER
 
         Fid_t fid_pipe[2];
         FCB * fcb_pipe[2];
@@ -173,24 +224,34 @@ Fid_t sys_Accept(Fid_t lsock)
 
         //Make pipes
 
-        peer1->peercb = (PEER_CB*)xmalloc(sizeof(PEER_CB));
-        peer2->peercb = (PEER_CB*)xmalloc(sizeof(PEER_CB));
+        PEER_CB* pcb1 = (PEER_CB*)xmalloc(sizeof(PEER_CB));
+        PEER_CB* pcb2 = (PEER_CB*)xmalloc(sizeof(PEER_CB));
 
-        peer1->peercb->pipe = (PIPE_CB*)xmalloc(sizeof(PIPE_CB));
-        peer2->peercb->pipe = (PIPE_CB*)xmalloc(sizeof(PIPE_CB));
+        pcb1->pipe = (PIPE_CB*)xmalloc(sizeof(PIPE_CB));
+        pcb2->pipe = (PIPE_CB*)xmalloc(sizeof(PIPE_CB));
 
-        peer1->peercb->pipe->writer=fcb_pipe[0];
-        peer1->peercb->pipe->reader=fcb_pipe[1];
+        pcb1->pipe->writer=fcb_pipe[0];
+        pcb1->pipe->reader=fcb_pipe[1];
 
-        peer2->peercb->pipe->writer=fcb_pipe[1];
-        peer2->peercb->pipe->reader=fcb_pipe[0];
+        pcb2->pipe->writer=fcb_pipe[1];
+        pcb2->pipe->reader=fcb_pipe[0];
 
-        if(PORT_MAP[slisten->port]->lcb->flag==1)
+        if(flag==1)
         {
           Initialize_Pipe(fcb_pipe[0],fcb_pipe[1]);
           Initialize_Pipe(fcb_pipe[1],fcb_pipe[0]);
         }
 
+        PIMutex_Lock(&peer1->lock);
+        peer1->type=PEER; //From UNB to PEER
+        peer1->peercb = pcb1;
+        PIMutex_Unlock(&peer1->lock);
+
+        PIMutex_Lock(&peer2->lock);
+        peer2->type=PEER; //From UNB to PEER
+        peer2->peercb = pcb2;
+        PIMutex_Unlock(&peer2->lock);
+
         return newf;
    }
   } 
@@ -210,15 +271,18 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
   if(usocket!=UNBOUND)
     return -1;
 
+  int ret = -1;
+  PIMutex_Lock(&port_lock);
   if(PORT_MAP[port]!=NULL)
     if(PORT_MAP[port]->type==LISTENER){
       rlnode_init(&usocket->socket_node,usocket);
       PORT_MAP[port]->lcb->flag=1;
       rlist_push_back(&PORT_MAP[port]->lcb->queue,&usocket->socket_node);
-      Cond_Signal(&PORT_MAP[port]->lcb->req);
-      return 0;
+      kernel_signal(&PORT_MAP[port]->lcb->req);
+      ret = 0;
     }
-  return -1;
+  PIMutex_Unlock(&port_lock);
+  return ret;
 }
 
 
@@ -227,16 +291,22 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 	    FCB* fcb = get_fcb(sock);
       void *sobj = fcb->streamobj;
       SCB* new_sock=(SCB*) sobj;
-      if(new_sock!=NULL && new_sock->peercb!=NULL){
+      PEER_CB* peer = NULL;
+      if(new_sock!=NULL) {
+        PIMutex_Lock(&new_sock->lock);
+        peer = new_sock->peercb;
+        PIMutex_Unlock(&new_sock->lock);
+      }
+      if(peer!=NULL){
         switch(how){
             case 1:
-                return pipe_reader_close(new_sock->peercb->pipe->reader) == 0 ? 0 : -1;
+                return pipe_reader_close(peer->pipe->reader->streamobj) == 0 ? 0 : -1;
                 break;
             case 2:
-                return pipe_writer_close(new_sock->peercb->pipe->writer) == 0 ? 0 : -1;
+                return pipe_writer_close(peer->pipe->writer->streamobj) == 0 ? 0 : -1;
                 break;
             case 3:
-                return pipe_reader_close(new_sock->peercb->pipe->reader) == 0 && pipe_writer_close(new_sock->peercb->pipe->writer) == 0 ? 0 : -1;
+                return pipe_reader_close(peer->pipe->reader->streamobj) == 0 && pipe_writer_close(peer->pipe->writer->streamobj) == 0 ? 0 : -1;
                  break;
             default: 
                 fprintf(stderr, "Wrong case of shutdown_mode\n");}
@@ -8,8 +8,17 @@
 
 #define MAX_FILES MAX_PROC
 
+/*
+  Locking: the free list of FCBs is protected by FCB_freelist_lock, and
+  the fileid table of each process by the FIDT_lock of its PCB. These are
+  spinlocks, held for a few instructions each; in particular, they are
+  never held while calling a stream method. The reference count of an FCB
+  is atomic, and the FCB is closed by whoever drops it to 0.
+*/
+
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
+static Mutex FCB_freelist_lock = MUTEX_INIT;
 
 
 void initialize_files()
@@ -26,32 +35,34 @@ void initialize_files()
 
 FCB* acquire_FCB()
 {
+  FCB* fcb = NULL;
+  spin_lock(& FCB_freelist_lock);
   if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+    fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
-    return fcb;
   }
-  else
-    return NULL;
+  spin_unlock(& FCB_freelist_lock);
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
+  spin_lock(& FCB_freelist_lock);
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  spin_unlock(& FCB_freelist_lock);
 }
 
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(& fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  if(__atomic_sub_fetch(& fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
     int retval = fcb->streamfunc->Close(fcb->streamobj);
     release_FCB(fcb);
     return retval;
@@ -68,6 +79,8 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     size_t f=0;
     uint i;
 
+    spin_lock(& cur->FIDT_lock);
+
     /* Find distinct fids */
     for(i=0; i<num; i++) {
 	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
@@ -75,7 +88,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto fail;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,14 +99,19 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto fail;
     }
     /* Found all */
     for(i=0;i<num;i++) {
 	cur->FIDT[fid[i]]=fcb[i];
 	FCB_incref(fcb[i]);
     }
+    spin_unlock(& cur->FIDT_lock);
     return 1;
+
+fail:
+    spin_unlock(& cur->FIDT_lock);
+    return 0;
 }
 
 
@@ -101,11 +119,13 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    spin_lock(& cur->FIDT_lock);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
 	cur->FIDT[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
+    spin_unlock(& cur->FIDT_lock);
 }
 
 
@@ -128,6 +148,19 @@ FCB* get_fcb(Fid_t fid)
 }
 
 
+FCB* get_fcb_ref(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+
+  PCB* cur = CURPROC;
+  spin_lock(& cur->FIDT_lock);
+  FCB* fcb = cur->FIDT[fid];
+  if(fcb) FCB_incref(fcb);
+  spin_unlock(& cur->FIDT_lock);
+  return fcb;
+}
+
+
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
@@ -135,16 +168,13 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
   void* sobj;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream, making sure that the stream will 
+     not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
     sobj = fcb->streamobj;
     devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
   
     if(devread)
       retcode = devread(sobj, buf, size);
@@ -152,9 +182,6 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
 
   return retcode;
 }
@@ -167,19 +194,15 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
   void* sobj = NULL;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream, making sure that the stream will 
+     not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
 
     sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
     if(devwrite)
       retcode = devwrite(sobj, buf, size);
 
@@ -197,12 +220,16 @@ int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
 
-  FCB* fcb = get_fcb(fd);
+  if(retcode < 0) return retcode;
 
-  if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+  PCB* cur = CURPROC;
+  spin_lock(& cur->FIDT_lock);
+  FCB* fcb = cur->FIDT[fd];
+  cur->FIDT[fd] = NULL;
+  spin_unlock(& cur->FIDT_lock);
+
+  if(fcb)
     retcode = FCB_decref(fcb);    
-  }
 
   return retcode;
 }
@@ -221,24 +248,33 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  PCB* cur = CURPROC;
+  spin_lock(& cur->FIDT_lock);
+  FCB* old = cur->FIDT[oldfd];
+  FCB* new = cur->FIDT[newfd];
 
   if(old==NULL) {
     retcode = -1;
+    new = NULL;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    cur->FIDT[newfd] = old;
   }
+  else
+    new = NULL;
+  spin_unlock(& cur->FIDT_lock);
+
+  /* Close the replaced stream, without holding the lock */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
 
 
 
+/* Read-only (see kernel_sys.h): the device table does not change after boot */
 unsigned int sys_GetTerminalDevices()
 {
   return device_no(DEV_SERIAL);
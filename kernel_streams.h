@@ -52,7 +52,10 @@ typedef struct  pipe_control_block
   uint w,r ;
   FCB *reader;
   FCB *writer;
+  PIMutex lock;            /**< Protects the pipe; @c In_Cv and @c Out_Cv wait with it */
   CondVar In_Cv, Out_Cv ; //Was empty and full at lectures
+  io_waitqueue readq;      /**< Asynchronous reads, waiting for data or EOF */
+  io_waitqueue writeq;     /**< Asynchronous writes, waiting for space */
 } PIPE_CB;
 
 
@@ -100,6 +103,7 @@ typedef struct socket_control_block
   
   rlnode socket_node;
   uint refcount;
+  PIMutex lock;          /**< Protects @c type and the control block of the socket */
   FCB* sfcb;
   Socket_type type;
   port_t port;
@@ -116,6 +120,9 @@ typedef struct socket_control_block
 
 SCB* PORT_MAP[MAX_PORT+1];
 
+/** @brief The lock of @c PORT_MAP and of the request queues of the listeners */
+extern PIMutex port_lock;
+
 
 
 /* 
@@ -140,6 +147,8 @@ int  pipe_write();
 char get_char();
 void put_char(char ch, PIPE_CB* pipe);
 int  pipe_read();
+int pipe_try_read(void* pipe, char *buf, unsigned int size, io_waiter* w);
+int pipe_try_write(void* pipe, const char* buf, unsigned int size, io_waiter* w);
 int pipe_writer_close();
 int pipe_reader_close();
 
@@ -216,6 +225,9 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
+	It does not lock the fileid table, so the FCB may be closed
+	by another thread at any time; use @ref get_fcb_ref to use
+	the stream.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
@@ -223,6 +235,17 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Translate an fid to an FCB, and increase its reference count.
+
+	The stream stays open until the caller calls @ref FCB_decref,
+	even if another thread closes the fid meanwhile.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL if the fid is not legal.
+ */
+FCB* get_fcb_ref(Fid_t fid);
+
+
 /** @} */
 
 #endif
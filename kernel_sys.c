@@ -8,39 +8,158 @@
 #endif
 
 /*
-	Define all the syscalls 
+	Define all the syscalls.
+
+	There is no global kernel lock to take here: each system call locks
+	the kernel objects that it uses (see kernel_cc.h).
  */
 
 
-#define PRE_CALL \
-kernel_lock();\
+/* with return */
+#define SYSCALL(NAME, RET, SIG, ARGS)\
+RET NAME SIG \
+{\
+	return sys_##NAME ARGS;\
+}\
 
+/* without return */
+#define SYSCALLV(NAME, SIG, ARGS)\
+void NAME SIG \
+{\
+	sys_##NAME ARGS;\
+}\
 
 
-#define POST_CALL \
-kernel_unlock();\
+SYSCALLS
 
+#undef SYSCALL
+#undef SYSCALLV
+
+
+/*
+	Batched system calls.
+
+	For each system call, SYSCALLS is expanded into a dispatcher that
+	unpacks the arguments of the call from a syscall_desc, and calls
+	sys_NAME. The parameters are declared from SIG, e.g., 
+	"Fid_t fd; char *buf; unsigned int size;" and assigned from the
+	arguments, in the order of ARGS, cast to their own types. The array of
+	arguments is called batch_args, so as not to clash with a parameter.
+ */
+
+#define BATCH_NARGS(...) BATCH_NARGS_(_ __VA_OPT__(,) __VA_ARGS__, 4, 3, 2, 1, 0)
+#define BATCH_NARGS_(_, a1, a2, a3, a4, N, ...) N
+#define BATCH_CAT(a, b) BATCH_CAT_(a, b)
+#define BATCH_CAT_(a, b) a ## b
+
+/* Declare the parameters in SIG */
+#define BATCH_DECL(...) BATCH_CAT(BATCH_DECL, BATCH_NARGS(__VA_ARGS__))(__VA_ARGS__)
+#define BATCH_DECL0()
+#define BATCH_DECL1(p1) p1;
+#define BATCH_DECL2(p1, p2) p1; p2;
+#define BATCH_DECL3(p1, p2, p3) p1; p2; p3;
+#define BATCH_DECL4(p1, p2, p3, p4) p1; p2; p3; p4;
+
+/* Assign the parameters in ARGS from the array batch_args */
+#define BATCH_LOAD(...) BATCH_CAT(BATCH_LOAD, BATCH_NARGS(__VA_ARGS__))(__VA_ARGS__)
+#define BATCH_ARG(x, i) x = (__typeof__(x)) batch_args[i];
+#define BATCH_LOAD0()
+#define BATCH_LOAD1(x1) BATCH_ARG(x1, 0)
+#define BATCH_LOAD2(x1, x2) BATCH_LOAD1(x1) BATCH_ARG(x2, 1)
+#define BATCH_LOAD3(x1, x2, x3) BATCH_LOAD2(x1, x2) BATCH_ARG(x3, 2)
+#define BATCH_LOAD4(x1, x2, x3, x4) BATCH_LOAD3(x1, x2, x3) BATCH_ARG(x4, 3)
+
+typedef intptr_t (*batch_dispatcher)(const intptr_t* batch_args);
 
-/* with return */
 #define SYSCALL(NAME, RET, SIG, ARGS)\
-RET NAME SIG \
+static intptr_t batch_##NAME(const intptr_t* batch_args)\
 {\
-	RET __ret;\
-	PRE_CALL\
-	__ret = sys_##NAME ARGS;\
-	POST_CALL\
-	return __ret;\
+	BATCH_DECL SIG\
+	BATCH_LOAD ARGS\
+	return (intptr_t) sys_##NAME ARGS;\
 }\
 
-/* without return */
 #define SYSCALLV(NAME, SIG, ARGS)\
-void NAME SIG \
+static intptr_t batch_##NAME(const intptr_t* batch_args)\
 {\
-	PRE_CALL\
+	BATCH_DECL SIG\
+	BATCH_LOAD ARGS\
 	sys_##NAME ARGS;\
-	POST_CALL\
+	return 0;\
 }\
 
+SYSCALLS
+
+#undef SYSCALL
+#undef SYSCALLV
+
+
+/* The dispatch table, mapping each system call to its dispatcher */
+static const struct {
+	void* call;
+	batch_dispatcher dispatch;
+} batch_table[] = {
+
+#define SYSCALL(NAME, RET, SIG, ARGS)  { (void*) NAME, batch_##NAME },
+#define SYSCALLV(NAME, SIG, ARGS)  { (void*) NAME, batch_##NAME },
 
 SYSCALLS
 
+#undef SYSCALL
+#undef SYSCALLV
+
+};
+
+#define BATCH_TABLE_SIZE (sizeof(batch_table)/sizeof(batch_table[0]))
+
+
+static batch_dispatcher batch_lookup(void* call)
+{
+	for(unsigned int i=0; i<BATCH_TABLE_SIZE; i++)
+		if(batch_table[i].call == call)
+			return batch_table[i].dispatch;
+	return NULL;
+}
+
+
+/* 
+	A batch usually repeats a few system calls (e.g., Write and Read), so
+	the dispatchers of the last few distinct calls are kept in a small 
+	cache, to avoid searching the table for each call.
+ */
+#define BATCH_CACHE_SIZE 4
+
+int sys_SyscallBatch(syscall_desc* calls, unsigned int n)
+{
+	void* cached_call[BATCH_CACHE_SIZE] = { NULL };
+	batch_dispatcher cached_dispatch[BATCH_CACHE_SIZE];
+	unsigned int victim = 0;
+
+	for(unsigned int i=0; i<n; i++) {
+		/* An empty slot of the cache would match a NULL call */
+		if(calls[i].call == NULL) {
+			calls[i].ret = -1;
+			return i;
+		}
+
+		batch_dispatcher dispatch = NULL;
+		unsigned int c;
+		for(c=0; c<BATCH_CACHE_SIZE; c++)
+			if(cached_call[c] == calls[i].call) {
+				dispatch = cached_dispatch[c];
+				break;
+			}
+		if(c == BATCH_CACHE_SIZE) {
+			dispatch = batch_lookup(calls[i].call);
+			cached_call[victim] = calls[i].call;
+			cached_dispatch[victim] = dispatch;
+			victim = (victim + 1) % BATCH_CACHE_SIZE;
+		}
+		if(dispatch == NULL) {
+			calls[i].ret = -1;
+			return i;
+		}
+		calls[i].ret = dispatch(calls[i].args);
+	}
+	return n;
+}
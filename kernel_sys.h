@@ -4,17 +4,51 @@
 #include "bios.h"
 #include "tinyos.h"
 
+/*
+	The table of system calls. Each entry is one of
+	- SYSCALL(NAME, RET, SIG, ARGS): a system call returning RET
+	- SYSCALLV(NAME, SIG, ARGS): a system call returning void
+
+	The code that expands SYSCALLS must define both macros.
+
+	SIG is the parameter list, written as () when there are no parameters,
+	and ARGS the list of parameter names. Both are used by SyscallBatch
+	(see kernel_sys.c) to unpack the arguments of a call, so a system call
+	may have at most SYSCALL_MAX_ARGS parameters, of integral or pointer types.
+
+	Read-only system calls have no side effects, and they neither lock
+	nor sleep. They only read per-core data (see @c cur_thread) or 
+	fields that are updated atomically, so they never wait for another
+	core. They are:
+
+	  GetPid              the pid of the current thread's PCB
+	  GetPPid             the parent pointer, stored atomically by Exit
+	  ThreadSelf          the current thread, by cur_thread()
+	  GetTerminalDevices  the device table, fixed after boot
+
+	A new system call in this list must keep to these rules.
+ */
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
 SYSCALLV(Exit, (int exitval), (exitval))\
-SYSCALL(GetPid, int, (void), ())\
-SYSCALL(GetPPid, int, (void), ())\
+SYSCALL(GetPid, int, (), ())\
+SYSCALL(GetPPid, int, (), ())\
+SYSCALL(SetNice, int, (Pid_t pid, int nice), (pid, nice))\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
-SYSCALL(ThreadSelf, Tid_t, (void), ())\
+SYSCALL(CreateThreadStack, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
+SYSCALL(ThreadSelf, Tid_t, (), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
+SYSCALL(SetThreadAffinity, int, (Tid_t tid, cpumask_t mask), (tid, mask))\
+SYSCALL(GetThreadAffinity, cpumask_t, (Tid_t tid), (tid))\
+SYSCALL(SetPriority, int, (Tid_t tid, int priority), (tid, priority))\
+SYSCALL(GetPriority, int, (Tid_t tid), (tid))\
+SYSCALL(SetPeriodic, int, (Tid_t tid, timeout_t period, timeout_t budget), (tid, period, budget))\
+SYSCALL(WaitNextPeriod, int, (), ())\
+SYSCALL(GetDeadlineMisses, int, (Tid_t tid), (tid))\
+SYSCALL(GetThreadInfo, int, (Tid_t tid, threadinfo* info), (tid, info))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
@@ -29,6 +63,12 @@ SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(OpenCoreInfo, Fid_t, (), ())\
+SYSCALL(FutexWait, int, (int* addr, int expected, timeout_t timeout), (addr, expected, timeout))\
+SYSCALL(FutexWake, int, (int* addr, unsigned int n), (addr, n))\
+SYSCALL(IoRingSetup, io_ring*, (unsigned int entries), (entries))\
+SYSCALL(IoRingEnter, int, (unsigned int min_complete, timeout_t timeout), (min_complete, timeout))\
+SYSCALL(SyscallBatch, int, (syscall_desc* calls, unsigned int n), (calls, n))\
 
 
 
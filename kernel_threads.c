@@ -8,16 +8,25 @@
 #include "util.h"
 
 
-Mutex kernel_mutex = MUTEX_INIT;
-
 /** 
   @brief Create a new thread in the current process.
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
 {
+  return sys_CreateThreadStack(task, argl, args, 0);
+}
+
+/** 
+  @brief Create a new thread in the current process, with the given stack size.
+  */
+Tid_t sys_CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size)
+{
+  if(stack_size > THREAD_STACK_MAX)
+    return NOTHREAD;
+
   PTCB* cur_ptcb=xmalloc(sizeof(PTCB));
 
-  cur_ptcb->thread=spawn_thread(CURPROC,start_new_thread); //Spawn a thread for our new ptcb node and then ./ Start Thread ./ Exit Thread
+  cur_ptcb->thread=spawn_thread(CURPROC,start_new_thread,stack_size); //Spawn a thread for our new ptcb node and then ./ Start Thread ./ Exit Thread
 
   cur_ptcb->main_task=task;
   cur_ptcb->argl=argl;      
@@ -32,9 +41,11 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
   cur_ptcb->ref_count=1;
 
   rlnode_init(&cur_ptcb->ptcb_node,cur_ptcb);
+  PIMutex_Lock(& proc_lock);
   rlist_push_back(&CURPROC->ptcbs,&cur_ptcb->ptcb_node);
 
   CURPROC->thread_counter++; //Need to sysinfo!
+  PIMutex_Unlock(& proc_lock);
 
   wakeup(cur_ptcb->thread); //Send signal to the scheduler so that the thread becomes ready //-FAULT- Edo itan to lathos sto 1o meros
   
@@ -45,17 +56,18 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
 }
 
 /**
-  @brief Return the Tid of the current thread.
+  @brief Return the Tid of the current thread (read-only, see kernel_sys.h).
  */
 Tid_t sys_ThreadSelf()
 {
-	return (Tid_t) CURTHREAD;
+	return (Tid_t) cur_thread();
 }
 
-/**
-  @brief Join the given thread.
+/*
+  Join the given thread.
+  *** MUST BE CALLED WITH proc_lock HELD ***
   */
-int sys_ThreadJoin(Tid_t tid, int* exitval)
+static int thread_join(Tid_t tid, int* exitval)
 {   
 
   PTCB* ptcbg;
@@ -88,7 +100,7 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
 
   while (join_ptcb->exited!=1 && join_ptcb->detached!=1)
   {
-  	kernel_wait(&join_ptcb->Jointhreads, SCHED_USER);
+  	kernel_wait(& proc_lock, &join_ptcb->Jointhreads, SCHED_USER);
   }
 
   if (exitval==NULL)
@@ -128,6 +140,17 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   return -1;
 }
 
+/**
+  @brief Join the given thread.
+  */
+int sys_ThreadJoin(Tid_t tid, int* exitval)
+{
+  PIMutex_Lock(& proc_lock);
+  int ret = thread_join(tid, exitval);
+  PIMutex_Unlock(& proc_lock);
+  return ret;
+}
+
 
 
 /**
@@ -146,13 +169,18 @@ int sys_ThreadDetach(Tid_t tid)
   rlnode* fail=(rlnode*)xmalloc(sizeof(rlnode));
   node=rlnode_init(node, NULL);
   fail=rlnode_init(fail, NULL);
+
+  PIMutex_Lock(& proc_lock);
   node=ptcbs_search_method(ptcbs,ptcb_owner,fail);
 
-  if(node==fail || the_tcb->state==EXITED)
+  if(node==fail || the_tcb->state==EXITED) {
+     PIMutex_Unlock(& proc_lock);
      return -1;
+  }
 
   ptcb_owner->detached=1;
-  Cond_Broadcast(&ptcb_owner->Jointhreads);
+  kernel_broadcast(& proc_lock, &ptcb_owner->Jointhreads);
+  PIMutex_Unlock(& proc_lock);
 	
   return 0; 
 }
@@ -168,10 +196,13 @@ void sys_ThreadExit(int exitval)
 
   rlnode* node;
   
+  PIMutex_Lock(& proc_lock);
+
   owner_ptcb->exited=1;
   owner_ptcb->exitval=exitval;
   
-  Cond_Broadcast(&owner_ptcb->Jointhreads);
+  kernel_broadcast(& proc_lock, &owner_ptcb->Jointhreads);
+  kernel_broadcast(& proc_lock, & CURPROC->thread_exit);
 
   if (owner_ptcb->detached==1)
   {
@@ -190,10 +221,148 @@ void sys_ThreadExit(int exitval)
   }
 
   /* Bye-bye cruel world */
-        fprintf(stderr, "BB CRUEL WORLD\n");
+  kernel_sleep(& proc_lock, EXITED, SCHED_USER);		
+}
+
+
+
+
 
-  kernel_sleep(EXITED, SCHED_USER);		
+/*
+  Return the PTCB of an unexited thread of the current process, or NULL.
+  The tid may be given as returned by CreateThread or by ThreadSelf.
+  *** MUST BE CALLED WITH proc_lock HELD ***
+ */
+static PTCB* find_live_ptcb(Tid_t tid)
+{
+  rlnode* ptcbs = &CURPROC->ptcbs;
+  for(rlnode* node = ptcbs->next; node != ptcbs; node = node->next) {
+    PTCB* ptcb = node->ptcb;
+    if(((Tid_t) ptcb == tid || (Tid_t) ptcb->thread == tid) && ! ptcb->exited)
+      return ptcb;
+  }
+  return NULL;
 }
 
+/**
+  @brief Set the cores where a thread may run.
+  */
+int sys_SetThreadAffinity(Tid_t tid, cpumask_t mask)
+{
+  /* Some existing core must be allowed */
+  cpumask_t cores = (cpu_cores() < 32) ? (1u << cpu_cores()) - 1 : ALL_CORES;
+  if((mask & cores) == 0)
+    return -1;
+
+  PIMutex_Lock(& proc_lock);
+  PTCB* ptcb = find_live_ptcb(tid);
+  if(ptcb != NULL)
+    set_thread_affinity(ptcb->thread, mask);
+  PIMutex_Unlock(& proc_lock);
+  return (ptcb != NULL) ? 0 : -1;
+}
 
+/**
+  @brief Return the set of cores where a thread may run.
+  */
+cpumask_t sys_GetThreadAffinity(Tid_t tid)
+{
+  PIMutex_Lock(& proc_lock);
+  PTCB* ptcb = find_live_ptcb(tid);
+  cpumask_t mask = (ptcb != NULL) ? ptcb->thread->affinity : 0;
+  PIMutex_Unlock(& proc_lock);
+  return mask;
+}
 
+/**
+  @brief Set the priority of a thread.
+  */
+int sys_SetPriority(Tid_t tid, int priority)
+{
+  if(priority < 0 || priority >= THREAD_PRIORITIES)
+    return -1;
+
+  PIMutex_Lock(& proc_lock);
+  PTCB* ptcb = find_live_ptcb(tid);
+  if(ptcb != NULL)
+    set_thread_priority(ptcb->thread, priority);
+  PIMutex_Unlock(& proc_lock);
+  return (ptcb != NULL) ? 0 : -1;
+}
+
+/**
+  @brief Return the priority of a thread.
+  */
+int sys_GetPriority(Tid_t tid)
+{
+  PIMutex_Lock(& proc_lock);
+  PTCB* ptcb = find_live_ptcb(tid);
+  int priority = (ptcb != NULL) ? ptcb->thread->thread_priority : -1;
+  PIMutex_Unlock(& proc_lock);
+  return priority;
+}
+
+/**
+  @brief Make a thread periodic.
+  */
+int sys_SetPeriodic(Tid_t tid, timeout_t period, timeout_t budget)
+{
+  if(period > 0 && (budget == 0 || budget > period))
+    return -1;
+
+  PIMutex_Lock(& proc_lock);
+  PTCB* ptcb = find_live_ptcb(tid);
+  if(ptcb != NULL)
+    set_thread_periodic(ptcb->thread, period*1000, budget*1000);
+  PIMutex_Unlock(& proc_lock);
+  return (ptcb != NULL) ? 0 : -1;
+}
+
+/**
+  @brief End the current job of a periodic thread.
+  */
+int sys_WaitNextPeriod()
+{
+  if(CURTHREAD->rt_period == 0)
+    return -1;
+
+  /* Sleep until the next release; nobody signals this */
+  PIMutex mx = PIMUTEX_INIT;
+  CondVar release = COND_INIT;
+  PIMutex_Lock(& mx);
+  kernel_timedwait(& mx, & release, SCHED_USER, end_periodic_job());
+  PIMutex_Unlock(& mx);
+  return 0;
+}
+
+/**
+  @brief Return the number of deadlines missed by a thread.
+  */
+int sys_GetDeadlineMisses(Tid_t tid)
+{
+  PIMutex_Lock(& proc_lock);
+  PTCB* ptcb = find_live_ptcb(tid);
+  int misses = (ptcb != NULL) ? ptcb->thread->rt_misses : -1;
+  PIMutex_Unlock(& proc_lock);
+  return misses;
+}
+
+/**
+  @brief Return the CPU time accounting of a thread.
+  */
+int sys_GetThreadInfo(Tid_t tid, threadinfo* info)
+{
+  if(info == NULL)
+    return -1;
+
+  PIMutex_Lock(& proc_lock);
+  PTCB* ptcb = find_live_ptcb(tid);
+  if(ptcb != NULL) {
+    TCB* tcb = ptcb->thread;
+    info->run_time = tcb->run_time;
+    info->vol_switches = tcb->vol_switches;
+    info->invol_switches = tcb->invol_switches;
+  }
+  PIMutex_Unlock(& proc_lock);
+  return (ptcb != NULL) ? 0 : -1;
+}
@@ -0,0 +1,172 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernel_trace.h"
+#include "kernel_proc.h"
+
+
+/**
+	@file kernel_trace.c
+
+	@brief The implementation of scheduler tracing.
+
+	Each core writes only to its own ring, but a thread may be preempted
+	in the middle of writing an event, and another thread on the same core
+	may then record events too. Therefore, a slot is reserved by an atomic
+	increment of the ring's head, and the event is published by storing
+	its sequence number last. A reader copies a slot and checks that the
+	sequence number was the expected one, before and after the copy.
+*/
+
+
+typedef struct trace_ring {
+	unsigned long head;		/* The number of events ever recorded in this ring */
+	trace_record rec[TRACE_RING_SIZE];
+} __attribute__((aligned(64))) trace_ring;
+
+static trace_ring trace_rings[MAX_CORES];
+
+int trace_enabled = 0;
+
+
+void trace_event(enum TRACE_EVENT event, TCB* tcb, int cause, int arg)
+{
+	trace_ring* ring = & trace_rings[cpu_core_id];
+	unsigned long n = __atomic_fetch_add(& ring->head, 1, __ATOMIC_RELAXED);
+	trace_record* r = & ring->rec[n & (TRACE_RING_SIZE-1)];
+
+	__atomic_store_n(& r->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	r->time = bios_fine_clock();
+	r->tcb = tcb;
+	r->pid = (tcb == NULL) ? NOPROC : get_pid(tcb->owner_pcb);
+	r->arg = arg;
+	r->event = event;
+	r->cause = cause;
+	r->state = (tcb == NULL) ? 0 : tcb->state;
+
+	__atomic_store_n(& r->seq, n+1, __ATOMIC_RELEASE);
+}
+
+
+void trace_enable(int on)
+{
+	if(on && ! trace_enabled) {
+		for(uint c=0; c<MAX_CORES; c++) {
+			trace_rings[c].head = 0;
+			for(uint i=0; i<TRACE_RING_SIZE; i++)
+				trace_rings[c].rec[i].seq = 0;
+		}
+	}
+	__atomic_store_n(& trace_enabled, on, __ATOMIC_RELEASE);
+}
+
+
+/* Copy the n-th event of a ring. Return 0 if it was not (fully) written, or overwritten. */
+static int trace_read(trace_ring* ring, unsigned long n, trace_record* out)
+{
+	trace_record* r = & ring->rec[n & (TRACE_RING_SIZE-1)];
+	if(__atomic_load_n(& r->seq, __ATOMIC_ACQUIRE) != n+1) return 0;
+	*out = *r;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(& r->seq, __ATOMIC_RELAXED) == n+1;
+}
+
+
+static const char* trace_event_name[] = {
+	"yield", "gain", "wakeup", "sleep", "select"
+};
+
+static const char* trace_cause_name[] = {
+	"quantum", "io", "mutex", "pipe", "poll", "idle", "user", "preempt"
+};
+
+static const char* trace_state_name[] = {
+	"init", "ready", "running", "stopped", "exited"
+};
+
+
+/* Print the separator of JSON array elements */
+static void trace_sep(FILE* f, unsigned long* count)
+{
+	fputs((*count)++ ? ",\n" : "\n", f);
+}
+
+unsigned long trace_dump_json(FILE* f)
+{
+	unsigned long count = 0;
+
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", f);
+
+	trace_sep(f, &count);
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"cores\"}}");
+
+	for(uint c=0; c<cpu_cores(); c++) {
+		trace_ring* ring = & trace_rings[c];
+		unsigned long head = __atomic_load_n(& ring->head, __ATOMIC_ACQUIRE);
+		unsigned long first = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+
+		trace_sep(f, &count);
+		fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,"
+			"\"args\":{\"name\":\"core %u\"}}", c, c);
+
+		/* The slice of the thread running on the core, from its gain to its yield */
+		TCB* running = NULL;
+		TimerDuration since = 0;
+
+		for(unsigned long n=first; n<head; n++) {
+			trace_record r;
+			if(! trace_read(ring, n, &r)) continue;
+
+			if(r.event == TRACE_YIELD && r.tcb == running && running != NULL) {
+				trace_sep(f, &count);
+				fprintf(f, "{\"name\":\"%s %d\",\"cat\":\"run\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,"
+					"\"pid\":0,\"tid\":%u,\"args\":{\"tcb\":\"%p\"}}",
+					(r.pid == 0) ? "idle" : "pid", r.pid,
+					(unsigned long) since, (unsigned long)(r.time - since), c, (void*) running);
+				running = NULL;
+			}
+			if(r.event == TRACE_GAIN) {
+				running = r.tcb;
+				since = r.time;
+			}
+
+			trace_sep(f, &count);
+			fprintf(f, "{\"name\":\"%s\",\"cat\":\"sched\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lu,"
+				"\"pid\":0,\"tid\":%u,\"args\":{\"tcb\":\"%p\",\"pid\":%d,\"state\":\"%s\",\"arg\":%d",
+				trace_event_name[r.event], (unsigned long) r.time, c, (void*) r.tcb, r.pid,
+				(r.tcb == NULL) ? "none" : trace_state_name[r.state], r.arg);
+			if(r.cause >= 0)
+				fprintf(f, ",\"cause\":\"%s\"", trace_cause_name[(int) r.cause]);
+			fputs("}}", f);
+		}
+	}
+
+	fputs("\n]}\n", f);
+	return count;
+}
+
+
+void initialize_trace()
+{
+	if(getenv("TINYOS_TRACE") != NULL)
+		trace_enable(1);
+}
+
+
+void finalize_trace()
+{
+	const char* fname = getenv("TINYOS_TRACE");
+	if(fname == NULL) return;
+
+	trace_enable(0);
+	FILE* f = fopen(fname, "w");
+	if(f == NULL) {
+		perror(fname);
+		return;
+	}
+	trace_dump_json(f);
+	fclose(f);
+}
@@ -0,0 +1,119 @@
+/*
+ *  Scheduler tracing API
+ *
+ */
+
+#ifndef __KERNEL_TRACE_H
+#define __KERNEL_TRACE_H
+
+#include <stdio.h>
+
+/**
+	@file kernel_trace.h
+	@brief Scheduler event tracing.
+
+	@defgroup trace Scheduler tracing.
+	@ingroup kernel
+	@brief Scheduler event tracing.
+
+	The scheduler records its events (switches, wakeups, sleeps and
+	selections) into a ring buffer per core. Recording is lock-free, so
+	that it can be done from any context, including interrupt handlers
+	and code holding spinlocks. When the ring of a core is full, the
+	oldest events are overwritten.
+
+	Tracing is off by default, and then each tracepoint costs a single
+	test of @c trace_enabled. Compiling with @c -DNTRACE removes the
+	tracepoints altogether.
+
+	To trace a program, set the environment variable @c TINYOS_TRACE to
+	the name of a file:
+	@code
+	$ TINYOS_TRACE=trace.json ./mtask 4 0 10 10
+	@endcode
+	When the VM shuts down, the rings are written to the file in the
+	Chrome trace-event format, which can be opened by @c chrome://tracing
+	or by Perfetto. The timeline shows one track per core, with the slices
+	during which each thread ran, and the events as instants.
+	@{
+*/
+
+#include "kernel_sched.h"
+
+
+/** @brief The number of events kept in the ring of each core (a power of 2) */
+#define TRACE_RING_SIZE  8192
+
+/** @brief The kinds of traced events */
+enum TRACE_EVENT {
+	TRACE_YIELD,	/**< A thread called @c yield; @c cause is the cause */
+	TRACE_GAIN,		/**< A thread started a time slice; @c arg is its previous core */
+	TRACE_WAKEUP,	/**< A thread woke up a thread; @c arg is the core that queued it, or -1 */
+	TRACE_SLEEP,	/**< A thread went to sleep; @c cause is the cause */
+	TRACE_SELECT	/**< The scheduler selected a thread, or none; @c arg is 1 if it was stolen */
+};
+
+/** @brief A traced event */
+typedef struct trace_record {
+	unsigned long seq;		/**< The position of the event in the ring, plus 1; 0 while it is written */
+	TimerDuration time;		/**< The time of the event, from @c bios_fine_clock */
+	TCB* tcb;				/**< The thread of the event */
+	Pid_t pid;				/**< The process of the thread */
+	short arg;				/**< An argument that depends on @c event */
+	unsigned char event;	/**< A value of @c enum TRACE_EVENT */
+	signed char cause;		/**< A value of @c enum SCHED_CAUSE, or -1 */
+	unsigned char state;	/**< The @c Thread_state of the thread after the event */
+} trace_record;
+
+
+/** @brief Non-zero when events are recorded */
+extern int trace_enabled;
+
+/**
+	@brief Record an event in the ring of the current core.
+
+	Use the @c TRACE macro instead, which does not call this when
+	tracing is disabled.
+*/
+void trace_event(enum TRACE_EVENT event, TCB* tcb, int cause, int arg);
+
+#ifndef NTRACE
+/** @brief A tracepoint */
+#define TRACE(event, tcb, cause, arg) \
+	do { if(__builtin_expect(trace_enabled, 0)) trace_event((event), (tcb), (cause), (arg)); } while(0)
+#else
+#define TRACE(event, tcb, cause, arg)  do { } while(0)
+#endif
+
+
+/**
+	@brief Turn tracing on or off.
+
+	Turning tracing on clears the rings.
+*/
+void trace_enable(int on);
+
+/**
+	@brief Write the events of all rings to a file, in the Chrome
+	trace-event JSON format.
+
+	This may be called while the cores are running; events that are
+	overwritten during the dump are skipped.
+
+	@returns the number of events written.
+*/
+unsigned long trace_dump_json(FILE* f);
+
+/**
+	@brief Start tracing at boot, if @c TINYOS_TRACE is set.
+*/
+void initialize_trace();
+
+/**
+	@brief Dump the rings to the file named by @c TINYOS_TRACE, if it is set.
+*/
+void finalize_trace();
+
+/** @} */
+
+#endif
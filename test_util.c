@@ -265,6 +265,95 @@ TEST_SUITE(rlist_tests,
 };
 
 
+/* Unit tests for the resource trees */
+
+/* Check the tree structure, and that its nodes are in key order, FIFO for equal keys */
+static void check_tree(rtree* T)
+{
+	size_t count = 0;
+	rtnode* prev = NULL;
+	for(rtnode* n = rtree_first(T); n != NULL; n = rtree_next(n)) {
+		if(n->left) ASSERT(n->left->parent == n);
+		if(n->right) ASSERT(n->right->parent == n);
+		if(prev) {
+			ASSERT(prev->key <= n->key);
+			if(prev->key == n->key) ASSERT(prev->num < n->num);
+		}
+		prev = n;
+		count++;
+	}
+	ASSERT(count == T->size);
+	ASSERT((T->size == 0) == is_rtree_empty(T));
+	if(T->root) ASSERT(T->root->parent == NULL);
+}
+
+
+BARE_TEST(test_tree_insert,
+	"Test that the nodes of a tree are visited in key order, and in order "
+	"of insertion for equal keys."
+	)
+{
+	rtree T; rtree_init(&T);
+	ASSERT(rtree_first(&T) == NULL);
+
+	const int N = 1000;
+	rtnode n[N];
+	unsigned long minkey = -1;
+	for(int i=0; i<N; i++) {
+		unsigned long key = (i*7919) % 97;
+		rtree_insert(&T, rtnode_init(n+i, NULL), key);
+		n[i].num = i;
+		if(key < minkey) minkey = key;
+		ASSERT(rtree_first(&T)->key == minkey);
+	}
+	check_tree(&T);
+	ASSERT(T.size == N);
+}
+
+
+BARE_TEST(test_tree_remove,
+	"Test removing nodes from any position of a tree."
+	)
+{
+	rtree T; rtree_init(&T);
+
+	const int N = 1000;
+	rtnode n[N];
+	for(int i=0; i<N; i++) {
+		rtree_insert(&T, rtnode_init(n+i, NULL), (i*31) % 10);
+		n[i].num = i;
+	}
+
+	/* Remove every third node, then all the others from the front */
+	for(int i=0; i<N; i+=3)
+		rtree_remove(&T, n+i);
+	check_tree(&T);
+	ASSERT(T.size == N - (N+2)/3);
+
+	unsigned long lastkey = 0;
+	while(! is_rtree_empty(&T)) {
+		rtnode* first = rtree_first(&T);
+		ASSERT(first->key >= lastkey);
+		lastkey = first->key;
+		rtree_remove(&T, first);
+	}
+	ASSERT(T.size == 0 && rtree_first(&T) == NULL);
+
+	/* A node can be reinserted */
+	rtree_insert(&T, n, 5);
+	ASSERT(rtree_first(&T) == n && rtree_next(n) == NULL);
+}
+
+
+TEST_SUITE(rtree_tests,
+	"Tests for the resource tree")
+{
+	&test_tree_insert,
+	&test_tree_remove,
+	NULL
+};
+
+
 
 void test_argv(size_t argc, const char* argv[])
 {
@@ -548,6 +637,7 @@ TEST_SUITE(all_tests,
 	"All tests")
 {
 	&rlist_tests,
+	&rtree_tests,
 	&test_pack_unpack,
 	&exception_tests,	
 	NULL
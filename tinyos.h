@@ -66,6 +66,26 @@ typedef uintptr_t Tid_t;
 /** @brief The invalid thread ID */
 #define NOTHREAD ((Tid_t)0)
 
+/**
+  @brief A set of cores.
+
+  Bit @c c of a mask is set when core @c c belongs to the set.
+  */
+typedef unsigned int cpumask_t;
+
+/** @brief The set of all cores */
+#define ALL_CORES ((cpumask_t)-1)
+
+/** 
+  @brief The number of thread priorities. 
+
+  Priorities range from 0 (the lowest) to @c THREAD_PRIORITIES-1.
+  */
+#define THREAD_PRIORITIES 4
+
+/** @brief The priority of new threads */
+#define DEFAULT_PRIORITY 1
+
 
 /*******************************************
  *      Concurrency control
@@ -74,8 +94,10 @@ typedef uintptr_t Tid_t;
 /** @brief A mutex is used to provide mutual exclusion. 
   
     Mutexes are used extensively to surround critical sections. The TinyOS
-    mutexes are suitable for use in user-space, as well as in the implementation 
-    of the kernel.
+    mutexes are suitable for use in user-space, as well as in the preemptive
+    domain of the kernel. A thread that waits for a mutex sleeps, and the 
+    waiting threads get the mutex in FIFO order, unless a running thread 
+    gets it first (which is allowed only for a short while).
 
     @see Mutex_Lock
     @see Mutex_Unlock
@@ -96,19 +118,19 @@ typedef char Mutex;
 
 /** @brief Lock a mutex.
 
-  Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
-  In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
+  Lock a mutex, by waiting if necessary, as long as it takes. If the mutex
+  is locked, the thread spins for a few hundred times, and then it sleeps 
+  until the mutex is unlocked. This call must not be used in interrupt 
+  handlers; the kernel uses spinlocks there (see @c spin_lock).
 
   @see Mutex
   @see Mutex_Unlock
-  @see set_core_preemption
   */
 void Mutex_Lock(Mutex*);
 
 /** @brief Unlock a mutex that you locked. 
   
-    This operation is non-blocking.
+    This operation is non-blocking; it wakes up a thread waiting for the mutex, if any.
     @see Mutex
     @see Mutex_Lock
 */
@@ -127,7 +149,7 @@ void Mutex_Unlock(Mutex*);
  */
 typedef struct {
   void *waitset;        /**< The set of waiting threads */
-  Mutex waitset_lock;   /**< A mutex to protect `waitset` */
+  Mutex waitset_lock;   /**< A spinlock to protect `waitset` */
 } CondVar;
 
 
@@ -207,6 +229,111 @@ void Cond_Signal(CondVar*);
 void Cond_Broadcast(CondVar*); 
 
 
+/** @brief A mutex with priority inheritance.
+
+  Unlike a @c Mutex, which does not know which thread holds it, this 
+  mutex records its owner. While threads wait, the owner inherits the highest priority among 
+  them (if that is higher than its own), so that threads of middle 
+  priority cannot keep it from releasing the mutex (priority inversion).
+  On unlock, the mutex is handed to the waiting thread of the highest
+  priority, in FIFO order among equals.
+
+  Inheritance is not transitive: if the owner waits for another 
+  mutex, the owner of that one does not inherit the priority.
+  A thread may hold several such mutexes; it keeps the priorities 
+  it inherited until it releases the last of them.
+
+  @see PIMutex_Lock
+  @see PIMutex_Unlock
+  @see Cond_WaitPI
+  @see PIMUTEX_INIT
+*/
+typedef struct {
+  void* owner;          /**< The thread holding the mutex, or NULL */
+  void* waitset;        /**< The set of waiting threads */
+  Mutex waitset_lock;   /**< A spinlock to protect `owner` and `waitset` */
+} PIMutex;
+
+/** @brief This macro is used to initialize priority-inheritance mutexes. */
+#define PIMUTEX_INIT ((PIMutex){ NULL, NULL, MUTEX_INIT })
+
+/** @brief Lock a priority-inheritance mutex, blocking as long as it takes. 
+
+  The mutex must not be already held by the calling thread.
+  @see PIMutex
+  */
+void PIMutex_Lock(PIMutex* mx);
+
+/** @brief Unlock a priority-inheritance mutex held by the calling thread. 
+  @see PIMutex
+  */
+void PIMutex_Unlock(PIMutex* mx);
+
+/** @brief Wait on a condition variable, with a priority-inheritance mutex. 
+
+  This is the same as @c Cond_Wait, for a @c PIMutex.
+  @see Cond_Wait
+  */
+int Cond_WaitPI(PIMutex* mx, CondVar* cv);
+
+/** @brief Wake up all threads waiting on a condition variable with 
+  a priority-inheritance mutex.
+
+  This is the same as @c Cond_Broadcast, for threads waiting in 
+  @c Cond_WaitPI on mutex @c mx. Since they will all lock @c mx before
+  they return, they are not made ready at once; instead, they are moved 
+  to the waitset of the mutex (wait morphing), and are woken up one at 
+  a time, as the mutex is handed to them. Thus, the threads do not all
+  wake up only to block again on the mutex.
+
+  All the waiters of @c cv must be waiting with @c mx.
+  @see Cond_WaitPI
+  */
+void Cond_BroadcastPI(PIMutex* mx, CondVar* cv);
+
+
+/** @brief Wait on a futex (fast user-space mutex).
+
+  A futex is any @c int in memory. Libraries use futexes to build their
+  own synchronization objects (locks, semaphores, barriers etc.), whose
+  uncontended operations are atomic instructions on the @c int, without
+  a system call. Only a thread that has to wait calls @c FutexWait, and
+  only a thread that changed the @c int in a way that waiters may care 
+  about calls @c FutexWake.
+
+  If @c *addr equals @c expected, the calling thread sleeps until
+  it is woken up by @c FutexWake on @c addr, or the timeout expires. 
+  The comparison and the sleep happen atomically with respect to 
+  @c FutexWake, so a thread that changes @c *addr and then calls 
+  @c FutexWake does not miss a waiter.
+
+  As with condition variables, the caller must check @c *addr again 
+  after this returns.
+
+  @param addr the address of the futex
+  @param expected the value of @c *addr that the caller waits to change
+  @param timeout the maximum time to wait, in milliseconds, or 
+    @c (timeout_t)-1 to wait without a timeout.
+  @returns 0 if the thread was woken up by @c FutexWake, or -1 if
+    @c addr is NULL, @c *addr was not equal to @c expected, or the 
+    timeout expired.
+  @see FutexWake
+  */
+int FutexWait(int* addr, int expected, timeout_t timeout);
+
+/** @brief Wake up threads waiting on a futex.
+
+  Up to @c n of the threads waiting in @c FutexWait on @c addr are 
+  woken up, in the order that they started waiting.
+
+  @param addr the address of the futex
+  @param n the maximum number of threads to wake up
+  @returns the number of threads woken up, or -1 if @c addr is NULL.
+  @see FutexWait
+  */
+int FutexWake(int* addr, unsigned int n);
+
+
 /*******************************************
  *
  * Process creation
@@ -255,6 +382,12 @@ Pid_t Exec(Task task, int argl, void* args);
   return value) from its main function, in which case the return value of the
   main function becomes the exit status.
 
+  @note The process becomes a zombie, and a parent waiting in @c WaitChild
+  is notified, only after all the other threads of the process have exited. 
+  Until then, the calling thread blocks in @c Exit. Therefore, a process 
+  with a thread that never exits (e.g., one blocked forever) never 
+  terminates, and @c WaitChild for it does not return.
+
   @param val the exit status of the process
   @see Exec
    */
@@ -296,6 +429,31 @@ Pid_t GetPid(void);
  */
 Pid_t GetPPid(void);
 
+/** @brief The lowest nice value, which gives a process the largest share of the cores */
+#define NICE_MIN (-20)
+
+/** @brief The highest nice value, which gives a process the smallest share of the cores */
+#define NICE_MAX 19
+
+/**
+  @brief Set the nice value of a process.
+
+  Threads of equal priority share the cores fairly between processes, 
+  regardless of the number of threads of each process (see @c SetPriority).
+  The share of a process is in proportion to its weight, which is 1024 
+  at nice 0 and changes by a factor of about 1.25 for each step of nice;
+  e.g., a process at nice 0 gets about 3 times the share of a process at
+  nice 5. New processes inherit the nice value of their parent.
+
+  @param pid the process, which must be the current process or a child of it
+  @param nice the new nice value, from @c NICE_MIN to @c NICE_MAX
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no live process with the given pid, which is the current
+      process or a child of it.
+    - the nice value is out of range.
+  */
+int SetNice(Pid_t pid, int nice);
+
 /*******************************************
  *
  * Threads
@@ -324,6 +482,22 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+
+  This is the same as `CreateThread`, except that the stack of the new
+  thread has (at least) `stack_size` bytes, instead of the default size.
+  Stack memory is committed as it is used, so threads with large stacks
+  cost only as much memory as they touch; however, lightweight threads can
+  use a small stack to save address space. A stack size of 0 selects the
+  default size. Stacks smaller than a system minimum are enlarged to it.
+
+  @param task a function to execute
+  @param stack_size the size of the stack of the new thread, in bytes
+  @returns the Tid of the new thread, or NOTHREAD if the stack size is too large
+  */
+Tid_t CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -379,6 +553,146 @@ int ThreadDetach(Tid_t tid);
   */
 void ThreadExit(int exitval);
 
+/**
+  @brief Set the cores where a thread may run.
+
+  After this call, thread @c tid will only be scheduled on the cores
+  in @c mask. If the thread is running or waiting on a core outside 
+  the mask, it is moved to an allowed core. New threads (and the main
+  threads of new processes) inherit the affinity of the thread that 
+  creates them; the affinity of the first process is @c ALL_CORES. 
+  Bits of the mask which do not correspond to an existing core are 
+  ignored.
+
+  The tid can be the one returned by @c CreateThread or by 
+  @c ThreadSelf.
+
+  @param tid the thread, which must belong to the current process
+  @param mask the set of allowed cores
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no (unexited) thread with the given tid in this process.
+    - the mask contains no existing core.
+  */
+int SetThreadAffinity(Tid_t tid, cpumask_t mask);
+
+/**
+  @brief Return the set of cores where a thread may run.
+
+  @param tid the thread, which must belong to the current process
+  @returns the affinity mask of the thread, or 0 if there is no 
+    (unexited) thread with the given tid in this process.
+  @see SetThreadAffinity
+  */
+cpumask_t GetThreadAffinity(Tid_t tid);
+
+/**
+  @brief Set the priority of a thread.
+
+  A ready thread is never scheduled while a thread of higher priority 
+  is ready to run on the same core. Threads of equal priority share the
+  cores fairly between processes, in proportion to their weights (see
+  @c SetNice); a process which blocks often (e.g., for I/O) runs ahead of 
+  processes which use up their time slice. New threads (and the main 
+  threads of new processes) have priority @c DEFAULT_PRIORITY.
+
+  Note that a thread of high priority that never blocks can starve
+  the threads of lower priorities.
+
+  @param tid the thread, which must belong to the current process
+  @param priority the new priority, from 0 to @c THREAD_PRIORITIES-1
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no (unexited) thread with the given tid in this process.
+    - the priority is out of range.
+  */
+int SetPriority(Tid_t tid, int priority);
+
+/**
+  @brief Return the priority of a thread.
+
+  @param tid the thread, which must belong to the current process
+  @returns the priority of the thread, or -1 if there is no (unexited)
+    thread with the given tid in this process.
+  @see SetPriority
+  */
+int GetPriority(Tid_t tid);
+
+/**
+  @brief Make a thread periodic.
+
+  A periodic thread executes a job in every period, by a loop which 
+  calls @c WaitNextPeriod at the end of each job. Each job must complete
+  by the end of its period (its deadline) and is granted @c budget msec 
+  of execution time. While a job has budget left, the thread runs ahead
+  of all non-periodic threads, regardless of their priority; periodic 
+  threads run in order of deadline (Earliest Deadline First). When a job
+  exceeds its budget, the thread runs at its priority, until the end of 
+  the period.
+
+  The first period starts at once. A job that is not completed by its 
+  deadline counts as a missed deadline (see @c GetDeadlineMisses), and 
+  continues with the deadline and budget of the current period.
+
+  A set of periodic threads meets its deadlines when, for each core, the
+  sum of budget/period over the threads running on that core does not 
+  exceed 1 (see @c SetThreadAffinity), and the jobs stay within their budget.
+
+  @param tid the thread, which must belong to the current process
+  @param period the period in msec, or 0 to make the thread non-periodic
+  @param budget the execution time of each job in msec, at most @c period
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no (unexited) thread with the given tid in this process.
+    - the budget is 0 or larger than the period.
+  */
+int SetPeriodic(Tid_t tid, timeout_t period, timeout_t budget);
+
+/**
+  @brief End the current job of a periodic thread.
+
+  The calling thread sleeps until the start of its next period. If 
+  the deadline of the job has passed, the thread counts a missed
+  deadline and waits for the end of the current period.
+
+  @returns 0 on success, or -1 if the current thread is not periodic.
+  @see SetPeriodic
+  */
+int WaitNextPeriod(void);
+
+/**
+  @brief Return the number of deadlines missed by a thread.
+
+  @param tid the thread, which must belong to the current process
+  @returns the number of deadlines missed by the jobs of the thread, 
+    or -1 if there is no (unexited) thread with the given tid in this process.
+  @see SetPeriodic
+  */
+int GetDeadlineMisses(Tid_t tid);
+
+/**
+  @brief The CPU time accounting of a thread.
+  @see GetThreadInfo
+  */
+typedef struct threadinfo
+{
+  unsigned long run_time;       /**< @brief The execution time of the thread, in microseconds. */
+  unsigned long vol_switches;   /**< @brief Times the thread left its core because it blocked. */
+  unsigned long invol_switches; /**< @brief Times the thread left its core while ready to run 
+                (e.g., at the end of its quantum, or when preempted). */
+} threadinfo;
+
+/**
+  @brief Return the CPU time accounting of a thread.
+
+  The execution time is charged at each context switch, so the time of
+  the current slice of a running thread is not yet included.
+
+  @param tid the thread, which must belong to the current process
+  @param info the location where the accounting is stored
+  @returns 0 on success, or -1 if there is no (unexited) thread with the 
+    given tid in this process, or @c info is NULL.
+  @see OpenInfo
+  */
+int GetThreadInfo(Tid_t tid, threadinfo* info);
+
 
 
 /*******************************************
@@ -729,6 +1043,19 @@ typedef struct procinfo
   int alive;      /**< @brief Non-zero if process is alive, zero if process is zombie. */
 	
   unsigned long thread_count; /**< Current no of threads. */
+
+  unsigned long migrations; /**< @brief Times the threads of the process moved to another core. */
+
+  unsigned long deadline_misses; /**< @brief Deadlines missed by the periodic threads of the process. */
+
+  int nice;        /**< @brief The nice value of the process (see @c SetNice). */
+
+  unsigned long run_time; /**< @brief The execution time of the threads of the process, in microseconds. */
+
+  unsigned long vol_switches; /**< @brief Times the threads of the process left a core because they blocked. */
+
+  unsigned long invol_switches; /**< @brief Times the threads of the process left a core while ready to run
+                (e.g., at the end of their quantum). */
 	
   Task main_task;  /**< @brief The main task of the process. */
 	
@@ -766,6 +1093,230 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/**
+  @brief A struct containing the CPU time accounting of a core.
+
+  This structure is returned by core information streams.
+  @see OpenCoreInfo
+  */
+typedef struct coreinfo
+{
+  unsigned int core;            /**< @brief The core id. */
+  unsigned long busy_time;      /**< @brief Time spent running threads, in microseconds. */
+  unsigned long idle_time;      /**< @brief Time spent idle, in microseconds. */
+  unsigned long switches;       /**< @brief Context switches performed by the core. */
+  unsigned long invol_switches; /**< @brief Context switches away from a thread that was ready to run. */
+  unsigned long steals;         /**< @brief Threads the core stole from the queues of other cores. */
+  unsigned long migrations;     /**< @brief Threads that started running on the core after running on another. */
+  unsigned long balanced;       /**< @brief Threads the core moved to less loaded cores. */
+  unsigned long idle_halts;     /**< @brief Times the idle core halted, after polling for work in vain. */
+  unsigned long idle_spin_hits; /**< @brief Times the idle core found work while polling. */
+  unsigned long idle_wakeups;   /**< @brief Times the idle core started running a thread. */
+  unsigned long idle_latency;   /**< @brief Total time from the queueing of those threads until they ran, in microseconds. */
+  unsigned long idle_latency_max; /**< @brief The longest of those times, in microseconds. */
+} coreinfo;
+
+
+/**
+  @brief Open a core information stream.
+
+  This is a read-only stream that returns one @c coreinfo structure for
+  each core, in order of core id, each packed into a block of size 
+  @c sizeof(coreinfo). The counters are read without synchronization, 
+  and may be slightly out of date.
+
+  @returns a file id on success, or NOFILE on error. Possible reasons
+    for error are:
+    - the available file ids for the process are exhausted.
+ */
+Fid_t OpenCoreInfo();
+
+
+
+
+/*******************************************
+ *
+ * Asynchronous I/O
+ *
+ *******************************************/
+
+/** @brief The maximum number of entries of an I/O submission ring. */
+#define IO_RING_MAX_ENTRIES 4096
+
+/** @brief The operations of asynchronous I/O. */
+typedef enum {
+  IO_NOP,     /**< @brief Do nothing; the result is 0. */
+  IO_READ,    /**< @brief Read, as @c Read. */
+  IO_WRITE    /**< @brief Write, as @c Write, but possibly fewer bytes. */
+} io_opcode;
+
+/** 
+  @brief A submission queue entry: an I/O operation requested by the program.
+  */
+typedef struct io_sqe
+{
+  io_opcode opcode;       /**< @brief The operation. */
+  Fid_t fd;               /**< @brief The stream. */
+  char* buf;              /**< @brief The buffer, which must stay valid until the completion. */
+  unsigned int size;      /**< @brief The size of the buffer. */
+  uintptr_t user_data;    /**< @brief Copied to the completion, to identify the operation. */
+} io_sqe;
+
+/** 
+  @brief A completion queue entry: the result of an I/O operation.
+  */
+typedef struct io_cqe
+{
+  uintptr_t user_data;    /**< @brief The @c user_data of the operation. */
+  int res;                /**< @brief The result, as returned by @c Read or @c Write. */
+} io_cqe;
+
+/**
+  @brief The rings of asynchronous I/O of a process.
+
+  The program and the kernel share this object. The program queues 
+  operations at the tail of the submission ring @c sq, and the kernel
+  consumes them from its head. The kernel queues the results at the
+  tail of the completion ring @c cq, and the program consumes them from
+  its head. The indices grow without bound, and they are taken modulo
+  the number of entries, which is a power of 2. Each side publishes 
+  the index it advances with a release store, and reads the other
+  side's index with an acquire load. The functions @c IoQueue and 
+  @c IoReap of tinyoslib.h do this.
+
+  @see IoRingSetup
+  */
+typedef struct io_ring
+{
+  unsigned int sq_entries;  /**< @brief The number of entries of @c sq. */
+  unsigned int cq_entries;  /**< @brief The number of entries of @c cq, twice @c sq_entries. */
+  unsigned int sq_head;     /**< @brief Advanced by the kernel, as it consumes @c sq. */
+  unsigned int sq_tail;     /**< @brief Advanced by the program, as it fills @c sq. */
+  unsigned int cq_head;     /**< @brief Advanced by the program, as it consumes @c cq. */
+  unsigned int cq_tail;     /**< @brief Advanced by the kernel, as it fills @c cq. */
+  io_sqe* sq;               /**< @brief The submission ring. */
+  io_cqe* cq;               /**< @brief The completion ring. */
+} io_ring;
+
+
+/**
+  @brief Create the asynchronous I/O rings of the current process.
+
+  Asynchronous I/O lets a single thread have many operations in flight,
+  on any kind of stream (e.g., reading from many pipes or sockets at 
+  once), instead of using one thread per blocking @c Read or @c Write.
+
+  The operations are queued in the submission ring, and submitted to the
+  kernel by @c IoRingEnter. An operation that cannot proceed waits
+  in the kernel, without a thread, until its stream is ready. Then, it is 
+  completed the next time a thread of the process calls @c IoRingEnter,
+  and its result is queued in the completion ring.
+
+  A read completes as soon as some data is available, as @c Read. A
+  write completes as soon as some data can be written, so it may write
+  fewer bytes than requested; the program must submit the rest again.
+
+  Only pipes, sockets, the serial terminals and the null device support
+  asynchronous I/O. An operation on any other stream (e.g., the streams
+  of @c OpenInfo) completes with the result -1, rather than blocking 
+  the thread in @c IoRingEnter.
+
+  Each process may have one pair of rings, which lasts until it exits.
+  The operations in flight when the process exits are cancelled.
+
+  @param entries the number of entries of the submission ring, which
+     is rounded up to a power of 2.
+  @returns the rings, or NULL on error. Possible reasons for error are:
+    - the process already has the rings.
+    - @c entries is 0 or greater than @c IO_RING_MAX_ENTRIES.
+  */
+io_ring* IoRingSetup(unsigned int entries);
+
+/**
+  @brief Submit the queued operations, and wait for completions.
+
+  All the entries of the submission ring are submitted, as long as 
+  there is room for their results in the completion ring (counting the
+  operations in flight). Then, the call completes the operations whose
+  streams are ready, and, if fewer than @c min_complete results are in
+  the completion ring, waits for more.
+
+  The wait ends when @c min_complete results are available, when no
+  operations are in flight, or when the timeout expires.
+
+  Only one thread at a time enters the rings; other threads calling
+  this wait for it to return.
+
+  @param min_complete the number of results to wait for.
+  @param timeout the maximum time to wait, in milliseconds, or 
+    @c (timeout_t)-1 to wait without a timeout.
+  @returns the number of operations submitted, or -1 if the process has 
+     no rings.
+  */
+int IoRingEnter(unsigned int min_complete, timeout_t timeout);
+
+
+
+
+/*******************************************
+ *
+ * Batched system calls
+ *
+ *******************************************/
+
+/** @brief The maximum number of arguments of a system call in a batch. */
+#define SYSCALL_MAX_ARGS 4
+
+/**
+  @brief A system call in a batch.
+
+  The call is named by the address of its function, e.g., @c Write,
+  and its arguments are cast to @c intptr_t, in the order of the
+  function's parameters. For example,
+  @code
+  char buf[16];
+  syscall_desc batch[2] = {
+    { .call = Write, .args = { fid1, (intptr_t) "hello", 5 } },
+    { .call = Read,  .args = { fid2, (intptr_t) buf, sizeof(buf) } }
+  };
+  SyscallBatch(batch, 2);
+  @endcode
+
+  @see SyscallBatch
+  */
+typedef struct syscall_desc
+{
+  void* call;       /**< @brief The system call. */
+  intptr_t args[SYSCALL_MAX_ARGS]; /**< @brief The arguments; the unused ones are ignored. */
+  intptr_t ret;     /**< @brief The return value of the call, set by @c SyscallBatch. 
+                      It is 0 for calls that return @c void. */
+} syscall_desc;
+
+
+/**
+  @brief Execute a batch of system calls.
+
+  The calls are executed in order, with a single entry into the
+  kernel, and the return value of each one is stored in the @c ret
+  field of its descriptor. This saves the cost of entering the kernel
+  for each call, for programs that make many small calls, e.g., 
+  @c Read and @c Write of a few bytes.
+
+  The calls are executed as if made one after the other by the calling
+  thread; in particular, a call that blocks (e.g., a @c Read on an
+  empty pipe) blocks the batch, and a call to @c Exit or @c ThreadExit
+  ends it. A batch is not atomic: other threads may run between its calls.
+
+  The batch stops at the first descriptor whose @c call is not a system
+  call (or is NULL); the @c ret of that descriptor is set to -1.
+
+  @param calls the array of descriptors
+  @param n the number of descriptors in @c calls
+  @returns the number of calls executed.
+  */
+int SyscallBatch(syscall_desc* calls, unsigned int n);
+
+
 
 
 /*******************************************
@@ -166,3 +166,29 @@ int Execute(Program prog, size_t argc, const char** argv)
 	return Exec(exec_wrapper, argl, args);
 }
 
+
+
+int IoQueue(io_ring* ring, io_opcode opcode, Fid_t fd, char* buf, unsigned int size, uintptr_t user_data)
+{
+	unsigned int tail = ring->sq_tail;
+	if(tail - __atomic_load_n(& ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+		return -1;
+
+	ring->sq[tail & (ring->sq_entries-1)] = (io_sqe) {
+		.opcode = opcode, .fd = fd, .buf = buf, .size = size, .user_data = user_data
+	};
+	__atomic_store_n(& ring->sq_tail, tail+1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+int IoReap(io_ring* ring, io_cqe* cqe)
+{
+	unsigned int head = ring->cq_head;
+	if(head == __atomic_load_n(& ring->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	*cqe = ring->cq[head & (ring->cq_entries-1)];
+	__atomic_store_n(& ring->cq_head, head+1, __ATOMIC_RELEASE);
+	return 1;
+}
@@ -73,4 +73,24 @@ int Execute(Program prog, size_t argc, const char** argv);
 int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv );
 
 
+/**
+	@brief Queue an operation in the submission ring of asynchronous I/O.
+
+	The operation is submitted by the next call to @ref IoRingEnter.
+
+	@returns 0 on success, or -1 if the submission ring is full.
+	@see IoRingSetup
+*/
+int IoQueue(io_ring* ring, io_opcode opcode, Fid_t fd, char* buf, unsigned int size, uintptr_t user_data);
+
+/**
+	@brief Take a result from the completion ring of asynchronous I/O.
+
+	@returns 1 if a result was copied into @c cqe, or 0 if the 
+	   completion ring is empty.
+	@see IoRingSetup
+*/
+int IoReap(io_ring* ring, io_cqe* cqe);
+
+
 #endif
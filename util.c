@@ -43,3 +43,99 @@ void exception_unwind(exception_context context, int errcode)
 		raise_exception(context);
 }
 
+
+
+/*
+	Resource trees.
+
+	The priority of a node is a hash of its address; the treap keeps 
+	the node of the smallest priority at the root.
+*/
+static inline uintptr_t rt_priority(rtnode* n)
+{
+	return ((uintptr_t) n * 0x9E3779B97F4A7C15ul) >> 16;
+}
+
+/* Rotate x above its parent, keeping the order of the keys */
+static void rt_rotate_up(rtree* T, rtnode* x)
+{
+	rtnode* p = x->parent;
+	rtnode* g = p->parent;
+
+	if(p->left == x) {
+		p->left = x->right;
+		if(x->right) x->right->parent = p;
+		x->right = p;
+	} else {
+		p->right = x->left;
+		if(x->left) x->left->parent = p;
+		x->left = p;
+	}
+	p->parent = x;
+
+	x->parent = g;
+	if(g == NULL) T->root = x;
+	else if(g->left == p) g->left = x;
+	else g->right = x;
+}
+
+void rtree_insert(rtree* T, rtnode* n, unsigned long key)
+{
+	n->key = key;
+	n->left = n->right = NULL;
+
+	/* Insert as a leaf */
+	rtnode* p = NULL;
+	rtnode** link = & T->root;
+	int leftmost = 1;
+	while(*link) {
+		p = *link;
+		if(key < p->key)
+			link = & p->left;
+		else {
+			link = & p->right;
+			leftmost = 0;
+		}
+	}
+	*link = n;
+	n->parent = p;
+	if(leftmost) T->first = n;
+	T->size++;
+
+	/* Restore the heap order */
+	while(n->parent && rt_priority(n) < rt_priority(n->parent))
+		rt_rotate_up(T, n);
+}
+
+void rtree_remove(rtree* T, rtnode* n)
+{
+	if(T->first == n) T->first = rtree_next(n);
+
+	/* Rotate the node down, until it is a leaf */
+	while(n->left || n->right) {
+		rtnode* c;
+		if(n->left == NULL) c = n->right;
+		else if(n->right == NULL) c = n->left;
+		else c = (rt_priority(n->left) < rt_priority(n->right)) ? n->left : n->right;
+		rt_rotate_up(T, c);
+	}
+
+	rtnode* p = n->parent;
+	if(p == NULL) T->root = NULL;
+	else if(p->left == n) p->left = NULL;
+	else p->right = NULL;
+	n->parent = NULL;
+	T->size--;
+}
+
+rtnode* rtree_next(rtnode* n)
+{
+	if(n->right) {
+		n = n->right;
+		while(n->left) n = n->left;
+		return n;
+	}
+	while(n->parent && n->parent->right == n)
+		n = n->parent;
+	return n->parent;
+}
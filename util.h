@@ -601,6 +601,112 @@ static inline void rlist_select(rlnode* Lsrc, rlnode* Ldest, int (*pred)(rlnode*
 
 
 
+/**
+	@defgroup rtrees  Resource trees
+	@brief  An ordered tree of nodes with integer keys.
+
+	An @c rtree holds @c rtnode objects, ordered by an unsigned key 
+	which is given when the node is inserted. Nodes with equal keys 
+	are kept in the order of insertion. The node with the smallest key
+	is found in O(1) time, and insertion and removal of any node take 
+	O(log n) expected time. Like resource lists, resource trees are 
+	intrusive: the nodes are usually stored inside the objects that 
+	they hold, and the tree never allocates memory.
+
+	The tree is a treap: a binary search tree on the keys, which is 
+	also a heap on a pseudo-random priority of each node, computed 
+	from the node's address. 
+
+	For example, to visit the TCBs of a tree in key order,
+	@code
+	for(rtnode* n = rtree_first(&T); n != NULL; n = rtree_next(n))
+		do_something(n->tcb);
+	@endcode
+
+	@{
+ */
+
+/** @brief A convenience typedef */
+typedef struct resource_tree_node * rtnode_ptr;
+
+/**
+	@brief Tree node
+*/
+typedef struct resource_tree_node {
+
+  /** @brief The object held by the node, as in @c rlnode */
+  union {
+    PCB* pcb; 
+    TCB* tcb;
+    void* obj;
+    intptr_t num;
+    uintptr_t unum;
+  };
+
+  unsigned long key;   /**< @brief The key that orders the node in its tree */
+
+  /* tree pointers */
+  rtnode_ptr parent;   /**< @brief The parent node, or NULL for the root */
+  rtnode_ptr left;     /**< @brief The subtree of smaller keys */
+  rtnode_ptr right;    /**< @brief The subtree of larger (or equal) keys */
+} rtnode;
+
+/**
+	@brief An ordered tree
+*/
+typedef struct resource_tree {
+  rtnode_ptr root;     /**< @brief The root node, or NULL */
+  rtnode_ptr first;    /**< @brief The node of the smallest key, or NULL */
+  size_t size;         /**< @brief The number of nodes in the tree */
+} rtree;
+
+/** @brief Initialize an empty tree. */
+static inline void rtree_init(rtree* T)
+{
+	T->root = T->first = NULL;
+	T->size = 0;
+}
+
+/**
+	@brief Initialize a tree node, storing a pointer in it.
+	@returns the node itself
+*/
+static inline rtnode* rtnode_init(rtnode* n, void* ptr)
+{
+	n->obj = ptr;
+	n->parent = n->left = n->right = NULL;
+	return n;
+}
+
+/** @brief Check a tree for emptiness. */
+static inline int is_rtree_empty(rtree* T) { return T->root == NULL; }
+
+/** @brief Return the node of the smallest key (the first inserted among equal keys), or NULL. */
+static inline rtnode* rtree_first(rtree* T) { return T->first; }
+
+/**
+	@brief Insert a node into a tree.
+
+	The node is placed after all nodes with a key less than or equal to @c key.
+	@pre @c n is not in any tree
+*/
+void rtree_insert(rtree* T, rtnode* n, unsigned long key);
+
+/**
+	@brief Remove a node from a tree.
+	@pre @c n is in tree @c T
+*/
+void rtree_remove(rtree* T, rtnode* n);
+
+/**
+	@brief Return the node which follows a node in key order, or NULL.
+*/
+rtnode* rtree_next(rtnode* n);
+
+/* @} rtrees */
+
+
+
 /*
 	Some helpers for packing and unpacking vectors of strings into
 	(argl, args)
@@ -352,6 +352,37 @@ BOOT_TEST(test_orphans_adopted_by_init,
  *********************************************/
 
 
+static unsigned long tspec2msec(struct timespec t)
+{
+	return 1000ul*t.tv_sec + t.tv_nsec/1000000ul;
+}
+
+/* The real time, in msec */
+static unsigned long msec()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	return tspec2msec(t);
+}
+
+/* Sleep for t msec, without using the CPU */
+static void nap(timeout_t t)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, t);
+	Mutex_Unlock(&mx);
+}
+
+/* Run the current thread on core 0 (where its children run too), at the top priority */
+static void run_on_core0_at_top()
+{
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1)==0);
+	ASSERT(SetPriority(ThreadSelf(), THREAD_PRIORITIES-1)==0);
+}
+
+
 /*
 	Test that a timed wait on a condition variable terminates after the timeout.
  */
@@ -361,11 +392,6 @@ BOOT_TEST(test_cond_timedwait_timeout,
 	)
 {
 
-	unsigned long tspec2msec(struct timespec t)
-	{
-		return 1000ul*t.tv_sec + t.tv_nsec/1000000ul;
-	}
-
 	int do_timeout(int argl, void* args) {
 		timeout_t t = *((timeout_t *) args);
 
@@ -476,6 +502,226 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 }
 
 
+BOOT_TEST(test_cond_broadcast_signals_all,
+	"Test that a broadcast on a condition variable signals every waiter, "
+	"when there are more waiters than can be woken up in one batch."
+	)
+{
+	Mutex m = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	CondVar pcv = COND_INIT;
+	int waiting=0, go=0, signalled=0;
+
+	int waiter(int argl, void* args)
+	{
+		Mutex_Lock(&m);
+		waiting ++;
+		Cond_Signal(&pcv);
+		int sig = 1;
+		while(!go) sig = sig && Cond_Wait(&m, &cv);
+		signalled += sig;
+		Mutex_Unlock(&m);
+		return 0;
+	}
+
+	const int N=150;
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) tids[i] = CreateThread(waiter, 0, NULL);
+
+	Mutex_Lock(&m);
+	while(waiting!=N) Cond_Wait(&m, &pcv);
+	go = 1;
+	Cond_Broadcast(&cv);
+	Mutex_Unlock(&m);
+
+	/* Joining a thread that has exited already fails, which is fine here */
+	for(int i=0; i<N; i++) ThreadJoin(tids[i], NULL);
+	ASSERT(signalled == N);
+	return 0;
+}
+
+
+BOOT_TEST(test_cond_broadcast_pi,
+	"Test that the waiters of a broadcast with wait morphing are all signalled, "
+	"and return holding the mutex, one at a time."
+	)
+{
+	PIMutex mx = PIMUTEX_INIT;
+	CondVar cv = COND_INIT;
+	CondVar pcv = COND_INIT;
+	int waiting=0, go=0, signalled=0, inside=0, overlaps=0;
+
+	int waiter(int argl, void* args)
+	{
+		PIMutex_Lock(&mx);
+		waiting ++;
+		Cond_Signal(&pcv);
+		int sig = 1;
+		while(!go) sig = sig && Cond_WaitPI(&mx, &cv);
+		if(inside++) overlaps++;
+		signalled += sig;
+		for(volatile int i=0; i<1000; i++);
+		inside--;
+		PIMutex_Unlock(&mx);
+		return 0;
+	}
+
+	const int N=100;
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) tids[i] = CreateThread(waiter, 0, NULL);
+
+	PIMutex_Lock(&mx);
+	while(waiting!=N) Cond_WaitPI(&mx, &pcv);
+	go = 1;
+	Cond_BroadcastPI(&mx, &cv);
+	PIMutex_Unlock(&mx);
+
+	/* Joining a thread that has exited already fails, which is fine here */
+	for(int i=0; i<N; i++) ThreadJoin(tids[i], NULL);
+	ASSERT(signalled == N);
+	ASSERT(overlaps == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_mutex_contended,
+	"Test that a Mutex contended by many threads, some of which sleep waiting "
+	"for it, provides mutual exclusion."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	int counter=0, inside=0, overlaps=0;
+	const int N=20, M=2000;
+
+	int contender(int argl, void* args)
+	{
+		for(int j=0; j<M; j++) {
+			Mutex_Lock(&mx);
+			if(inside++) overlaps++;
+			int c = counter;
+			for(volatile int i=0; i<50; i++);
+			counter = c+1;
+			inside--;
+			Mutex_Unlock(&mx);
+		}
+		return 0;
+	}
+
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) tids[i] = CreateThread(contender, 0, NULL);
+
+	/* Joining a thread that has exited already fails, which is fine here */
+	for(int i=0; i<N; i++) ThreadJoin(tids[i], NULL);
+	ASSERT(counter == N*M);
+	ASSERT(overlaps == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_futex_wait_wake,
+	"Test that FutexWait does not sleep when the value differs, that it "
+	"times out, and that FutexWake wakes up at most the given number of waiters."
+	)
+{
+	int f = 0;
+	int woken = 0, started = 0;
+	const int N=5;
+
+	ASSERT(FutexWait(NULL, 0, -1) == -1);
+	ASSERT(FutexWake(NULL, 1) == -1);
+	ASSERT(FutexWait(&f, 1, -1) == -1);
+	ASSERT(FutexWake(&f, 10) == 0);
+
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_REALTIME, &t1);
+	ASSERT(FutexWait(&f, 0, 50) == -1);
+	clock_gettime(CLOCK_REALTIME, &t2);
+	ASSERT((t2.tv_sec-t1.tv_sec)*1000l + (t2.tv_nsec-t1.tv_nsec)/1000000l >= 40);
+
+	int waiter(int argl, void* args)
+	{
+		__atomic_add_fetch(&started, 1, __ATOMIC_SEQ_CST);
+		while(__atomic_load_n(&f, __ATOMIC_SEQ_CST) == 0)
+			FutexWait(&f, 0, -1);
+		__atomic_add_fetch(&woken, 1, __ATOMIC_SEQ_CST);
+		return 0;
+	}
+
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) tids[i] = CreateThread(waiter, 0, NULL);
+
+	/* Wait until they all sleep on the futex, then wake up two of them */
+	while(__atomic_load_n(&started, __ATOMIC_SEQ_CST) < N) ThreadSelf();
+	int total = 0;
+	while(total < 2) {
+		total += FutexWake(&f, 2-total);
+		if(total < 2) ThreadSelf();
+	}
+	ASSERT(total == 2);
+
+	/* Now, let them all go */
+	__atomic_store_n(&f, 1, __ATOMIC_SEQ_CST);
+	FutexWake(&f, N);
+
+	for(int i=0; i<N; i++) ThreadJoin(tids[i], NULL);
+	ASSERT(woken == N);
+	return 0;
+}
+
+
+BOOT_TEST(test_futex_lock,
+	"Test a lock built on a futex, contended by many threads, for mutual exclusion."
+	)
+{
+	/* The lock of "Futexes are tricky": 0 free, 1 locked, 2 locked with waiters */
+	int lock = 0;
+	int counter=0, inside=0, overlaps=0;
+	const int N=20, M=2000;
+
+	void futex_lock()
+	{
+		int c = 0;
+		if(__atomic_compare_exchange_n(&lock, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+		if(c != 2) c = __atomic_exchange_n(&lock, 2, __ATOMIC_ACQUIRE);
+		while(c != 0) {
+			FutexWait(&lock, 2, -1);
+			c = __atomic_exchange_n(&lock, 2, __ATOMIC_ACQUIRE);
+		}
+	}
+
+	void futex_unlock()
+	{
+		if(__atomic_fetch_sub(&lock, 1, __ATOMIC_RELEASE) != 1) {
+			__atomic_store_n(&lock, 0, __ATOMIC_RELEASE);
+			FutexWake(&lock, 1);
+		}
+	}
+
+	int contender(int argl, void* args)
+	{
+		for(int j=0; j<M; j++) {
+			futex_lock();
+			if(inside++) overlaps++;
+			int c = counter;
+			for(volatile int i=0; i<50; i++);
+			counter = c+1;
+			inside--;
+			futex_unlock();
+		}
+		return 0;
+	}
+
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) tids[i] = CreateThread(contender, 0, NULL);
+	for(int i=0; i<N; i++) ThreadJoin(tids[i], NULL);
+	ASSERT(counter == N*M);
+	ASSERT(overlaps == 0);
+	ASSERT(lock == 0);
+	return 0;
+}
+
+
 
 /*********************************************
  *
@@ -883,6 +1129,11 @@ TEST_SUITE(basic_tests,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
+	&test_cond_broadcast_signals_all,
+	&test_cond_broadcast_pi,
+	&test_mutex_contended,
+	&test_futex_wait_wake,
+	&test_futex_lock,
 	&test_null_device,
 	&test_get_terminals,
 	&test_open_terminals,
@@ -974,11 +1225,439 @@ BOOT_TEST(test_exit_many_threads,
 
 
 
+BOOT_TEST(test_create_thread_stack_size,
+	"Test that threads can be created with a given stack size, that the "
+	"stack can be used, and that an excessive stack size is rejected."
+	)
+{
+	/* Touch argl bytes of the stack */
+	int task(int argl, void* args) {
+		volatile char buffer[argl];
+		for(int i=0; i<argl; i+=512) buffer[i] = 1;
+		return buffer[0];
+	}
+
+	/* Stack sizes and the stack usage of the thread */
+	unsigned int stack[]  = { 0, 1, 64*1024, 1024*1024 };
+	int use[] = { 64*1024, 8*1024, 32*1024, 768*1024 };
+
+	for(int i=0; i<4; i++) {
+		Tid_t t = CreateThreadStack(task, use[i], NULL, stack[i]);
+		ASSERT(t!=NOTHREAD);
+		int exitval;
+		ASSERT(ThreadJoin(t, &exitval)==0);
+		ASSERT(exitval==1);
+	}
+
+	ASSERT(CreateThreadStack(task, 0, NULL, 1u<<31)==NOTHREAD);
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_affinity,
+	"Test that the affinity of threads can be set and read, that it is "
+	"respected by the scheduler, and that illegal calls fail."
+	)
+{
+	uint ncores = cpu_cores();
+	uint last = ncores-1;
+
+	/* Check that the thread stays on the core, while sleeping repeatedly */
+	int pinned(int argl, void* args) {
+		Mutex mx = MUTEX_INIT;
+		CondVar cv = COND_INIT;
+		while(GetThreadAffinity(ThreadSelf()) != 1u<<argl) {
+			Mutex_Lock(&mx);
+			Cond_TimedWait(&mx, &cv, 1);
+			Mutex_Unlock(&mx);
+		}
+		for(int i=0; i<20; i++) {
+			Mutex_Lock(&mx);
+			Cond_TimedWait(&mx, &cv, 1);
+			Mutex_Unlock(&mx);
+			if(cpu_core_id != argl) return -1;
+		}
+		return 0;
+	}
+
+	ASSERT(GetThreadAffinity(ThreadSelf())==ALL_CORES);
+
+	/* Pin myself */
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1u<<last)==0);
+	ASSERT(GetThreadAffinity(ThreadSelf())==1u<<last);
+	ASSERT(pinned(last, NULL)==0);
+	ASSERT(SetThreadAffinity(ThreadSelf(), ALL_CORES)==0);
+
+	/* Pin new threads, one per core */
+	int result[ncores];
+	int pinned_thread(int argl, void* args) {
+		result[argl] = pinned(argl, args);
+		return 0;
+	}
+	Tid_t t[ncores];
+	for(uint c=0; c<ncores; c++) {
+		result[c] = -2;
+		t[c] = CreateThread(pinned_thread, c, NULL);
+		ASSERT(SetThreadAffinity(t[c], 1u<<c)==0);
+		ASSERT(GetThreadAffinity(t[c])==1u<<c);
+	}
+	for(uint c=0; c<ncores; c++) {
+		ThreadJoin(t[c], NULL);
+		ASSERT(result[c]==0);
+	}
+
+	/* Illegal calls */
+	ASSERT(SetThreadAffinity(ThreadSelf(), 0)==-1);
+	if(ncores < 32)
+		ASSERT(SetThreadAffinity(ThreadSelf(), ~((1u<<ncores)-1))==-1);
+	ASSERT(SetThreadAffinity(NOTHREAD, ALL_CORES)==-1);
+	ASSERT(GetThreadAffinity(NOTHREAD)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_priority,
+	"Test that the priority of threads can be set and read, that ready "
+	"threads of higher priority run first, and that illegal calls fail."
+	)
+{
+	ASSERT(GetPriority(ThreadSelf())==DEFAULT_PRIORITY);
+	ASSERT(SetPriority(ThreadSelf(), -1)==-1);
+	ASSERT(SetPriority(ThreadSelf(), THREAD_PRIORITIES)==-1);
+	ASSERT(SetPriority(NOTHREAD, 0)==-1);
+	ASSERT(GetPriority(NOTHREAD)==-1);
+
+	run_on_core0_at_top();
+	ASSERT(GetPriority(ThreadSelf())==THREAD_PRIORITIES-1);
+
+	/* Each thread records its place in the order of execution */
+	int order[THREAD_PRIORITIES-1];
+	int n = 0;
+	int record(int argl, void* args) {
+		order[n++] = argl;
+		return 0;
+	}
+
+	/* Create threads of increasing priority; they wait, since we have the top priority */
+	Tid_t t[THREAD_PRIORITIES-1];
+	for(int p=0; p<THREAD_PRIORITIES-1; p++) {
+		t[p] = CreateThread(record, p, NULL);
+		ASSERT(GetPriority(t[p])==DEFAULT_PRIORITY);
+		ASSERT(SetPriority(t[p], p)==0);
+		ASSERT(GetPriority(t[p])==p);
+	}
+	ASSERT(n==0);
+
+	for(int p=0; p<THREAD_PRIORITIES-1; p++)
+		ThreadJoin(t[p], NULL);
+
+	/* They ran in the order of decreasing priority */
+	ASSERT(n==THREAD_PRIORITIES-1);
+	for(int i=0; i<n; i++)
+		ASSERT(order[i] == THREAD_PRIORITIES-2-i);
+	return 0;
+}
+
+
+BOOT_TEST(test_priority_inheritance,
+	"Test that a thread of high priority, which waits for a PIMutex held by "
+	"a thread of low priority, is not delayed indefinitely by CPU-bound "
+	"threads of middle priority.",
+	.timeout = 20
+	)
+{
+	PIMutex mx = PIMUTEX_INIT;
+	volatile int locked = 0;
+	volatile int hogs_done = 0;
+
+	/* Hold the mutex while computing for 20 msec (of real time) */
+	int low(int argl, void* args) {
+		PIMutex_Lock(&mx);
+		locked = 1;
+		unsigned long t0 = msec();
+		while(msec() < t0+20);
+		PIMutex_Unlock(&mx);
+		return 0;
+	}
+
+	/* Compute until the test is over, but at most for 2 sec */
+	int hog(int argl, void* args) {
+		unsigned long t0 = msec();
+		while(!hogs_done && msec() < t0+2000);
+		return 0;
+	}
+
+	run_on_core0_at_top();
+
+	Tid_t tlow = CreateThread(low, 0, NULL);
+	ASSERT(SetPriority(tlow, 0)==0);
+	while(!locked) nap(1);
+
+	Tid_t thog[2];
+	for(int i=0; i<2; i++) {
+		thog[i] = CreateThread(hog, 0, NULL);
+		ASSERT(SetPriority(thog[i], THREAD_PRIORITIES-2)==0);
+	}
+
+	/* Without inheritance, the holder would not run until the hogs quit */
+	unsigned long t0 = msec();
+	PIMutex_Lock(&mx);
+	unsigned long wait = msec()-t0;
+	PIMutex_Unlock(&mx);
+	hogs_done = 1;
+
+	ThreadJoin(tlow, NULL);
+	for(int i=0; i<2; i++)
+		ThreadJoin(thog[i], NULL);
+
+	MSG("waited %lu msec for the mutex\n", wait);
+	ASSERT(wait < 500);
+	return 0;
+}
+
+
+BOOT_TEST(test_periodic_threads,
+	"Test that periodic threads meet their deadlines, while a CPU-bound "
+	"thread of top priority runs on the same core, and that a job which "
+	"overruns its budget misses its deadline, without starving other threads.",
+	.timeout = 20
+	)
+{
+	volatile int hogs_done = 0;
+	volatile unsigned long hog_count = 0;
+
+	/* Compute until the test is over, but at most for 5 sec */
+	int hog(int argl, void* args) {
+		unsigned long t0 = msec();
+		while(!hogs_done && msec() < t0+5000) hog_count++;
+		return 0;
+	}
+
+	/* Run 10 jobs which compute for argl msec */
+	int periodic(int argl, void* args) {
+		int* misses = args;
+		for(int i=0; i<10; i++) {
+			unsigned long t0 = msec();
+			while(msec() < t0+argl);
+			ASSERT(WaitNextPeriod()==0);
+		}
+		*misses = GetDeadlineMisses(ThreadSelf());
+		return 0;
+	}
+
+	ASSERT(SetPeriodic(ThreadSelf(), 10, 20)==-1);
+	ASSERT(SetPeriodic(ThreadSelf(), 10, 0)==-1);
+	ASSERT(WaitNextPeriod()==-1);
+
+	/* The hog has the top priority, like us */
+	run_on_core0_at_top();
+	Tid_t thog = CreateThread(hog, 0, NULL);
+	ASSERT(SetPriority(thog, THREAD_PRIORITIES-1)==0);
+
+	/* Two threads whose jobs need 2 msec, within their budget of 5 msec per 20 */
+	int misses[3] = { -1, -1, -1 };
+	Tid_t t[2];
+	for(int i=0; i<2; i++) {
+		t[i] = CreateThread(periodic, 2, &misses[i]);
+		ASSERT(SetPeriodic(t[i], 20, 5)==0);
+	}
+	for(int i=0; i<2; i++) {
+		ThreadJoin(t[i], NULL);
+		ASSERT(misses[i]==0);
+	}
+
+	/* A thread whose jobs need 30 msec, more than their budget and their period */
+	Tid_t tover = CreateThread(periodic, 30, &misses[2]);
+	ASSERT(SetPeriodic(tover, 20, 5)==0);
+	unsigned long count = hog_count;
+	nap(100);
+
+	/* The thread misses its deadlines, but does not take over the core */
+	ASSERT(GetDeadlineMisses(tover) > 0);
+	ASSERT(hog_count > count);
+
+	hogs_done = 1;
+	ThreadJoin(tover, NULL);
+	ThreadJoin(thog, NULL);
+	ASSERT(misses[2] > 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_fair_share,
+	"Test that processes of equal priority share a core fairly, regardless "
+	"of their number of threads, and that illegal calls to SetNice fail."
+	)
+{
+	ASSERT(SetNice(GetPid(), NICE_MIN-1)==-1);
+	ASSERT(SetNice(GetPid(), NICE_MAX+1)==-1);
+	ASSERT(SetNice(NOPROC, 0)==-1);
+	ASSERT(SetNice(GetPPid(), 0)==-1);
+	ASSERT(SetNice(GetPid(), 0)==0);
+
+	/* We sample at the top priority */
+	run_on_core0_at_top();
+
+	volatile int done = 0;
+	unsigned long count[2] = { 0, 0 };
+	int spin(int argl, void* args) {
+		while(! done) 
+			__atomic_fetch_add(& count[argl], 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	/* Process 0 has many threads, process 1 has one */
+	int spinners(int argl, void* args) {
+		Tid_t t[4];
+		int n = (argl==0) ? 4 : 0;
+		for(int i=0; i<n; i++) t[i] = CreateThread(spin, argl, NULL);
+		spin(argl, NULL);
+		for(int i=0; i<n; i++) ThreadJoin(t[i], NULL);
+		return 0;
+	}
+
+	Pid_t many = Exec(spinners, 0, NULL);
+	Pid_t one = Exec(spinners, 1, NULL);
+	ASSERT(SetNice(many, 0)==0);
+	ASSERT(SetNice(one, 0)==0);
+
+	nap(500);
+	unsigned long c0 = count[0], c1 = count[1];
+	done = 1;
+	WaitChild(many, NULL);
+	WaitChild(one, NULL);
+
+	/* Round robin between threads would give process 1 only a fifth */
+	ASSERT_MSG(c1 > (c0+c1)/3, "share of the single-thread process: %lu/%lu\n", c1, c0+c1);
+	return 0;
+}
+
+
+BOOT_TEST(test_feedback_within_process,
+	"Test that a thread which sleeps at a pipe is not queued behind the "
+	"CPU-bound threads of its own process.",
+	.timeout = 20
+	)
+{
+	/* We write at the top priority */
+	run_on_core0_at_top();
+
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	volatile int done = 0;
+	int hog(int argl, void* args) {
+		unsigned long t0 = msec();
+		while(!done && msec() < t0+5000);
+		return 0;
+	}
+
+	/* Count the messages received within 5 msec of their sending */
+	int prompt = 0;
+	int reader(int argl, void* args) {
+		unsigned long sent;
+		while(Read(pipe.read, (char*) &sent, sizeof(sent)) == sizeof(sent))
+			if(msec() < sent+5) prompt++;
+		return 0;
+	}
+
+	Tid_t thog[3];
+	for(int i=0; i<3; i++)
+		thog[i] = CreateThread(hog, 0, NULL);
+	Tid_t tr = CreateThread(reader, 0, NULL);
+
+	/* Let the hogs sink to the lowest level */
+	nap(200);
+
+	for(int i=0; i<20; i++) {
+		nap(5);
+		unsigned long now = msec();
+		ASSERT(Write(pipe.write, (char*) &now, sizeof(now)) == sizeof(now));
+	}
+	Close(pipe.write);
+	ThreadJoin(tr, NULL);
+	done = 1;
+	for(int i=0; i<3; i++)
+		ThreadJoin(thog[i], NULL);
+	Close(pipe.read);
+
+	/* Without the feedback levels, the reader would wait for the hogs every time */
+	ASSERT_MSG(prompt >= 10, "prompt messages: %d/20\n", prompt);
+	return 0;
+}
+
+
+BOOT_TEST(test_cpu_accounting,
+	"Test that the execution time and the context switches of threads, "
+	"processes and cores are accounted, and reported by the info streams."
+	)
+{
+	threadinfo tinfo;
+	ASSERT(GetThreadInfo(NOTHREAD, &tinfo)==-1);
+	ASSERT(GetThreadInfo(ThreadSelf(), NULL)==-1);
+
+	/* A thread that computes and a thread that sleeps report their accounting */
+	threadinfo info[2];
+	int compute(int argl, void* args) {
+		for(volatile long i=0; i<20000000; i++);
+		nap(1);   /* Be charged for the last slice */
+		return GetThreadInfo(ThreadSelf(), & info[argl]);
+	}
+	int sleeper(int argl, void* args) {
+		for(int i=0; i<5; i++) nap(2);
+		return GetThreadInfo(ThreadSelf(), & info[argl]);
+	}
+	Tid_t tc = CreateThread(compute, 0, NULL);
+	Tid_t ts = CreateThread(sleeper, 1, NULL);
+	ThreadJoin(tc, NULL);
+	ThreadJoin(ts, NULL);
+
+	ASSERT(info[0].run_time > info[1].run_time);
+	ASSERT(info[0].vol_switches >= 1);
+	ASSERT(info[1].vol_switches >= 5);
+
+	/* The process is charged for its threads */
+	procinfo pinfo;
+	int found = 0;
+	Fid_t fid = OpenInfo();
+	while(Read(fid, (char*) &pinfo, sizeof(pinfo)) > 0)
+		if(pinfo.pid == GetPid()) { found = 1; break; }
+	Close(fid);
+	ASSERT(found);
+	ASSERT(pinfo.run_time >= info[0].run_time + info[1].run_time);
+	ASSERT(pinfo.vol_switches >= info[0].vol_switches + info[1].vol_switches);
+
+	/* Each core reports once, and the cores have done some work */
+	coreinfo cinfo;
+	uint ncores = 0;
+	unsigned long busy = 0, switches = 0;
+	fid = OpenCoreInfo();
+	while(Read(fid, (char*) &cinfo, sizeof(cinfo)) > 0) {
+		ASSERT(cinfo.core == ncores);
+		ncores++;
+		busy += cinfo.busy_time;
+		switches += cinfo.switches;
+	}
+	Close(fid);
+	ASSERT(ncores == cpu_cores());
+	ASSERT(busy >= info[0].run_time);
+	ASSERT(switches >= info[0].vol_switches + info[1].vol_switches);
+	return 0;
+}
+
+
 TEST_SUITE(thread_tests, 
 	"A suite of tests for threads."
 	)
 {
 	&test_create_join_thread,
+	&test_create_thread_stack_size,
+	&test_thread_affinity,
+	&test_thread_priority,
+	&test_priority_inheritance,
+	&test_periodic_threads,
+	&test_fair_share,
+	&test_feedback_within_process,
+	&test_cpu_accounting,
 	&test_exit_many_threads,
 	NULL
 };
@@ -1025,6 +1704,156 @@ BOOT_TEST(test_pipe_open,
 }
 
 
+BOOT_TEST(test_syscall_batch,
+	"Test that SyscallBatch executes the calls in order, and stops at a call that is not a system call."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	char buffer[12] = { [0] = 0 };
+	syscall_desc batch[] = {
+		{ .call = Write, .args = { pipe.write, (intptr_t) "Hello world", 12 } },
+		{ .call = GetPid },
+		{ .call = Read, .args = { pipe.read, (intptr_t) buffer, 12 } },
+		{ .call = Close, .args = { pipe.write } },
+		{ .call = Read, .args = { pipe.read, (intptr_t) buffer, 12 } },
+		{ .call = Close, .args = { NOFILE } },
+		{ .call = ThreadExit },  /* not reached */
+	};
+
+	ASSERT(SyscallBatch(batch, 6)==6);
+	ASSERT(batch[0].ret==12);
+	ASSERT(batch[1].ret==GetPid());
+	ASSERT(batch[2].ret==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+	ASSERT(batch[3].ret==0);
+	ASSERT(batch[4].ret==0);
+	ASSERT(batch[5].ret==-1);
+
+	/* A batch stops at a descriptor that is not a system call */
+	syscall_desc bad[] = {
+		{ .call = GetPid },
+		{ .call = strcmp },
+		{ .call = GetPid, .ret = 42 }
+	};
+	ASSERT(SyscallBatch(bad, 3)==1);
+	ASSERT(bad[1].ret==-1);
+	ASSERT(bad[2].ret==42);
+
+	/* ... or at a NULL call */
+	syscall_desc null_call[] = {
+		{ .call = NULL },
+		{ .call = GetPid, .ret = 42 }
+	};
+	ASSERT(SyscallBatch(null_call, 2)==0);
+	ASSERT(null_call[0].ret==-1);
+	ASSERT(null_call[1].ret==42);
+
+	/* Batches nest */
+	syscall_desc outer[] = {
+		{ .call = SyscallBatch, .args = { (intptr_t) bad, 1 } }
+	};
+	ASSERT(SyscallBatch(outer, 1)==1);
+	ASSERT(outer[0].ret==1);
+
+	return 0;
+}
+
+
+static int ioring_late_writer(int argl, void* args)
+{
+	Fid_t fd = *(Fid_t*)args;
+
+	/* Let the reader wait first */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 20);
+	Mutex_Unlock(&mx);
+
+	ASSERT(Write(fd, "late", 5)==5);
+	return 0;
+}
+
+BOOT_TEST(test_ioring_pipes,
+	"Test asynchronous reads and writes on pipes, through the I/O rings."
+	)
+{
+	io_ring* ring = IoRingSetup(5);
+	ASSERT(ring!=NULL);
+	ASSERT(ring->sq_entries==8 && ring->cq_entries==16);
+	ASSERT(IoRingSetup(5)==NULL);
+
+	pipe_t pipe[4];
+	char buf[4][16];
+	for(int i=0; i<4; i++)
+		ASSERT(Pipe(&pipe[i])==0);
+
+	/* Reads on empty pipes wait in the kernel */
+	for(int i=0; i<4; i++)
+		ASSERT(IoQueue(ring, IO_READ, pipe[i].read, buf[i], 16, i)==0);
+	ASSERT(IoRingEnter(0, 0)==4);
+	io_cqe cqe;
+	ASSERT(IoReap(ring, &cqe)==0);
+
+	for(int i=3; i>=0; i--) {
+		char msg[8];
+		sprintf(msg, "pipe %d", i);
+		ASSERT(Write(pipe[i].write, msg, 7)==7);
+	}
+	ASSERT(IoRingEnter(4, -1)==0);
+	int seen = 0;
+	while(IoReap(ring, &cqe)) {
+		char msg[8];
+		sprintf(msg, "pipe %d", (int)cqe.user_data);
+		ASSERT(cqe.res==7);
+		ASSERT(strcmp(buf[cqe.user_data], msg)==0);
+		seen |= 1<<cqe.user_data;
+	}
+	ASSERT(seen==15);
+
+	/* A write, a read, a nop, a bad fid and EOF */
+	ASSERT(Close(pipe[1].write)==0);
+	ASSERT(IoQueue(ring, IO_WRITE, pipe[0].write, "hello", 6, 10)==0);
+	ASSERT(IoQueue(ring, IO_READ, pipe[0].read, buf[0], 16, 11)==0);
+	ASSERT(IoQueue(ring, IO_NOP, NOFILE, NULL, 0, 12)==0);
+	ASSERT(IoQueue(ring, IO_READ, NOFILE, buf[0], 16, 13)==0);
+	ASSERT(IoQueue(ring, IO_READ, pipe[1].read, buf[1], 16, 14)==0);
+	ASSERT(IoRingEnter(5, -1)==5);
+	int expected[5] = { 6, 6, 0, -1, 0 };
+	for(int i=0; i<5; i++) {
+		ASSERT(IoReap(ring, &cqe)==1);
+		ASSERT(cqe.user_data==10+i);
+		ASSERT(cqe.res==expected[i]);
+	}
+	ASSERT(strcmp(buf[0], "hello")==0);
+
+	/* A stream without asynchronous I/O fails, rather than block */
+	Fid_t info = OpenInfo();
+	ASSERT(IoQueue(ring, IO_READ, info, buf[0], 16, 15)==0);
+	ASSERT(IoRingEnter(1, -1)==1);
+	ASSERT(IoReap(ring, &cqe)==1);
+	ASSERT(cqe.user_data==15 && cqe.res==-1);
+	Close(info);
+
+	/* A thread that writes later wakes up the ring */
+	Tid_t t = CreateThread(ioring_late_writer, sizeof(Fid_t), &pipe[2].write);
+	ASSERT(IoQueue(ring, IO_READ, pipe[2].read, buf[2], 16, 20)==0);
+	ASSERT(IoRingEnter(1, -1)==1);
+	ASSERT(IoReap(ring, &cqe)==1);
+	ASSERT(cqe.user_data==20 && cqe.res==5 && strcmp(buf[2], "late")==0);
+	ThreadJoin(t, NULL);
+
+	/* A timeout; the read is cancelled when the process exits */
+	ASSERT(IoQueue(ring, IO_READ, pipe[3].read, buf[3], 16, 30)==0);
+	ASSERT(IoRingEnter(1, 20)==1);
+	ASSERT(IoReap(ring, &cqe)==0);
+
+	return 0;
+}
+
+
 BOOT_TEST(test_pipe_fails_on_exhausted_fid,
 	"Test that Pipe will fail if the fids are exhausted."
 	)
@@ -1210,6 +2039,8 @@ TEST_SUITE(pipe_tests,
 	)
 {
 	&test_pipe_open,
+	&test_syscall_batch,
+	&test_ioring_pipes,
 	&test_pipe_fails_on_exhausted_fid,
 	&test_pipe_close_reader,
 	&test_pipe_close_writer,